@@ -0,0 +1,100 @@
+/*
+ * Arena.hpp
+ *
+ * Bump allocator for the per-thread scratch state of the algorithm. Memory
+ * handed out by an arena is released all at once by Reset, which keeps the
+ * underlying blocks, so that a steady state of tiles and calls with the same
+ * sizes does not touch the system allocator.
+ */
+
+#ifndef DA3D_ARENA_HPP_
+#define DA3D_ARENA_HPP_
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+namespace da3d {
+
+class Arena {
+ public:
+  Arena() = default;
+  ~Arena();
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  // returns uninitialized storage for count floats, aligned to kAlignment
+  float *Allocate(std::size_t count);
+  // makes all the memory available again, without freeing it
+  void Reset();
+
+  std::size_t capacity() const;  // in floats
+  std::size_t used() const { return used_; }  // in floats, since last Reset
+
+  static constexpr std::size_t kAlignment = 64;  // bytes
+
+ private:
+  struct Block {
+    void *raw;
+    float *data;
+    std::size_t size;
+  };
+  static Block NewBlock(std::size_t size);
+
+  std::vector<Block> blocks_{};
+  std::size_t offset_{0};  // first free float in the last block
+  std::size_t used_{0};
+};
+
+inline Arena::~Arena() {
+  for (Block &b : blocks_) std::free(b.raw);
+}
+
+inline Arena::Block Arena::NewBlock(std::size_t size) {
+  void *raw = std::malloc(size * sizeof(float) + kAlignment);
+  if (!raw) throw std::bad_alloc();
+  std::uintptr_t p = reinterpret_cast<std::uintptr_t>(raw);
+  p = (p + kAlignment - 1) / kAlignment * kAlignment;
+  return {raw, reinterpret_cast<float *>(p), size};
+}
+
+inline float *Arena::Allocate(std::size_t count) {
+  constexpr std::size_t step = kAlignment / sizeof(float);
+  count = (count + step - 1) / step * step;
+  if (blocks_.empty() || offset_ + count > blocks_.back().size) {
+    std::size_t size = blocks_.empty() ? 0 : 2 * blocks_.back().size;
+    blocks_.push_back(NewBlock(size > count ? size : count));
+    offset_ = 0;
+  }
+  float *ptr = blocks_.back().data + offset_;
+  offset_ += count;
+  used_ += count;
+  return ptr;
+}
+
+inline void Arena::Reset() {
+  // If the last cycle needed more than one block, replace them with a single
+  // one large enough for the whole cycle.
+  if (blocks_.size() > 1) {
+    std::size_t total = capacity();
+    for (Block &b : blocks_) std::free(b.raw);
+    blocks_.clear();
+    blocks_.push_back(NewBlock(total));
+  }
+  offset_ = 0;
+  used_ = 0;
+}
+
+inline std::size_t Arena::capacity() const {
+  std::size_t total = 0;
+  for (const Block &b : blocks_) total += b.size;
+  return total;
+}
+
+}  // namespace da3d
+
+#endif  // DA3D_ARENA_HPP_
@@ -0,0 +1,266 @@
+/*
+ * Cache.cpp
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <tuple>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utime.h>
+#include "Cache.hpp"
+#include "Utils.hpp"
+
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace da3d {
+
+namespace {
+
+const uint32_t kMagic = 0xda3dcac1;
+const char kSuffix[] = ".da3d";
+
+bool EndsWith(const string &s, const char *suffix) {
+  size_t n = std::strlen(suffix);
+  return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+}  // namespace
+
+ResultCache::ResultCache(const string &directory, size_t max_bytes)
+    : directory_(directory), max_bytes_(max_bytes) {
+  mkdir(directory_.c_str(), 0755);
+  // the entries already there, most recently used first
+  vector<std::tuple<time_t, string, size_t>> found;
+  if (DIR *dir = opendir(directory_.c_str())) {
+    while (dirent *entry = readdir(dir)) {
+      string name = entry->d_name;
+      struct stat st;
+      if (!EndsWith(name, kSuffix) ||
+          stat((directory_ + "/" + name).c_str(), &st) != 0) {
+        continue;
+      }
+      found.emplace_back(st.st_mtime,
+                         name.substr(0, name.size() - strlen(kSuffix)),
+                         st.st_size);
+    }
+    closedir(dir);
+  }
+  std::sort(found.rbegin(), found.rend());
+  for (const auto &entry : found) {
+    lru_.push_back(std::get<1>(entry));
+    index_[lru_.back()] = {std::prev(lru_.end()), std::get<2>(entry)};
+    bytes_ += std::get<2>(entry);
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  Evict();
+}
+
+bool ResultCache::Load(const string &key, const vector<Shape> &shapes,
+                       vector<Image> *images) {
+  // the size of the file written by Store for these shapes
+  size_t bytes = sizeof(uint32_t) * 2;
+  for (const Shape &shape : shapes) {
+    bytes += sizeof(int32_t) * 3 + sizeof(float) *
+             static_cast<size_t>(shape.rows) * shape.columns * shape.channels;
+  }
+  const string path = Path(key);
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file) return false;
+  struct stat st;
+  uint32_t header[2];
+  bool ok = fstat(fileno(file), &st) == 0 &&
+            static_cast<size_t>(st.st_size) == bytes &&
+            fread(header, sizeof(header), 1, file) == 1 &&
+            header[0] == kMagic && header[1] == shapes.size();
+  images->resize(ok ? shapes.size() : 0);
+  for (size_t i = 0; ok && i < shapes.size(); ++i) {
+    const Shape &expected = shapes[i];
+    int32_t shape[3];
+    ok = fread(shape, sizeof(shape), 1, file) == 1 &&
+         shape[0] == expected.rows && shape[1] == expected.columns &&
+         shape[2] == expected.channels;
+    if (!ok) break;
+    Image &image = (*images)[i];
+    image.Resize(shape[0], shape[1], shape[2]);
+    ok = fread(image.data(), sizeof(float), image.samples(), file) ==
+         static_cast<size_t>(image.samples());
+  }
+  fclose(file);
+  if (!ok) return false;
+  utime(path.c_str(), nullptr);  // keeps the order for the next processes
+  std::lock_guard<std::mutex> lock(mutex_);
+  Touch(key, bytes);
+  return true;
+}
+
+void ResultCache::Store(const string &key,
+                        const vector<const Image *> &images) {
+  static std::atomic<int> counter(0);
+  const string path = Path(key);
+  // written aside and renamed, so that readers never see partial entries
+  const string temporary = path + ".tmp" + std::to_string(getpid()) + "-" +
+                           std::to_string(counter++);
+  FILE *file = fopen(temporary.c_str(), "wb");
+  if (!file) return;
+  uint32_t header[2] = {kMagic, static_cast<uint32_t>(images.size())};
+  bool ok = fwrite(header, sizeof(header), 1, file) == 1;
+  size_t bytes = sizeof(header);
+  for (const Image *image : images) {
+    int32_t shape[3] = {image->rows(), image->columns(), image->channels()};
+    ok = ok && fwrite(shape, sizeof(shape), 1, file) == 1 &&
+         fwrite(image->data(), sizeof(float), image->samples(), file) ==
+             static_cast<size_t>(image->samples());
+    bytes += sizeof(shape) + sizeof(float) * image->samples();
+  }
+  ok = (fclose(file) == 0) && ok &&
+       rename(temporary.c_str(), path.c_str()) == 0;
+  if (!ok) {
+    unlink(temporary.c_str());
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  Touch(key, bytes);
+  Evict();
+}
+
+void ResultCache::Count(bool tile, bool hit) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (tile) {
+    ++(hit ? stats_.tile_hits : stats_.tile_misses);
+  } else {
+    ++(hit ? stats_.hits : stats_.misses);
+  }
+}
+
+ResultCache::Stats ResultCache::stats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+size_t ResultCache::bytes() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return bytes_;
+}
+
+int ResultCache::entries() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return static_cast<int>(index_.size());
+}
+
+string ResultCache::Path(const string &key) const {
+  return directory_ + "/" + key + kSuffix;
+}
+
+void ResultCache::Touch(const string &key, size_t bytes) {
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    bytes_ -= it->second.second;
+    lru_.erase(it->second.first);
+  }
+  lru_.push_front(key);
+  index_[key] = {lru_.begin(), bytes};
+  bytes_ += bytes;
+}
+
+void ResultCache::Evict() {
+  // the newest entry stays, even if it alone exceeds the limit
+  while (bytes_ > max_bytes_ && lru_.size() > 1) {
+    const string key = lru_.back();
+    unlink(Path(key).c_str());
+    bytes_ -= index_[key].second;
+    index_.erase(key);
+    lru_.pop_back();
+    ++stats_.evictions;
+  }
+}
+
+bool DenoiseCached(Denoiser *denoiser, ResultCache *cache,
+                   ConstImageView noisy, ConstImageView guide, float sigma,
+                   ImageView out) {
+  assert(out.shape() == guide.shape() && out.channels() == guide.channels());
+  const Parameters &params = denoiser->parameters();
+  if (params.engine == Engine::kSharedMap) {
+    // the patches depend on the timing of the threads: nothing to reuse
+    return denoiser->Denoise(noisy, guide, sigma, out);
+  }
+  ContentHash hash;
+  HashParameters(params, denoiser->nthreads(), &hash);
+  hash.Add(sigma);
+  ContentHash image_hash = hash;
+  image_hash.Add(noisy);
+  image_hash.Add(guide);
+  const string key = image_hash.Hex();
+  vector<Image> cached;
+  if (cache->Load(key, {{out.rows(), out.columns(), out.channels()}},
+                  &cached)) {
+    cache->Count(false, true);
+    utils::ExtractTile(cached[0], 0, 0, {1, 1}, 0, out);
+    return true;
+  }
+  cache->Count(false, false);
+
+  Image result(out.rows(), out.columns(), out.channels());
+  if (params.schedule != Schedule::kFixed ||
+      params.engine != Engine::kTiles) {
+    if (!denoiser->Denoise(noisy, guide, sigma, result)) return false;
+  } else {
+    // every tile depends only on its padded inputs
+    const int r = params.r;
+    const int s = utils::NextPowerOf2(2 * r + 1);
+    pair<int, int> tiling = utils::ComputeFixedTiling(
+        guide.rows(), guide.columns(), params.tile_size);
+    const int tiles = tiling.first * tiling.second;
+    vector<pair<Image, Image>> results(tiles);
+    vector<string> keys(tiles);
+    vector<int> missing;
+    for (int t = 0; t < tiles; ++t) {
+      pair<int, int> shape = utils::TileShape(guide.rows(), guide.columns(),
+                                              r, s - r - 1, tiling, t);
+      Image tile_noisy(shape.first, shape.second, noisy.channels());
+      Image tile_guide(shape.first, shape.second, guide.channels());
+      utils::ExtractTile(noisy, r, s - r - 1, tiling, t, tile_noisy);
+      utils::ExtractTile(guide, r, s - r - 1, tiling, t, tile_guide);
+      ContentHash tile_hash = hash;
+      tile_hash.Add(uint64_t{1});  // distinct from the whole images
+      tile_hash.Add(tile_noisy);
+      tile_hash.Add(tile_guide);
+      keys[t] = tile_hash.Hex();
+      bool hit = cache->Load(
+          keys[t], {{shape.first, shape.second, guide.channels()},
+                    {shape.first, shape.second, 1}},
+          &cached);
+      cache->Count(true, hit);
+      if (hit) {
+        results[t] = {std::move(cached[0]), std::move(cached[1])};
+      } else {
+        missing.push_back(t);
+      }
+    }
+    if (!missing.empty()) {
+      vector<pair<Image, Image>> denoised;
+      if (!denoiser->DenoiseTiles(noisy, guide, sigma, tiling, missing,
+                                  &denoised)) {
+        return false;
+      }
+      for (size_t i = 0; i < missing.size(); ++i) {
+        const int t = missing[i];
+        results[t] = std::move(denoised[i]);
+        cache->Store(keys[t], {&results[t].first, &results[t].second});
+      }
+    }
+    MergeTileResults(results, r, tiling, result);
+  }
+  cache->Store(key, {&result});
+  utils::ExtractTile(result, 0, 0, {1, 1}, 0, out);
+  return true;
+}
+
+}  // namespace da3d
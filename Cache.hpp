@@ -0,0 +1,90 @@
+/*
+ * Cache.hpp
+ *
+ * On-disk cache of denoised images, keyed by a hash of the inputs and of all
+ * the parameters that change the result. With Schedule::kFixed the tiles
+ * are cached too, each keyed by its padded inputs, so that an image of which
+ * only a part changed reuses the tiles that did not.
+ */
+
+#ifndef DA3D_CACHE_HPP_
+#define DA3D_CACHE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "DA3D.hpp"
+#include "Hash.hpp"
+#include "Image.hpp"
+#include "ImageView.hpp"
+
+namespace da3d {
+
+// Entries are files in a directory, shared by the processes that use it.
+// When their total size exceeds max_bytes the least recently used ones are
+// deleted. Thread-safe.
+class ResultCache {
+ public:
+  struct Stats {
+    int64_t hits = 0;
+    int64_t misses = 0;
+    int64_t tile_hits = 0;
+    int64_t tile_misses = 0;
+    int64_t evictions = 0;
+  };
+
+  // Creates the directory if needed and indexes the entries already there
+  ResultCache(const std::string &directory, size_t max_bytes);
+
+  struct Shape {
+    int rows, columns, channels;
+  };
+
+  // Reads the entry with the key, which must hold images of the given
+  // shapes. Returns false if there is none, or if its file is truncated or
+  // holds other shapes; nothing larger than the expected images is read.
+  bool Load(const std::string &key, const std::vector<Shape> &shapes,
+            std::vector<Image> *images);
+  void Store(const std::string &key,
+             const std::vector<const Image *> &images);
+
+  // counts the lookups of DenoiseCached
+  void Count(bool tile, bool hit);
+  Stats stats();
+  size_t bytes();
+  int entries();
+
+ private:
+  std::string Path(const std::string &key) const;
+  void Touch(const std::string &key, size_t bytes);
+  void Evict();
+
+  const std::string directory_;
+  const size_t max_bytes_;
+  std::mutex mutex_;  // guards all the following
+  std::list<std::string> lru_;  // most recently used first
+  std::unordered_map<std::string,
+                     std::pair<std::list<std::string>::iterator, size_t>>
+      index_;
+  size_t bytes_ = 0;
+  Stats stats_;
+};
+
+// Denoise through the cache. The whole image is looked up first; on a miss,
+// with Schedule::kFixed and Engine::kTiles, every tile is looked up and only
+// the missing ones are denoised, with Denoiser::DenoiseTiles. The result is
+// the same as Denoiser::Denoise. Engine::kSharedMap is not cached, since its
+// result depends on the timing of the threads. Returns false if the call was
+// cancelled, in which case nothing is stored.
+bool DenoiseCached(Denoiser *denoiser, ResultCache *cache,
+                   ConstImageView noisy, ConstImageView guide, float sigma,
+                   ImageView out);
+
+}  // namespace da3d
+
+#endif  // DA3D_CACHE_HPP_
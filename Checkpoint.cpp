@@ -0,0 +1,198 @@
+/*
+ * Checkpoint.cpp
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <utility>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#include "Checkpoint.hpp"
+
+using std::string;
+using std::vector;
+
+namespace da3d {
+
+namespace {
+
+const uint32_t kMagic = 0xda3dc4e1;
+
+// magic, complete, map rows and columns, image rows, columns and channels
+const int kHeader = 7;
+
+// Creates a file with a unique name next to path, so that neither another
+// Checkpoint nor another process on the same directory writes it, and opens
+// it for writing. Returns null on failure.
+FILE *OpenTemporary(const string &path, string *temporary) {
+#ifdef _WIN32
+  static std::atomic<unsigned> counter(0);
+  *temporary = path + ".tmp" + std::to_string(counter++);
+  return fopen(temporary->c_str(), "wbx");  // fails if the file exists
+#else
+  vector<char> name(path.begin(), path.end());
+  const char suffix[] = ".XXXXXX";
+  name.insert(name.end(), suffix, suffix + sizeof(suffix));
+  const int fd = mkstemp(name.data());
+  if (fd < 0) return nullptr;
+  *temporary = name.data();
+  FILE *file = fdopen(fd, "wb");
+  if (!file) {
+    close(fd);
+    remove(temporary->c_str());
+  }
+  return file;
+#endif
+}
+
+}  // namespace
+
+struct Checkpoint::Snapshot {
+  int32_t header[kHeader];
+  vector<float> data;  // level zero of the map, then output and weights
+};
+
+Checkpoint::Checkpoint(const string &directory, double interval)
+    : directory_(directory), interval_(interval),
+      writer_([this] { Write(); }) {}
+
+Checkpoint::~Checkpoint() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  changed_.notify_all();
+  writer_.join();
+}
+
+bool Checkpoint::Restore(const string &key, WeightMap *map, Image *output,
+                         Image *weights) {
+  FILE *file = fopen(Path(key).c_str(), "rb");
+  if (!file) return false;
+  Snapshot snapshot;
+  const size_t map_size = static_cast<size_t>(map->height()) * map->width();
+  const size_t size = map_size + output->samples() + weights->samples();
+  bool ok = fread(snapshot.header, sizeof(snapshot.header), 1, file) == 1 &&
+            snapshot.header[0] == static_cast<int32_t>(kMagic) &&
+            snapshot.header[2] == map->height() &&
+            snapshot.header[3] == map->width() &&
+            snapshot.header[4] == output->rows() &&
+            snapshot.header[5] == output->columns() &&
+            snapshot.header[6] == output->channels();
+  if (ok) {
+    snapshot.data.resize(size);
+    ok = fread(snapshot.data.data(), sizeof(float), size, file) == size;
+  }
+  fclose(file);
+  if (!ok) return false;
+  const float *data = snapshot.data.data();
+  map->SetWeights(data);
+  data += map_size;
+  std::copy_n(data, output->samples(), output->begin());
+  data += output->samples();
+  std::copy_n(data, weights->samples(), weights->begin());
+  std::lock_guard<std::mutex> lock(mutex_);
+  keys_.insert(key);
+  ++stats_.restored;
+  if (snapshot.header[1]) ++stats_.restored_complete;
+  return true;
+}
+
+void Checkpoint::Save(const string &key, const WeightMap &map,
+                      const Image &output, const Image &weights,
+                      bool complete) {
+  // The worker copies the whole state, a few megabytes for the usual tiles,
+  // once per interval: a fraction of a millisecond every several seconds of
+  // denoising, which does not call for tracking the changed regions.
+  const size_t map_size = static_cast<size_t>(map.height()) * map.width();
+  std::unique_ptr<Snapshot> snapshot(new Snapshot);
+  snapshot->header[0] = static_cast<int32_t>(kMagic);
+  snapshot->header[1] = complete;
+  snapshot->header[2] = map.height();
+  snapshot->header[3] = map.width();
+  snapshot->header[4] = output.rows();
+  snapshot->header[5] = output.columns();
+  snapshot->header[6] = output.channels();
+  snapshot->data.resize(map_size + output.samples() + weights.samples());
+  float *data = snapshot->data.data();
+  map.GetWeights(data);
+  data = std::copy(output.begin(), output.end(), data + map_size);
+  std::copy(weights.begin(), weights.end(), data);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    keys_.insert(key);
+    std::unique_ptr<Snapshot> &queued = pending_[key];
+    if (queued) {
+      ++stats_.replaced;
+    } else {
+      queue_.push_back(key);
+    }
+    queued = std::move(snapshot);
+  }
+  changed_.notify_all();
+}
+
+void Checkpoint::Flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  changed_.wait(lock, [this] { return queue_.empty() && !writing_; });
+}
+
+void Checkpoint::Clear() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  queue_.clear();
+  pending_.clear();
+  changed_.wait(lock, [this] { return !writing_; });
+  for (const string &key : keys_) remove(Path(key).c_str());
+  keys_.clear();
+}
+
+Checkpoint::Stats Checkpoint::stats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+string Checkpoint::Path(const string &key) const {
+  return directory_ + "/" + key + ".ckpt";
+}
+
+// Body of the writer thread. Every snapshot is written aside and renamed,
+// so that an interruption leaves the previous one in place.
+void Checkpoint::Write() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    changed_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+    if (queue_.empty()) return;
+    const string key = queue_.front();
+    queue_.pop_front();
+    std::unique_ptr<Snapshot> snapshot = std::move(pending_[key]);
+    pending_.erase(key);
+    writing_ = true;
+    lock.unlock();
+
+    const string path = Path(key);
+    string temporary;
+    FILE *file = OpenTemporary(path, &temporary);
+    bool ok = file &&
+              fwrite(snapshot->header, sizeof(snapshot->header), 1, file) ==
+                  1 &&
+              fwrite(snapshot->data.data(), sizeof(float),
+                     snapshot->data.size(), file) == snapshot->data.size();
+    if (file) ok = (fclose(file) == 0) && ok;
+    ok = ok && rename(temporary.c_str(), path.c_str()) == 0;
+    if (!ok && file) remove(temporary.c_str());
+
+    lock.lock();
+    writing_ = false;
+    if (ok) {
+      ++stats_.saved;
+      stats_.bytes += sizeof(snapshot->header) +
+                      sizeof(float) * snapshot->data.size();
+    }
+    changed_.notify_all();
+  }
+}
+
+}  // namespace da3d
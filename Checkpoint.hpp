@@ -0,0 +1,88 @@
+/*
+ * Checkpoint.hpp
+ *
+ * Snapshots of the tiles being denoised, so that a long run interrupted by
+ * the end of the process resumes where it stopped. The state of a tile is
+ * its weight map and its output and weights accumulators; every tile is
+ * keyed by a hash of its padded inputs, sigma and the parameters, so a
+ * snapshot is only ever used by a run that computes the same tile. The
+ * workers only copy the state: a background thread writes the files.
+ */
+
+#ifndef DA3D_CHECKPOINT_HPP_
+#define DA3D_CHECKPOINT_HPP_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Image.hpp"
+#include "WeightMap.hpp"
+
+namespace da3d {
+
+class Checkpoint {
+ public:
+  struct Stats {
+    int64_t saved = 0;  // snapshots written
+    int64_t replaced = 0;  // snapshots replaced by a newer one before writing
+    int64_t bytes = 0;  // bytes written
+    int64_t restored = 0;  // tiles resumed
+    int64_t restored_complete = 0;  // tiles resumed already complete
+  };
+
+  // The directory must exist. A tile in progress is saved every interval
+  // seconds, and once more when it is complete.
+  explicit Checkpoint(const std::string &directory, double interval = 30.);
+  // writes the snapshots still queued
+  ~Checkpoint();
+
+  Checkpoint(const Checkpoint&) = delete;
+  Checkpoint& operator=(const Checkpoint&) = delete;
+
+  double interval() const { return interval_; }
+
+  // Restores the state of the tile with the given key into map, output and
+  // weights, which must already have the shapes of the tile. Returns false,
+  // leaving them unchanged, if there is no usable snapshot.
+  bool Restore(const std::string &key, WeightMap *map, Image *output,
+               Image *weights);
+  // Copies the state of a tile and queues it for writing. A snapshot of the
+  // same tile that is still queued is replaced.
+  void Save(const std::string &key, const WeightMap &map, const Image &output,
+            const Image &weights, bool complete);
+  // Waits until the queued snapshots are written
+  void Flush();
+  // Deletes the snapshots of all the tiles seen, once the results are safe
+  void Clear();
+
+  Stats stats();
+
+ private:
+  struct Snapshot;
+
+  std::string Path(const std::string &key) const;
+  void Write();
+
+  const std::string directory_;
+  const double interval_;
+  std::mutex mutex_;  // guards all the following
+  std::condition_variable changed_;
+  std::deque<std::string> queue_;  // keys of the pending snapshots, in order
+  std::unordered_map<std::string, std::unique_ptr<Snapshot>> pending_;
+  std::set<std::string> keys_;  // tiles saved or restored
+  bool writing_ = false;
+  bool stop_ = false;
+  Stats stats_;
+  std::thread writer_;
+};
+
+}  // namespace da3d
+
+#endif  // DA3D_CHECKPOINT_HPP_
@@ -1,18 +1,29 @@
+#include <cassert>
 #include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
 #include <tuple>
 #include <utility>
 #include <algorithm>
+#include <atomic>
 #include <numeric>
+#include "Arena.hpp"
+#include "Checkpoint.hpp"
+#include "Hash.hpp"
 #include "Image.hpp"
+#include "Kernels.hpp"
+#include "Trace.hpp"
+#include "ImageView.hpp"
 #include "DA3D.hpp"
+#include "Executor.hpp"
 #include "WeightMap.hpp"
 #include "Utils.hpp"
 #include "DftPatch.hpp"
 
-#ifdef _OPENMP
-#include <omp.h>
-#endif  // OPENMP
-
 using std::max;
 using std::min;
 using std::vector;
@@ -22,22 +33,25 @@ using std::move;
 using std::sqrt;
 using std::log2;
 using std::floor;
-using std::modf;
-using std::abs;
 using std::accumulate;
-using std::norm;
-using utils::fastexp;
 using utils::NextPowerOf2;
 using utils::ComputeTiling;
-using utils::SplitTiles;
+using utils::ComputeBatchTiling;
+using utils::ComputeBatchThreads;
 using utils::MergeTiles;
 
 namespace da3d {
 
 namespace {
 
-Image ColorTransform(Image&& src) {
-  Image img = move(src);
+// The per-tile counters are compiled out unless instrumented
+#ifdef DA3D_INSTRUMENT
+const bool kInstrument = true;
+#else
+const bool kInstrument = false;
+#endif
+
+void ColorTransform(ImageView img) {
   if (img.channels() == 3) {
     for (int row = 0; row < img.rows(); ++row) {
       for (int col = 0; col < img.columns(); ++col) {
@@ -51,11 +65,9 @@ Image ColorTransform(Image&& src) {
       }
     }
   }
-  return img;
 }
 
-Image ColorTransformInverse(Image&& src) {
-  Image img = move(src);
+void ColorTransformInverse(ImageView img) {
   if (img.channels() == 3) {
     for (int row = 0; row < img.rows(); ++row) {
       for (int col = 0; col < img.columns(); ++col) {
@@ -69,295 +81,1328 @@ Image ColorTransformInverse(Image&& src) {
       }
     }
   }
-  return img;
 }
 
-void ExtractPatch(const Image &src, int pr, int pc, Image *dst) {
-  // src is padded, so (pr, pc) becomes the upper left pixel
-  int i = 0, j = (pr * src.columns() + pc) * src.channels();
-  for (int row = 0; row < dst->rows(); ++row) {
-    for (int el = 0; el < dst->columns() * dst->channels(); ++el) {
-      dst->val(i) = src.val(j);
-      ++i;
-      ++j;
+}  // namespace
+
+// A patch between the stages of the algorithm
+struct Patches {
+  Patches(int s, int channels)
+      : y(s, s, channels), g(s, s, channels), k_reg(s, s), k(s, s),
+        k2(s, s), reg_plane(channels) {}
+
+  Image y;
+  Image g;
+  Image k_reg;
+  Image k;
+  Image k2;  // squared weights, used to update the map early when pipelined
+  vector<pair<float, float>> reg_plane;  // parameters of the regression plane
+  int pr = 0, pc = 0;  // upper left pixel in the padded images
+  bool shortcut = false;  // sum(k) < 10: the guide is aggregated directly
+};
+
+// A patch processed, for the heatmaps
+struct PatchRecord {
+  int frame;
+  int row, column;  // center, in the image
+  int patches;  // 0 for the time of the second lane of a pipelined patch
+  float seconds;
+};
+
+struct BlockWorkspace {
+  BlockWorkspace(int s, int channels, unsigned fft_flags)
+      : y_m(s, s, channels, fft_flags), g_m(s, s, channels, fft_flags),
+        yt(channels) {
+    slots.emplace_back(s, channels);
+    slots.emplace_back(s, channels);
+  }
+
+  // The FFT plans are bound to the buffers of the patches, so these are
+  // allocated once and never borrowed from the arenas.
+  DftPatch y_m;
+  DftPatch g_m;
+  vector<float> yt;  // weighted average of the patch
+  // two patches, so that one can be prepared while the other is aggregated
+  vector<Patches> slots;
+  WeightMap agg_weights;
+  Arena scratch;  // weight map, reset for every tile
+  Arena results;  // output and weights of the tiles, reset for every call
+  // stages recorded by the two lanes of the pipeline in the current call
+  vector<StageEvent> front_events;
+  vector<StageEvent> back_events;
+  // patches processed by the two lanes, when the heatmaps are enabled
+  vector<PatchRecord> front_patches;
+  vector<PatchRecord> back_patches;
+};
+
+// buffers used for one image of a batch, reused across calls
+struct FrameBuffers {
+  Image weights;
+  pair<int, int> tiling;
+  vector<Image> noisy_tiles, guide_tiles;  // used by Engine::kSharedMap
+  vector<pair<Image, Image>> result_tiles;
+  WeightMap map;  // used by Engine::kSharedMap
+};
+
+namespace {
+
+// values derived from the parameters and the noise level
+struct BlockConstants {
+  BlockConstants(const Parameters &params, float sigma)
+      : r(params.r), s(NextPowerOf2(2 * params.r + 1)), sigma2(sigma * sigma),
+        gamma_r_sigma2(params.gamma_r * sigma2),
+        sigma_s2(params.sigma_s * params.sigma_s),
+        gamma_rr_sigma2(gamma_r_sigma2 * 10.f), sigma_sr2(sigma_s2 * 2.f),
+        threshold(params.threshold),
+        K_high(params.K_high), K_low(params.K_low) {}
+
+  const int r;
+  const int s;
+  const float sigma2;
+  const float gamma_r_sigma2;
+  const float sigma_s2;
+  // regression parameters
+  const float gamma_rr_sigma2;
+  const float sigma_sr2;
+  const float threshold;
+  const vector<float> &K_high;
+  const vector<float> &K_low;
+};
+
+// Records the stages of the patches of a tile as events, and when
+// instrumented adds their durations to seconds, indexed by Stage. The default
+// one records nothing, and does not read the clock.
+class StageClock {
+ public:
+  StageClock() = default;
+  explicit StageClock(double *seconds)
+      : seconds_(kInstrument ? seconds : nullptr) {}
+  StageClock(vector<StageEvent> *events, double *seconds, int tile, int lane,
+             double origin)
+      : events_(events), seconds_(kInstrument ? seconds : nullptr),
+        tile_(tile), lane_(lane), origin_(origin) {}
+
+  void Start() {
+    if (events_ || (kInstrument && seconds_)) last_ = utils::Seconds();
+  }
+  // ends the stage begun by the previous call to Start or End
+  void End(Stage stage) {
+    if (!events_ && !(kInstrument && seconds_)) return;
+    double now = utils::Seconds();
+    if (events_) {
+      events_->push_back({stage, tile_, lane_, last_ - origin_,
+                          now - origin_});
     }
-    j += (src.columns() - dst->columns()) * src.channels();
+    if (kInstrument && seconds_) {
+      seconds_[static_cast<int>(stage)] += now - last_;
+    }
+    last_ = now;
   }
+
+ private:
+  vector<StageEvent> *events_ = nullptr;
+  double *seconds_ = nullptr;
+  int tile_ = 0;
+  int lane_ = 0;
+  double origin_ = 0.;
+  double last_ = 0.;
+};
+
+// Lines 6-12 for the patch at (p->pr, p->pc) of the padded images: the
+// patches without the regression plane and their weights
+void PreparePatch(const Image &noisy, const Image &guide,
+                  const BlockConstants &c, Patches *p, StageClock *clock) {
+  const int r = c.r;
+  Image &y = p->y;
+  Image &g = p->g;
+  Image &k_reg = p->k_reg;
+  Image &k = p->k;
+  vector<pair<float, float>> &reg_plane = p->reg_plane;
+
+  ExtractPatch(noisy, p->pr, p->pc, &y);  // line 6
+  ExtractPatch(guide, p->pr, p->pc, &g);  // line 7
+  clock->End(Stage::kExtract);
+  BilateralWeight(g, &k_reg, r, c.gamma_rr_sigma2, c.sigma_sr2);  // line 8
+  clock->End(Stage::kWeights);
+  ComputeRegressionPlane(y, g, k_reg, r, &reg_plane);  // line 9
+  SubtractPlane(r, reg_plane, &y);  // line 10
+  SubtractPlane(r, reg_plane, &g);  // line 11
+  clock->End(Stage::kRegression);
+  BilateralWeight(g, &k, r, c.gamma_r_sigma2, c.sigma_s2);  // line 12
+  p->shortcut = accumulate(k.begin(), k.end(), 0.f) < 10.f;
+  clock->End(Stage::kWeights);
 }
 
-void BilateralWeight(const Image &g, Image *k, int r, float gamma_r_sigma2,
-                     float sigma_s2) {
-  for (int row = 0; row < g.rows(); ++row) {
-    for (int col = 0; col < g.columns(); ++col) {
-      float x = 0.f;
-      for (int chan = 0; chan < g.channels(); ++chan) {
-        float y = g.val(col, row, chan) - g.val(r, r, chan);
-        x += y * y;
-      }
-      x /= gamma_r_sigma2;
-      x += ((row - r) * (row - r) + (col - r) * (col - r)) / (2 * sigma_s2);
-      k->val(col, row) = utils::fastexp(-x);
+// Lines 13-22: shrinks a prepared patch and aggregates it into output and
+// weights. On return p->k holds the aggregation weights of the patch.
+void AggregatePatch(const BlockConstants &c, Patches *p, BlockWorkspace *ws,
+                    Image *output, Image *weights, StageClock *clock) {
+  DftPatch &y_m = ws->y_m;
+  DftPatch &g_m = ws->g_m;
+
+  if (p->shortcut) {
+    AggregateGuide(p->g, p->reg_plane, c.r, p->pr, p->pc, &p->k, output,
+                   weights);
+    clock->End(Stage::kAggregate);
+  } else {
+    ModifyPatch(p->y, p->k, &y_m, ws->yt.data());  // line 13
+    ModifyPatch(p->g, p->k, &g_m);  // line 14
+    clock->End(Stage::kModify);
+    y_m.ToFreq();  // line 15
+    g_m.ToFreq();  // line 16
+    clock->End(Stage::kFft);
+    ShrinkSpectrum(p->k, c.sigma2, g_m, c.K_high, c.K_low, &y_m);
+    clock->End(Stage::kShrink);
+    y_m.ToSpace();  // line 19
+    clock->End(Stage::kInverseFft);
+    AggregateShrunk(y_m, ws->yt.data(), p->reg_plane, c.r, p->pr, p->pc,
+                    &p->k, output, weights);
+    clock->End(Stage::kAggregate);
+  }
+}
+
+// Lines 6-22 for the patch with upper left pixel (pr, pc)
+void DenoisePatch(const Image &noisy, const Image &guide, int pr, int pc,
+                  const BlockConstants &c, Patches *p, BlockWorkspace *ws,
+                  Image *output, Image *weights, StageClock *clock) {
+  p->pr = pr;
+  p->pc = pc;
+  PreparePatch(noisy, guide, c, p, clock);
+  AggregatePatch(c, p, ws, output, weights, clock);
+}
+
+// Counts a prepared patch in profile, which is null unless instrumented
+void CountPatch(const Patches &p, TileProfile *profile) {
+  if (kInstrument && profile) {
+    ++profile->patches;
+    profile->shortcuts += p.shortcut;
+  }
+}
+
+// Lines 1-3: the weight map and the (cleared) output of a tile
+void InitBlock(const Image &guide, const BlockConstants &c, BlockWorkspace *ws,
+               Image *output, Image *weights) {
+  ws->agg_weights.Init(guide.rows() - c.s + 1, guide.columns() - c.s + 1,
+                       &ws->scratch);  // line 1
+  *output = Image(guide.rows(), guide.columns(), guide.channels(),
+                  &ws->results);
+  *weights = Image(guide.rows(), guide.columns(), 1, &ws->results);
+  output->Clear();
+  weights->Clear();
+}
+
+// Padded and color transformed tile of a frame, copied by the thread that
+// processes it into its scratch arena, so that on NUMA systems the memory
+// is local to the thread
+void PrepareTile(ConstImageView src, int pad_before, int pad_after,
+                 pair<int, int> tiling, int index, Arena *arena, Image *dst) {
+  pair<int, int> shape = utils::TileShape(src.rows(), src.columns(),
+                                          pad_before, pad_after, tiling,
+                                          index);
+  *dst = Image(shape.first, shape.second, src.channels(), arena);
+  utils::ExtractTile(src, pad_before, pad_after, tiling, index, *dst);
+  ColorTransform(*dst);
+}
+
+// Restores a tile from a checkpoint and saves it periodically. The default
+// one does nothing.
+class TileSaver {
+ public:
+  TileSaver() = default;
+  TileSaver(Checkpoint *checkpoint, std::string key)
+      : checkpoint_(checkpoint), key_(std::move(key)),
+        last_(utils::Seconds()) {}
+
+  void Restore(BlockWorkspace *ws, Image *output, Image *weights) {
+    if (checkpoint_) {
+      checkpoint_->Restore(key_, &ws->agg_weights, output, weights);
     }
   }
+  // called after every patch: true when a snapshot is due
+  bool Due() {
+    if (!checkpoint_) return false;
+    changed_ = true;
+    return utils::Seconds() - last_ >= checkpoint_->interval();
+  }
+  // a complete tile is saved only if it was not restored complete
+  void Save(const BlockWorkspace &ws, const Image &output,
+            const Image &weights, bool complete) {
+    if (!checkpoint_ || !changed_) return;
+    checkpoint_->Save(key_, ws.agg_weights, output, weights, complete);
+    last_ = utils::Seconds();
+  }
+
+ private:
+  Checkpoint *checkpoint_ = nullptr;
+  std::string key_;
+  double last_ = 0.;
+  bool changed_ = false;
+};
+
+// Reports the progress of a tile and checks whether the call is cancelled.
+// The default one does neither. With a map shared by several threads, Due is
+// called under the lock of the map and Continue after releasing it.
+class TileProgress {
+ public:
+  TileProgress() = default;
+  TileProgress(const ProgressCallback *callback, double interval,
+               const CancellationToken *token, float threshold, int tile,
+               int tiles)
+      : callback_(callback), token_(token), interval_(interval),
+        threshold_(threshold), tile_(tile), tiles_(tiles) {}
+
+  void Start(const WeightMap &map) {
+    if (!callback_) return;
+    last_ = utils::Seconds();
+    (*callback_)(tile_, tiles_, map.Covered(threshold_));
+  }
+  bool Cancelled() const { return token_ && token_->cancelled(); }
+  // called after every patch: false once the call is cancelled
+  bool Continue(const WeightMap &map) { return Continue(Due(map)); }
+  // the coverage of map to report, or a negative value if no report is due
+  double Due(const WeightMap &map) {
+    if (!callback_ || utils::Seconds() - last_ < interval_) return -1.;
+    last_ = utils::Seconds();
+    return map.Covered(threshold_);
+  }
+  // called after every patch with the result of Due
+  bool Continue(double covered) {
+    patches_.fetch_add(1, std::memory_order_relaxed);
+    if (Cancelled()) return false;
+    if (covered >= 0.) (*callback_)(tile_, tiles_, covered);
+    return true;
+  }
+  int64_t patches() const { return patches_; }
+  void Finish() {
+    if (callback_) (*callback_)(tile_, tiles_, 1.);
+  }
+
+ private:
+  const ProgressCallback *callback_ = nullptr;
+  const CancellationToken *token_ = nullptr;
+  double interval_ = 0.;
+  float threshold_ = 0.f;
+  int tile_ = 0;
+  int tiles_ = 0;
+  double last_ = 0.;
+  std::atomic<int64_t> patches_{0};
+};
+
+// Tracks of the trace: the calling thread and every worker
+const int kCallerTrack = 0;
+
+int WorkerTrack(TraceRecorder *trace, int worker) {
+  const int track = 1 + worker;
+  trace->NameTrack(track, "worker " + std::to_string(worker));
+  return track;
+}
+
+// Records the span of a tile and a sample of its patches into a trace. The
+// default one records nothing, and does not read the clock.
+class TileTracer {
+ public:
+  TileTracer() = default;
+  TileTracer(TraceRecorder *trace, int track, int frame, int tile)
+      : trace_(trace), track_(track), frame_(frame), tile_(tile),
+        start_(trace->Now()) {}
+
+  double Now() const { return trace_ ? trace_->Now() : 0.; }
+  // called before every patch
+  void BeginPatch() {
+    if (!trace_) return;
+    const int interval = trace_->patch_interval();
+    sampled_ = interval > 0 && patches_ % interval == 0;
+    ++patches_;
+    if (sampled_) patch_start_ = trace_->Now();
+  }
+  // called once the patch p is in the map
+  void EndPatch(const Patches &p, const WeightMap &map) {
+    if (trace_ && sampled_) EndPatch(p, map.Minimum());
+  }
+  // the same with the minimum of the map, read under the lock of a shared one
+  void EndPatch(const Patches &p, float minimum) {
+    if (!trace_ || !sampled_) return;
+    const double now = trace_->Now();
+    trace_->Span(track_, "patch", patch_start_, now,
+                 "{\"row\": " + std::to_string(p.pr) + ", \"column\": " +
+                     std::to_string(p.pc) + ", \"shortcut\": " +
+                     (p.shortcut ? "true" : "false") + "}");
+    trace_->Counter("weight map minimum",
+                    "f" + std::to_string(frame_) + " t" +
+                        std::to_string(tile_),
+                    now, minimum);
+  }
+  // a span of the tile on another track, from start to now
+  void Span(int track, const char *name, double start) {
+    if (trace_) trace_->Span(track, name, start, trace_->Now(), Args());
+  }
+  void End() { Span(track_, "tile", start_); }
+
+ private:
+  std::string Args() const {
+    return "{\"frame\": " + std::to_string(frame_) + ", \"tile\": " +
+           std::to_string(tile_) + ", \"patches\": " +
+           std::to_string(patches_) + "}";
+  }
+
+  TraceRecorder *trace_ = nullptr;
+  int track_ = 0;
+  int frame_ = 0;
+  int tile_ = 0;
+  double start_ = 0.;
+  int64_t patches_ = 0;
+  bool sampled_ = false;
+  double patch_start_ = 0.;
+};
+
+// Records the center and the processing time of every patch of a tile into
+// records, for the heatmaps. The default one records nothing.
+class PatchLog {
+ public:
+  PatchLog() = default;
+  PatchLog(vector<PatchRecord> *records, int frame, pair<int, int> origin,
+           int patches = 1)
+      : records_(records), frame_(frame), origin_(origin),
+        patches_(patches) {}
+
+  // the same tile, for the second lane of the pipeline
+  PatchLog Lane(vector<PatchRecord> *records) const {
+    return records_ ? PatchLog(records, frame_, origin_, 0) : PatchLog();
+  }
+  void Begin() {
+    if (records_) start_ = utils::Seconds();
+  }
+  // the upper left pixel of the patch in the padded tile is its center in
+  // the tile
+  void End(const Patches &p) {
+    if (!records_) return;
+    records_->push_back({frame_, origin_.first + p.pr,
+                         origin_.second + p.pc, patches_,
+                         static_cast<float>(utils::Seconds() - start_)});
+  }
+
+ private:
+  vector<PatchRecord> *records_ = nullptr;
+  int frame_ = 0;
+  pair<int, int> origin_{0, 0};
+  int patches_ = 1;
+  double start_ = 0.;
+};
+
+// The processor index of the index-th worker for utils::ScopedPin, or -1 if
+// the threads are not pinned
+int WorkerCpu(const Parameters &params, int index) {
+  return params.pin_threads ? index : -1;
 }
 
-/* void ComputeRegressionPlaneIRLS(const Image &y,
-                                const Image &g,
-                                const Image &k,
-                                int r,
-                                vector<pair<float, float>> *reg_plane,
-                                int iterations = 2) {
-  constexpr float delta = 0.0001f;
-  for (pair<float, float> &v : *reg_plane) v = {0.f, 0.f};
-  for (int chan = 0; chan < y.channels(); ++chan) {
-    float x1 = 0.f, x2 = 0.f;
-    for (int t = 0; t < iterations; ++t) {
-      float a = 0.f, b = 0.f, c = 0.f, d = 0.f, e = 0.f;
-      float central = g.val(r, r, chan);
-      for (int row = 0; row < y.rows(); ++row) {
-        for (int col = 0; col < y.columns(); ++col) {
-          int cc = col - r, rr = row - r;
-          float w = k.val(col, row)
-              / max(delta, (y.val(col, row, chan) - central - x1 * rr - x2 * cc));
-          a += rr * rr * w;
-          b += rr * cc * w;
-          c += cc * cc * w;
-          d += rr * (y.val(col, row, chan) - central) * w;
-          e += cc * (y.val(col, row, chan) - central) * w;
-        }
-      }
-      float det = a * c - b * b;
-      if (abs(det) < delta) break;
+// Returns false if cancelled, after saving the tile to resume it later.
+// profile, if not null, gets the counters of the patches.
+bool DA3D_block(const Image &noisy, const Image &guide, float sigma,
+                const Parameters &params, BlockWorkspace *ws, Image *output,
+                Image *weights, TileSaver *saver, TileProgress *progress,
+                TileProfile *profile, TileTracer *tracer, PatchLog *log) {
+  const BlockConstants c(params, sigma);
+  const int r = c.r;
+  InitBlock(guide, c, ws, output, weights);
+  saver->Restore(ws, output, weights);
+  progress->Start(ws->agg_weights);
+  Patches &p = ws->slots[0];
+  int pr, pc;  // coordinates of the central pixel
+  WeightMap &agg_weights = ws->agg_weights;
+  StageClock clock(profile ? profile->stage_seconds : nullptr);
 
-      // Solves the system
-      // |a   b| |x1|   |d|
-      // |     | |  | = | |
-      // |b   c| |x2|   |e|
-      x1 = (c * d - b * e) / det;
-      x2 = (a * e - b * d) / det;
+  // main loop
+  while (agg_weights.Minimum() < c.threshold) {  // line 4
+    tracer->BeginPatch();
+    log->Begin();
+    clock.Start();
+    tie(pr, pc) = agg_weights.FindMinimum();  // line 5
+    clock.End(Stage::kSelect);
+    DenoisePatch(noisy, guide, pr, pc, c, &p, ws, output, weights, &clock);
+    agg_weights.IncreaseWeights(p.k, pr - r, pc - r);  // line 24
+    clock.End(Stage::kUpdate);
+    CountPatch(p, profile);
+    tracer->EndPatch(p, agg_weights);
+    log->End(p);
+    if (saver->Due()) saver->Save(*ws, *output, *weights, false);
+    if (!progress->Continue(agg_weights)) {
+      saver->Save(*ws, *output, *weights, false);
+      return false;
     }
-    (*reg_plane)[chan] = {x1, x2};
   }
-} */
+  saver->Save(*ws, *output, *weights, true);
+  progress->Finish();
+  tracer->End();
+  return true;
+}
 
-void ComputeRegressionPlane(const Image &y, const Image &g, const Image &k,
-                            int r, vector<pair<float, float>> *reg_plane) {
-  constexpr float epsilon = 0.0001f;
-  float a = 0.f, b = 0.f, c = 0.f;
-  for (int row = 0; row < y.rows(); ++row) {
-    for (int col = 0; col < y.columns(); ++col) {
-      a += (row - r) * (row - r) * k.val(col, row);
-      b += (row - r) * (col - r) * k.val(col, row);
-      c += (col - r) * (col - r) * k.val(col, row);
+// The two lanes of a pipelined tile, which are two indexes of the loop of
+// the executor, so that the executor bounds the number of threads. The first
+// to arrive selects and prepares the patches (the front lane); the second,
+// if it arrives while the front lane runs, shrinks and aggregates them (the
+// back lane). Both may also run one after the other, e.g. on the same
+// thread, so the front lane aggregates the patches itself until the back
+// lane attaches, and never waits for it to arrive: the patches and the order
+// of aggregation are the same either way.
+class Handoff {
+ public:
+  enum Lane { kFront, kBack };
+
+  Lane Arrive() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return arrived_++ == 0 ? kFront : kBack;
+  }
+
+  // Front lane: what the back lane needs to aggregate the patches
+  void Open(const BlockConstants *c, BlockWorkspace *ws, Image *output,
+            Image *weights, const PatchLog *log,
+            vector<StageEvent> *events, bool timed, int tile,
+            double origin) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      c_ = c;
+      ws_ = ws;
+      output_ = output;
+      weights_ = weights;
+      log_ = log;
+      events_ = events;
+      timed_ = timed;
+      tile_ = tile;
+      origin_ = origin;
+      open_ = true;
     }
+    changed_.notify_all();
   }
-  float det = a * c - b * b;
-  if (abs(det) < epsilon) {
-    for (int chan = 0; chan < y.channels(); ++chan) {
-      (*reg_plane)[chan] = {0.f, 0.f};
+  // Front lane, before preparing a patch: waits for a free slot
+  void WaitForSlot() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this] { return ready_ < 2; });
+  }
+  // Front lane, once the patch in slot is in the map: false if the back lane
+  // is not attached, in which case the front lane aggregates it
+  bool Push(int slot) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!attached_) {
+        next_ = slot ^ 1;
+        return false;
+      }
+      ++ready_;
     }
-  } else {
-    for (int chan = 0; chan < y.channels(); ++chan) {
-      float d = 0.f, e = 0.f;
-      float central = g.val(r, r, chan);
-      for (int row = 0; row < y.rows(); ++row) {
-        for (int col = 0; col < y.columns(); ++col) {
-          d += (row - r) * (y.val(col, row, chan) - central) * k.val(col, row);
-          e += (col - r) * (y.val(col, row, chan) - central) * k.val(col, row);
+    changed_.notify_all();
+    return true;
+  }
+  // Front lane: waits until the patches in the map are aggregated
+  void Drain() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this] { return ready_ == 0; });
+  }
+  // Front lane, on every path: no more patches. Waits for the back lane to
+  // aggregate the patches in flight and detach.
+  void Close() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    closed_ = true;
+    changed_.notify_all();
+    changed_.wait(lock, [this] { return !attached_; });
+  }
+  // time of the back lane in every stage, once closed
+  const double *back_seconds() const { return back_seconds_; }
+
+  // Back lane: aggregates the patches of the front lane, if it is running,
+  // until it closes. trace, if not null, gets the span on track.
+  void Back(TraceRecorder *trace, int track) {
+    int slot;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (closed_) return;
+      // the front lane has arrived, so it opens or closes soon
+      changed_.wait(lock, [this] { return open_ || closed_; });
+      if (closed_) return;
+      attached_ = true;
+      slot = next_;
+    }
+    const double started = trace ? trace->Now() : 0.;
+    {
+      StageClock clock(events_, timed_ ? back_seconds_ : nullptr, tile_, 1,
+                       origin_);
+      PatchLog log = log_->Lane(&ws_->back_patches);
+      for (;; slot ^= 1) {
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          changed_.wait(lock, [this] { return ready_ > 0 || closed_; });
+          if (ready_ == 0) break;
+        }
+        clock.Start();
+        log.Begin();
+        AggregatePatch(*c_, &ws_->slots[slot], ws_, output_, weights_,
+                       &clock);
+        log.End(ws_->slots[slot]);
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          --ready_;
         }
+        changed_.notify_all();
       }
-      // Solves the system
-      // |a   b| |x1|   |d|
-      // |     | |  | = | |
-      // |b   c| |x2|   |e|
-      (*reg_plane)[chan] = {(c * d - b * e) / det, (a * e - b * d) / det};
     }
+    if (trace) {
+      trace->Span(track, "back", started, trace->Now(),
+                  "{\"task\": " + std::to_string(tile_) + "}");
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      attached_ = false;
+    }
+    changed_.notify_all();
   }
-}
 
-void SubtractPlane(int r, vector<pair<float, float>> reg_plane, Image *y) {
-  for (int row = 0; row < y->rows(); ++row) {
-    for (int col = 0; col < y->columns(); ++col) {
-      for (int chan = 0; chan < y->channels(); ++chan) {
-        y->val(col, row, chan) -= reg_plane[chan].first * (row - r) +
-                                  reg_plane[chan].second * (col - r);
-      }
+ private:
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  int arrived_ = 0;
+  bool open_ = false;
+  bool closed_ = false;
+  bool attached_ = false;
+  int ready_ = 0;  // prepared patches not yet aggregated
+  int next_ = 0;  // slot of the next patch to aggregate, when attaching
+  // set by Open
+  const BlockConstants *c_ = nullptr;
+  BlockWorkspace *ws_ = nullptr;
+  Image *output_ = nullptr;
+  Image *weights_ = nullptr;
+  const PatchLog *log_ = nullptr;
+  vector<StageEvent> *events_ = nullptr;
+  bool timed_ = false;
+  int tile_ = 0;
+  double origin_ = 0.;
+  double back_seconds_[kStages] = {};
+};
+
+// The front lane of DA3D_block with the stages of consecutive patches
+// overlapped: this thread selects and prepares the patches (lines 4-12 and
+// 24) while the back lane of handoff shrinks and aggregates the previous one
+// (lines 13-22), each patch in one of the two slots of the workspace. The
+// weights of a patch are known after line 12, so the map is updated before
+// the patch is aggregated: the patches and the order of aggregation, hence
+// the result, are those of DA3D_block. A snapshot waits for the back lane to
+// aggregate the patches already in the map. events and back_events, if not
+// null, get the stages of the two lanes.
+bool DA3D_block_pipelined(const Image &noisy, const Image &guide, float sigma,
+                          const Parameters &params, BlockWorkspace *ws,
+                          Image *output, Image *weights, TileSaver *saver,
+                          TileProgress *progress, TileProfile *profile,
+                          TileTracer *tracer, PatchLog *log,
+                          vector<StageEvent> *events,
+                          vector<StageEvent> *back_events, int tile,
+                          double origin, Handoff *handoff) {
+  const BlockConstants c(params, sigma);
+  const int r = c.r;
+  InitBlock(guide, c, ws, output, weights);
+  saver->Restore(ws, output, weights);
+  progress->Start(ws->agg_weights);
+  WeightMap &agg_weights = ws->agg_weights;
+  handoff->Open(&c, ws, output, weights, log, back_events,
+                kInstrument && profile, tile, origin);
+
+  StageClock clock(events, profile ? profile->stage_seconds : nullptr, tile,
+                   0, origin);
+  PatchLog front_log = log->Lane(&ws->front_patches);
+  bool cancelled = false;
+  for (int i = 0; agg_weights.Minimum() < c.threshold; i ^= 1) {  // line 4
+    // the slot is free once the patch before the previous one is done
+    handoff->WaitForSlot();
+    tracer->BeginPatch();
+    log->Begin();
+    clock.Start();
+    Patches &p = ws->slots[i];
+    tie(p.pr, p.pc) = agg_weights.FindMinimum();  // line 5
+    clock.End(Stage::kSelect);
+    PreparePatch(noisy, guide, c, &p, &clock);
+    CountPatch(p, profile);
+    for (int j = 0; j < p.k.samples(); ++j) {
+      p.k2.val(j) = p.k.val(j) * p.k.val(j);  // line 22
     }
+    agg_weights.IncreaseWeights(p.k2, p.pr - r, p.pc - r);  // line 24
+    clock.End(Stage::kUpdate);
+    tracer->EndPatch(p, agg_weights);
+    log->End(p);
+    if (!handoff->Push(i)) {
+      front_log.Begin();
+      AggregatePatch(c, &p, ws, output, weights, &clock);
+      front_log.End(p);
+    }
+    if (saver->Due()) {
+      handoff->Drain();
+      saver->Save(*ws, *output, *weights, false);
+    }
+    if (!progress->Continue(agg_weights)) {
+      cancelled = true;
+      break;
+    }
+  }
+  handoff->Close();  // the patches in flight are aggregated
+  if (kInstrument && profile) {
+    for (int i = 0; i < kStages; ++i) {
+      profile->stage_seconds[i] += handoff->back_seconds()[i];
+    }
+  }
+  saver->Save(*ws, *output, *weights, !cancelled);
+  if (!cancelled) {
+    progress->Finish();
+    tracer->End();
   }
+  return !cancelled;
 }
 
-void ModifyPatch(const Image &patch, const Image &k, DftPatch *modified,
-                 float *average = nullptr) {
-  // compute the total weight of the mask
-  float weight = accumulate(k.begin(), k.end(), 0.f);
+// Lines 1-24 on the whole padded image, with a single weight map shared by
+// all the threads. A thread claims the minimum by blocking every position
+// whose patch would overlap it, so the patches being processed are disjoint
+// and are aggregated without locks; only the selection and the update of the
+// map hold the mutex. Returns false if cancelled. profiles, if not null, has
+// the counters of every thread; trace, if not null, gets the span of every
+// thread as a tile of the given frame. With log_patches the patches are
+// recorded for the heatmaps.
+bool DA3D_shared(const Image &noisy, const Image &guide, float sigma,
+                 const Parameters &params, Executor *executor, int threads,
+                 const std::function<BlockWorkspace *(int)> &workspace,
+                 TileProgress *progress, TileProfile *profiles,
+                 TraceRecorder *trace, int frame, bool log_patches,
+                 WeightMap *map, Image *output, Image *weights) {
+  const BlockConstants c(params, sigma);
+  const int r = c.r;
+  const int s = c.s;
+  map->Init(guide.rows() - s + 1, guide.columns() - s + 1);  // line 1
+  output->Resize(guide.rows(), guide.columns(), guide.channels());
+  weights->Resize(guide.rows(), guide.columns());
 
-  for (int chan = 0; chan < patch.channels(); ++chan) {
-    float avg = 0.f;
-    for (int row = 0; row < patch.rows(); ++row) {
-      for (int col = 0; col < patch.columns(); ++col) {
-        avg += k.val(col, row) * patch.val(col, row, chan);
+  progress->Start(*map);
+  std::mutex mutex;
+  std::condition_variable released;  // a claimed patch has been processed
+  int in_flight = 0;
+  bool cancelled = false;
+  executor->ParallelFor(threads, threads, [&](int i, int worker) {
+    TileProfile *profile = profiles ? &profiles[i] : nullptr;
+    const double started = profile ? utils::Seconds() : 0.;
+    utils::ScopedPin pin(WorkerCpu(params, worker));
+    BlockWorkspace *ws = workspace(worker);
+    Patches &p = ws->slots[0];
+    StageClock clock(profile ? profile->stage_seconds : nullptr);
+    TileTracer tracer;
+    if (trace) tracer = TileTracer(trace, WorkerTrack(trace, worker), frame, i);
+    PatchLog log;
+    if (log_patches) log = PatchLog(&ws->front_patches, frame, {0, 0});
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      if (progress->Cancelled()) cancelled = true;
+      if (!cancelled && map->Minimum() < c.threshold) {  // line 4
+        int pr, pc;
+        tracer.BeginPatch();
+        log.Begin();
+        clock.Start();
+        tie(pr, pc) = map->FindMinimum();  // line 5
+        map->Block(pr - s + 1, pc - s + 1, 2 * s - 1, 2 * s - 1);
+        clock.End(Stage::kSelect);
+        ++in_flight;
+        lock.unlock();
+        DenoisePatch(noisy, guide, pr, pc, c, &p, ws, output, weights,
+                     &clock);
+        lock.lock();
+        clock.Start();  // the wait for the lock is not counted
+        map->Unblock(pr - s + 1, pc - s + 1, 2 * s - 1, 2 * s - 1);
+        map->IncreaseWeights(p.k, pr - r, pc - r);  // line 24
+        clock.End(Stage::kUpdate);
+        // what the bookkeeping needs from the map, done without the lock
+        const float minimum = map->Minimum();
+        const double covered = progress->Due(*map);
+        --in_flight;
+        released.notify_all();
+        lock.unlock();
+        CountPatch(p, profile);
+        tracer.EndPatch(p, minimum);
+        log.End(p);
+        const bool go_on = progress->Continue(covered);
+        lock.lock();
+        if (!go_on) cancelled = true;
+      } else if (in_flight == 0) {
+        break;
+      } else {
+        // the remaining positions are blocked by patches in flight
+        released.wait(lock);
       }
     }
-    avg /= weight;
-    for (int row = 0; row < patch.rows(); ++row) {
-      for (int col = 0; col < patch.columns(); ++col) {
-        modified->space(col, row, chan) =
-            k.val(col, row) * patch.val(col, row, chan) +
-            (1.f - k.val(col, row)) * avg;
-      }
+    if (profile) {
+      profile->tile = i;
+      profile->worker = worker;
+      profile->seconds = utils::Seconds() - started;
     }
-    if (average) average[chan] = avg;
+    tracer.End();
+  });
+  if (!cancelled) progress->Finish();
+  return !cancelled;
+}
+
+}  // namespace
+
+const char *StageName(Stage stage) {
+  switch (stage) {
+    case Stage::kSelect: return "select";
+    case Stage::kExtract: return "extract";
+    case Stage::kWeights: return "weights";
+    case Stage::kRegression: return "regression";
+    case Stage::kModify: return "modify";
+    case Stage::kFft: return "fft";
+    case Stage::kShrink: return "shrink";
+    case Stage::kInverseFft: return "ifft";
+    case Stage::kAggregate: return "aggregate";
+    case Stage::kUpdate: return "update";
   }
+  return "";
 }
 
-pair<Image, Image> DA3D_block(const Image &noisy, const Image &guide,
-                              float sigma, const vector<float> &K_high,
-                              const vector<float> &K_low, bool use_lut,
-                              int r, float sigma_s, float gamma_r,
-                              float threshold) {
-  // useful values
-  const int s = utils::NextPowerOf2(2 * r + 1);
-  const float sigma2 = sigma * sigma;
-  const float gamma_r_sigma2 = gamma_r * sigma2;
-  const float sigma_s2 = sigma_s * sigma_s;
+bool Instrumented() { return kInstrument; }
 
-  // regression parameters
-  const float gamma_rr_sigma2 = gamma_r_sigma2 * 10.f;
-  const float sigma_sr2 = sigma_s2 * 2.f;
-
-  // declaration of internal variables
-  Image y(s, s, guide.channels());
-  Image g(s, s, guide.channels());
-  Image k_reg(s, s);
-  Image k(s, s);
-  DftPatch y_m(s, s, guide.channels());
-  DftPatch g_m(s, s, guide.channels());
-  int pr, pc;  // coordinates of the central pixel
-  vector<pair<float, float>> reg_plane(guide.channels());  // parameters of the regression plane
-  vector<float> yt(guide.channels());  // weighted average of the patch
-  WeightMap agg_weights(guide.rows() - s + 1, guide.columns() - s + 1);  // line 1
+std::string CheckParameters(const Parameters &params) {
+  if (params.r < 1) return "r must be positive";
+  // the other schedules ignore tile_size
+  if (params.schedule == Schedule::kFixed &&
+      params.tile_size < 2 * params.r + 1) {
+    return "tile_size must be at least 2 r + 1 with the fixed schedule";
+  }
+  if (!(params.sigma_s > 0.f) || !std::isfinite(params.sigma_s) ||
+      !(params.gamma_r > 0.f) || !std::isfinite(params.gamma_r) ||
+      !(params.threshold >= 0.f) || !std::isfinite(params.threshold)) {
+    return "sigma_s, gamma_r and threshold must be positive";
+  }
+  if (params.nthreads < 0) return "nthreads must be positive or 0";
+  if (params.schedule < Schedule::kPerThread ||
+      params.schedule > Schedule::kFixed) {
+    return "unknown schedule";
+  }
+  if (params.engine < Engine::kTiles || params.engine > Engine::kSharedMap) {
+    return "unknown engine";
+  }
+  // a single table would be ignored for the analytic curve
+  if (params.K_high.size() != params.K_low.size() ||
+      (!params.K_high.empty() && params.K_high.size() != kLutSize)) {
+    return "K_high and K_low must both be empty or both have 9 entries";
+  }
+  return "";
+}
 
-  Image output(guide.rows(), guide.columns(), guide.channels());
-  Image weights(guide.rows(), guide.columns());
+namespace {
 
-  // main loop
-  while (agg_weights.Minimum() < threshold) {  // line 4
-    tie(pr, pc) = agg_weights.FindMinimum();  // line 5
-    ExtractPatch(noisy, pr, pc, &y);  // line 6
-    ExtractPatch(guide, pr, pc, &g);  // line 7
-    BilateralWeight(g, &k_reg, r, gamma_rr_sigma2, sigma_sr2);  // line 8
-    ComputeRegressionPlane(y, g, k_reg, r, &reg_plane);  // line 9
-    SubtractPlane(r, reg_plane, &y);  // line 10
-    SubtractPlane(r, reg_plane, &g);  // line 11
-    BilateralWeight(g, &k, r, gamma_r_sigma2, sigma_s2);  // line 12
-    if (accumulate(k.begin(), k.end(), 0.f) < 10.f) {
-      for (float& v : k) v *= v;  // Square the weights
-      for (int row = 0; row < s; ++row) {
-        for (int col = 0; col < s; ++col) {
-          for (int chan = 0; chan < output.channels(); ++chan) {
-            output.val(col + pc, row + pr, chan) +=
-                (g.val(col, row, chan) + reg_plane[chan].first * (row - r) +
-                reg_plane[chan].second * (col - r)) * k.val(col, row);
-          }
-          weights.val(col + pc, row + pr) += k.val(col, row);
-        }
+void StagesJson(const double *seconds, std::ostringstream *out) {
+  *out << "{";
+  for (int i = 0; i < kStages; ++i) {
+    *out << (i ? ", " : "") << "\"" << StageName(static_cast<Stage>(i))
+         << "\": " << seconds[i];
+  }
+  *out << "}";
+}
+
+void CountersJson(const TileProfile &profile, std::ostringstream *out) {
+  *out << "\"patches\": " << profile.patches
+       << ", \"shortcuts\": " << profile.shortcuts
+       << ", \"seconds\": " << profile.seconds << ", \"stages\": ";
+  StagesJson(profile.stage_seconds, out);
+}
+
+void AddCounters(const TileProfile &profile, TileProfile *sum) {
+  sum->patches += profile.patches;
+  sum->shortcuts += profile.shortcuts;
+  sum->seconds += profile.seconds;
+  for (int i = 0; i < kStages; ++i) {
+    sum->stage_seconds[i] += profile.stage_seconds[i];
+  }
+}
+
+}  // namespace
+
+std::string RunStatsJson(const RunStats &stats) {
+  TileProfile total;
+  std::map<int, pair<int, TileProfile>> workers;  // tiles and counters
+  for (const TileProfile &profile : stats.profile) {
+    AddCounters(profile, &total);
+    ++workers[profile.worker].first;
+    AddCounters(profile, &workers[profile.worker].second);
+  }
+  std::ostringstream out;
+  out << "{\"threads\": " << stats.threads << ", \"tiles\": " << stats.tiles
+      << ", \"seconds\": " << stats.seconds
+      << ", \"patches\": " << stats.patches
+      << ", \"padding_ratio\": " << stats.padding_ratio
+      << ", \"estimated_efficiency\": " << stats.estimated_efficiency
+      << ", \"instrumented\": " << (Instrumented() ? "true" : "false")
+      << ", \"total\": {";
+  CountersJson(total, &out);
+  out << "}, \"workers\": [";
+  for (auto it = workers.begin(); it != workers.end(); ++it) {
+    out << (it != workers.begin() ? ", " : "") << "{\"worker\": " << it->first
+        << ", \"tiles\": " << it->second.first << ", ";
+    CountersJson(it->second.second, &out);
+    out << "}";
+  }
+  out << "], \"tile_profiles\": [";
+  for (size_t i = 0; i < stats.profile.size(); ++i) {
+    const TileProfile &profile = stats.profile[i];
+    out << (i ? ", " : "") << "{\"frame\": " << profile.frame
+        << ", \"tile\": " << profile.tile << ", \"worker\": " << profile.worker
+        << ", ";
+    CountersJson(profile, &out);
+    out << "}";
+  }
+  out << "]}";
+  return out.str();
+}
+
+Denoiser::Denoiser(const Parameters &params,
+                   std::shared_ptr<Executor> executor)
+    : params_(params),
+      executor_(executor ? std::move(executor) : DefaultExecutor()) {
+  // the shrinkage interpolates between the 9 entries of the tables, and the
+  // fixed tiling divides by the tile size
+  assert(params_.K_high.size() == params_.K_low.size());
+  assert(params_.K_high.empty() || params_.K_high.size() == kLutSize);
+  assert(params_.schedule != Schedule::kFixed || params_.tile_size >= 1);
+  assert(params_.nthreads >= 0);
+  nthreads_ = params_.nthreads ? params_.nthreads : executor_->concurrency();
+  PrepareWorkspaces(params_.channels);
+}
+
+Denoiser::~Denoiser() = default;
+
+void Denoiser::PrepareWorkspaces(int channels) {
+  params_.channels = channels;
+  workspaces_.clear();
+  workspaces_.resize(executor_->slots(nthreads_));
+  // Every worker creates (and first touches) its own workspace, so that on
+  // NUMA systems its memory is local. The workers that do not take part here
+  // create theirs when first used.
+  executor_->ParallelFor(nthreads_, nthreads_, [this](int, int worker) {
+    utils::ScopedPin pin(WorkerCpu(params_, worker));
+    Workspace(worker);
+  });
+}
+
+BlockWorkspace *Denoiser::Workspace(int worker) {
+  // The FFT plans depend on the number of channels, so they are created again
+  // only if it changes. FFTW_MEASURE chooses the algorithm from timings, so
+  // different threads (or runs) could round differently: reproducible
+  // results need FFTW_ESTIMATE. DftPatch serializes the planning.
+  std::unique_ptr<BlockWorkspace> &ws = workspaces_[worker];
+  if (!ws) {
+    const int s = NextPowerOf2(2 * params_.r + 1);
+    const unsigned fft_flags =
+        params_.schedule == Schedule::kFixed ? FFTW_ESTIMATE : FFTW_MEASURE;
+    ws.reset(new BlockWorkspace(s, params_.channels, fft_flags));
+  }
+  return ws.get();
+}
+
+bool Denoiser::Denoise(const Image &noisy, const Image &guide, float sigma,
+                       Image *out) {
+  if (out->shape() != guide.shape() || out->channels() != guide.channels()) {
+    out->Resize(guide.rows(), guide.columns(), guide.channels());
+  }
+  return Denoise(ConstImageView(noisy), ConstImageView(guide), sigma,
+                 ImageView(*out));
+}
+
+bool Denoiser::Denoise(ConstImageView noisy, ConstImageView guide,
+                       float sigma, ImageView out) {
+  Frame frame = {noisy, guide, sigma, out};
+  return Denoise(&frame, 1);
+}
+
+bool Denoiser::Denoise(const Frame *frames, int count) {
+  if (count < 1) return true;
+  const int r = params_.r;
+  const int s = NextPowerOf2(2 * r + 1);
+  const int channels = frames[0].guide.channels();
+  for (int f = 0; f < count; ++f) {
+    assert(frames[f].noisy.shape() == frames[f].guide.shape());
+    assert(frames[f].noisy.channels() == channels);
+    assert(frames[f].guide.channels() == channels);
+    assert(frames[f].out.shape() == frames[f].guide.shape());
+    assert(frames[f].out.channels() == channels);
+  }
+  if (channels != params_.channels) PrepareWorkspaces(channels);
+
+  // Two-level schedule: every frame is split in tiles, and all the tiles of
+  // all the frames are processed by a single parallel loop. With kPerThread
+  // every frame gets enough tiles for the frames to keep all the threads busy
+  // (a single frame gets one tile per thread), with kFixed the tiles have a
+  // fixed size, otherwise the tilings come from the cost model, which with
+  // kAuto also chooses the number of threads. The tiles are processed
+  // independently and merged in a fixed order, so the result depends only on
+  // the tilings. When pipelined, every tile takes two of the threads.
+  double start = utils::Seconds();
+  TraceRecorder *trace = trace_.get();
+  double phase = trace ? trace->Now() : 0.;
+  if (trace) trace->NameTrack(kCallerTrack, "caller");
+  while (static_cast<int>(frames_.size()) < count) {
+    frames_.emplace_back(new FrameBuffers);
+  }
+  vector<pair<int, int>> shapes;
+  for (int f = 0; f < count; ++f) shapes.push_back(frames[f].guide.shape());
+  const bool pipelined =
+      params_.pipelined && params_.engine == Engine::kTiles;
+  const int max_threads = pipelined ? max(1, nthreads_ / 2) : nthreads_;
+  int threads = max_threads;
+  if (params_.engine == Engine::kSharedMap) {
+    for (int f = 0; f < count; ++f) frames_[f]->tiling = {1, 1};
+  } else if (params_.schedule == Schedule::kPerThread) {
+    const int tiles_per_frame = max(1, (threads + count - 1) / count);
+    for (int f = 0; f < count; ++f) {
+      frames_[f]->tiling = ComputeTiling(frames[f].guide.rows(),
+                                         frames[f].guide.columns(),
+                                         tiles_per_frame);
+    }
+  } else if (params_.schedule == Schedule::kFixed) {
+    for (int f = 0; f < count; ++f) {
+      frames_[f]->tiling = utils::ComputeFixedTiling(
+          frames[f].guide.rows(), frames[f].guide.columns(),
+          params_.tile_size);
+    }
+  } else {
+    if (params_.schedule == Schedule::kAuto) {
+      threads = ComputeBatchThreads(shapes, max_threads, s - 1);
+    }
+    vector<pair<int, int>> tilings = ComputeBatchTiling(shapes, threads,
+                                                        s - 1);
+    for (int f = 0; f < count; ++f) frames_[f]->tiling = tilings[f];
+  }
+  tasks_.clear();
+  for (int f = 0; f < count; ++f) {
+    int tiles = frames_[f]->tiling.first * frames_[f]->tiling.second;
+    frames_[f]->result_tiles.resize(tiles);
+    for (int t = 0; t < tiles; ++t) tasks_.emplace_back(f, t);
+  }
+  if (params_.engine == Engine::kTiles &&
+      params_.schedule != Schedule::kPerThread) {
+    // largest tiles first, so that the small ones fill the gaps at the end
+    auto tile_cost = [&](const pair<int, int> &task) {
+      const FrameBuffers &fb = *frames_[task.first];
+      return utils::TilingCost(frames[task.first].guide.rows(),
+                               frames[task.first].guide.columns(), fb.tiling,
+                               s - 1) / (fb.tiling.first * fb.tiling.second);
+    };
+    std::stable_sort(tasks_.begin(), tasks_.end(),
+                     [&](const pair<int, int> &a, const pair<int, int> &b) {
+                       return tile_cost(a) > tile_cost(b);
+                     });
+  }
+
+  // what the cost model expects from the chosen schedule
+  stats_ = RunStats();
+  stats_.threads = pipelined ? min(2 * threads, nthreads_) : threads;
+  stats_.tiles = static_cast<int>(tasks_.size());
+  double area = 0., processed = 0.;
+  for (int f = 0; f < count; ++f) {
+    stats_.tilings.push_back(frames_[f]->tiling);
+    area += static_cast<double>(shapes[f].first) * shapes[f].second;
+    processed += utils::TilingCost(shapes[f].first, shapes[f].second,
+                                   frames_[f]->tiling, s - 1);
+  }
+  stats_.padding_ratio = processed / area;
+  if (params_.engine == Engine::kSharedMap) {
+    stats_.estimated_efficiency = 1.;  // the threads share every image
+  } else {
+    stats_.estimated_efficiency =
+        utils::BatchTime(shapes, vector<pair<int, int>>(count, {1, 1}), 1,
+                         s - 1) /
+        (threads * utils::BatchTime(shapes, stats_.tilings, threads, s - 1));
+  }
+
+  if (trace) {
+    trace->Span(kCallerTrack, "schedule", phase, trace->Now());
+    phase = trace->Now();
+  }
+
+  const CancellationToken *token = cancellation_.get();
+  bool completed = true;
+  if (params_.engine == Engine::kSharedMap) {
+    // one image at a time, with all the threads
+    for (int f = 0; f < count && completed; ++f) {
+      if (trace) phase = trace->Now();
+      FrameBuffers &fb = *frames_[f];
+      fb.noisy_tiles.resize(1);
+      fb.guide_tiles.resize(1);
+      fb.noisy_tiles[0].Resize(frames[f].guide.rows() + s - 1,
+                               frames[f].guide.columns() + s - 1, channels);
+      fb.guide_tiles[0].Resize(frames[f].guide.rows() + s - 1,
+                               frames[f].guide.columns() + s - 1, channels);
+      utils::ExtractTile(frames[f].noisy, r, s - r - 1, {1, 1}, 0,
+                         fb.noisy_tiles[0]);
+      utils::ExtractTile(frames[f].guide, r, s - r - 1, {1, 1}, 0,
+                         fb.guide_tiles[0]);
+      ColorTransform(fb.noisy_tiles[0]);
+      ColorTransform(fb.guide_tiles[0]);
+      if (trace) trace->Span(kCallerTrack, "extract", phase, trace->Now());
+      TileProgress progress(progress_ ? &progress_ : nullptr,
+                            progress_interval_, token, params_.threshold, f,
+                            count);
+      vector<TileProfile> profiles(kInstrument ? threads : 0);
+      completed = DA3D_shared(
+          fb.noisy_tiles[0], fb.guide_tiles[0], frames[f].sigma, params_,
+          executor_.get(), threads,
+          [this](int worker) { return Workspace(worker); }, &progress,
+          profiles.empty() ? nullptr : profiles.data(), trace, f,
+          heatmap_cell_ > 0, &fb.map, &fb.result_tiles[0].first,
+          &fb.result_tiles[0].second);
+      for (TileProfile &profile : profiles) {
+        profile.frame = f;
+        stats_.profile.push_back(profile);
       }
+      stats_.patches += progress.patches();
+    }
+  } else {
+    completed = ProcessTasks(frames, threads, pipelined, start);
+  }
+  CollectHeatmaps(frames, count);
+  if (!completed) {
+    stats_.seconds = utils::Seconds() - start;
+    return false;
+  }
+
+  if (trace) phase = trace->Now();
+  executor_->ParallelFor(count, threads, [&](int f, int worker) {
+    const double merge = trace ? trace->Now() : 0.;
+    FrameBuffers &fb = *frames_[f];
+    MergeTiles(fb.result_tiles, frames[f].guide.shape(), r, s - r - 1,
+               fb.tiling, frames[f].out, &fb.weights);
+    ColorTransformInverse(frames[f].out);
+    if (trace) {
+      trace->Span(WorkerTrack(trace, worker), "merge", merge, trace->Now(),
+                  "{\"frame\": " + std::to_string(f) + "}");
+    }
+  });
+  if (trace) trace->Span(kCallerTrack, "merge", phase, trace->Now());
+  stats_.seconds = utils::Seconds() - start;
+  return true;
+}
+
+bool Denoiser::ProcessTasks(const Frame *frames, int threads, bool pipelined,
+                            double start) {
+  const int r = params_.r;
+  const int s = NextPowerOf2(2 * r + 1);
+  for (auto &ws : workspaces_) {
+    if (!ws) continue;
+    ws->results.Reset();
+    ws->front_events.clear();
+    ws->back_events.clear();
+  }
+  const int ntasks = static_cast<int>(tasks_.size());
+  const CancellationToken *token = cancellation_.get();
+  std::atomic<bool> cancelled(false);
+  std::atomic<int64_t> patches(0);
+  if (kInstrument) stats_.profile.assign(ntasks, TileProfile());
+  // When pipelined, every tile is two indexes of the loop, one per lane, so
+  // that the executor runs both lanes within its number of workers
+  std::unique_ptr<Handoff[]> handoffs(pipelined ? new Handoff[ntasks]
+                                                : nullptr);
+  const int workers = pipelined ? min(2 * threads, nthreads_) : threads;
+  executor_->ParallelFor(pipelined ? 2 * ntasks : ntasks, workers,
+                         [&](int index, int worker) {
+    const int i = pipelined ? index / 2 : index;
+    Handoff *handoff = pipelined ? &handoffs[i] : nullptr;
+    TraceRecorder *trace = trace_.get();
+    if (handoff && handoff->Arrive() == Handoff::kBack) {
+      utils::ScopedPin pin(WorkerCpu(params_, worker));
+      handoff->Back(trace, trace ? WorkerTrack(trace, worker) : 0);
+      return;
+    }
+    // the tiles not started yet are skipped
+    if (token && token->cancelled()) {
+      cancelled = true;
+      if (handoff) handoff->Close();
+      return;
+    }
+    TileProfile *profile = kInstrument ? &stats_.profile[i] : nullptr;
+    const double started = profile ? utils::Seconds() : 0.;
+    const double prepared = trace ? trace->Now() : 0.;
+    utils::ScopedPin pin(WorkerCpu(params_, worker));
+    BlockWorkspace *ws = Workspace(worker);
+    const int f = tasks_[i].first, t = tasks_[i].second;
+    FrameBuffers &fb = *frames_[f];
+    Image noisy, guide;
+    ws->scratch.Reset();
+    PrepareTile(frames[f].noisy, r, s - r - 1, fb.tiling, t, &ws->scratch,
+                &noisy);
+    PrepareTile(frames[f].guide, r, s - r - 1, fb.tiling, t, &ws->scratch,
+                &guide);
+    TileSaver saver;
+    if (checkpoint_) {
+      // the tile is identified by its place in the frame and everything its
+      // result depends on, but not by the number of threads, so that a run
+      // can resume on any number of threads that gives the same tiling
+      const int rows = frames[f].guide.rows();
+      const int columns = frames[f].guide.columns();
+      const pair<int, int> origin = utils::TileOrigin(rows, columns,
+                                                      fb.tiling, t);
+      ContentHash hash;
+      HashTileParameters(params_, &hash);
+      hash.Add(static_cast<uint64_t>(rows));
+      hash.Add(static_cast<uint64_t>(columns));
+      hash.Add(static_cast<uint64_t>(fb.tiling.first));
+      hash.Add(static_cast<uint64_t>(fb.tiling.second));
+      hash.Add(static_cast<uint64_t>(origin.first));
+      hash.Add(static_cast<uint64_t>(origin.second));
+      hash.Add(frames[f].sigma);
+      hash.Add(noisy);
+      hash.Add(guide);
+      saver = TileSaver(checkpoint_.get(), hash.Hex());
+    }
+    TileProgress progress(progress_ ? &progress_ : nullptr,
+                          progress_interval_, token, params_.threshold, i,
+                          ntasks);
+    TileTracer tracer;
+    if (trace) {
+      const int track = WorkerTrack(trace, worker);
+      trace->Span(track, "prepare", prepared, trace->Now(),
+                  "{\"frame\": " + std::to_string(f) + ", \"tile\": " +
+                      std::to_string(t) + "}");
+      tracer = TileTracer(trace, track, f, t);
+    }
+    PatchLog log;
+    if (heatmap_cell_ > 0) {
+      log = PatchLog(&ws->front_patches, f,
+                     utils::TileOrigin(frames[f].guide.rows(),
+                                       frames[f].guide.columns(), fb.tiling,
+                                       t));
+    }
+    bool completed;
+    if (pipelined) {
+      completed = DA3D_block_pipelined(
+          noisy, guide, frames[f].sigma, params_, ws,
+          &fb.result_tiles[t].first, &fb.result_tiles[t].second, &saver,
+          &progress, profile, &tracer, &log,
+          timeline_ ? &ws->front_events : nullptr,
+          timeline_ ? &ws->back_events : nullptr, i, start, handoff);
     } else {
-      ModifyPatch(y, k, &y_m, yt.data());  // line 13
-      ModifyPatch(g, k, &g_m);  // line 14
-      y_m.ToFreq();  // line 15
-      g_m.ToFreq();  // line 16
-      float sigma_f2 = 0.f;
-      for (int row = 0; row < s; ++row) {
-        for (int col = 0; col < s; ++col) {
-          sigma_f2 += k.val(col, row) * k.val(col, row);
-        }
-      }
-      sigma_f2 *= sigma2;  // line 17
-      for (int row = 0; row < y_m.frows(); ++row) {
-        for (int col = 0; col < y_m.fcolumns(); ++col) {
-          for (int chan = 0; chan < y_m.channels(); ++chan) {
-            if (row || col) {
-              float x = norm(g_m.freq(col, row, chan)) / sigma_f2;
-              float K;
-              if (use_lut) {
-                if (x >= 2.f) {
-                  K = 1.f;
-                } else {
-                  float in;
-                  float fr = modf(4 * x, &in);
-                  int i = static_cast<int>(in);
-                  if (((16 < row) && (row < s - 16)) ||
-                      ((16 < col) && (col < s - 16))) {
-                    K = K_high[i] * (1.f - fr) + K_high[i + 1] * fr;
-                  } else {
-                    K = K_low[i] * (1.f - fr) + K_low[i + 1] * fr;
-                  }
-                }
-              } else {
-                K = utils::fastexp(-.8f / x);  // line 18
-              }
-              y_m.freq(col, row, chan) *= K;
-            }
-          }
-        }
-      }
-      y_m.ToSpace();  // line 19
-
-      // lines 20,21,25
-      // col and row are the "internal" indexes (with respect to the patch).
-      for (int row = 0; row < s; ++row) {
-        for (int col = 0; col < s; ++col) {
-          for (int chan = 0; chan < output.channels(); ++chan) {
-            float pij = (row - r) * reg_plane[chan].first +
-                        (col - r) * reg_plane[chan].second;
-            float kij = k.val(col, row);
-            output.val(col + pc, row + pr, chan) +=
-                (y_m.space(col, row, chan) - (1.f - kij) * yt[chan] +
-                pij * kij) * kij;
-          }
-          k.val(col, row) *= k.val(col, row);  // line 22
-          weights.val(col + pc, row + pr) += k.val(col, row);
-        }
-      }
+      completed = DA3D_block(noisy, guide, frames[f].sigma, params_, ws,
+                             &fb.result_tiles[t].first,
+                             &fb.result_tiles[t].second, &saver, &progress,
+                             profile, &tracer, &log);
     }
-    agg_weights.IncreaseWeights(k, pr - r, pc - r);  // line 24
+    if (!completed) cancelled = true;
+    patches += progress.patches();
+    if (profile) {
+      profile->frame = f;
+      profile->tile = t;
+      profile->worker = worker;
+      profile->seconds = utils::Seconds() - started;
+    }
+  });
+  stats_.patches = patches;
+  // in the order of the images, not of the schedule
+  std::sort(stats_.profile.begin(), stats_.profile.end(),
+            [](const TileProfile &a, const TileProfile &b) {
+              return std::tie(a.frame, a.tile) < std::tie(b.frame, b.tile);
+            });
+  if (pipelined && timeline_) {
+    for (auto &ws : workspaces_) {
+      if (!ws) continue;
+      stats_.timeline.insert(stats_.timeline.end(), ws->front_events.begin(),
+                             ws->front_events.end());
+      stats_.timeline.insert(stats_.timeline.end(), ws->back_events.begin(),
+                             ws->back_events.end());
+    }
+    std::sort(stats_.timeline.begin(), stats_.timeline.end(),
+              [](const StageEvent &a, const StageEvent &b) {
+                return a.start < b.start;
+              });
+  }
+  return !cancelled;
+}
+
+bool Denoiser::DenoiseTiles(ConstImageView noisy, ConstImageView guide,
+                            float sigma, pair<int, int> tiling,
+                            const vector<int> &tiles,
+                            vector<pair<Image, Image>> *results) {
+  assert(noisy.shape() == guide.shape());
+  assert(noisy.channels() == guide.channels());
+  assert(params_.engine == Engine::kTiles);
+  if (guide.channels() != params_.channels) {
+    PrepareWorkspaces(guide.channels());
+  }
+  double start = utils::Seconds();
+  if (frames_.empty()) frames_.emplace_back(new FrameBuffers);
+  FrameBuffers &fb = *frames_[0];
+  fb.tiling = tiling;
+  fb.result_tiles.resize(tiling.first * tiling.second);
+  tasks_.clear();
+  for (int t : tiles) tasks_.emplace_back(0, t);
+  const bool pipelined = params_.pipelined;
+  const int threads = pipelined ? max(1, nthreads_ / 2) : nthreads_;
+  Frame frame = {noisy, guide, sigma, ImageView()};
+  stats_ = RunStats();
+  stats_.threads = pipelined ? min(2 * threads, nthreads_) : threads;
+  stats_.tiles = static_cast<int>(tiles.size());
+  stats_.tilings.push_back(tiling);
+  bool completed = ProcessTasks(&frame, threads, pipelined, start);
+  CollectHeatmaps(&frame, 1);
+  results->clear();
+  if (completed) {
+    for (int t : tiles) results->push_back(std::move(fb.result_tiles[t]));
   }
+  stats_.seconds = utils::Seconds() - start;
+  return completed;
+}
 
-  return {move(output), move(weights)};
+void Denoiser::CollectHeatmaps(const Frame *frames, int count) {
+  const int cell = heatmap_cell_;
+  heatmaps_ = Heatmaps();
+  if (cell <= 0) return;
+  heatmaps_.cell = cell;
+  for (int f = 0; f < count; ++f) {
+    const int rows = (frames[f].guide.rows() + cell - 1) / cell;
+    const int columns = (frames[f].guide.columns() + cell - 1) / cell;
+    heatmaps_.patches.emplace_back(rows, columns, 1);
+    heatmaps_.seconds.emplace_back(rows, columns, 1);
+  }
+  for (auto &ws : workspaces_) {
+    if (!ws) continue;
+    for (vector<PatchRecord> *records :
+         {&ws->front_patches, &ws->back_patches}) {
+      for (const PatchRecord &record : *records) {
+        const int col = record.column / cell, row = record.row / cell;
+        heatmaps_.patches[record.frame].val(col, row) += record.patches;
+        heatmaps_.seconds[record.frame].val(col, row) += record.seconds;
+      }
+      records->clear();
+    }
+  }
 }
 
-}  // namespace
+void MergeTileResults(const vector<pair<Image, Image>> &results, int r,
+                      pair<int, int> tiling, ImageView out) {
+  const int s = NextPowerOf2(2 * r + 1);
+  Image weights;
+  utils::MergeTiles(results, out.shape(), r, s - r - 1, tiling, out,
+                    &weights);
+  ColorTransformInverse(out);
+}
 
 Image DA3D(const Image &noisy, const Image &guide, float sigma,
            const vector<float> &K_high, const vector<float> &K_low,
            bool use_lut, int nthreads, int r, float sigma_s, float gamma_r,
            float threshold) {
-  // padding and color transformation
-  const int s = utils::NextPowerOf2(2 * r + 1);
+  Parameters params;
+  params.r = r;
+  params.sigma_s = sigma_s;
+  params.gamma_r = gamma_r;
+  params.threshold = threshold;
+  params.channels = guide.channels();
+  if (use_lut) {
+    params.K_high = K_high;
+    params.K_low = K_low;
+  }
+  params.nthreads = max(nthreads, 0);
+  if (nthreads < 0) params.schedule = Schedule::kAuto;
 
-#ifdef _OPENMP
-  if (!nthreads) nthreads = omp_get_max_threads();  // number of threads
-#else
-  nthreads = 1;
-#endif  // _OPENMP
-
-  pair<int, int> tiling = ComputeTiling(guide.rows(), guide.columns(),
-                                        nthreads);
-  vector<Image> noisy_tiles = SplitTiles(ColorTransform(noisy.copy()), r,
-                                         s - r - 1, tiling);
-  vector<Image> guide_tiles = SplitTiles(ColorTransform(guide.copy()), r,
-                                         s - r - 1, tiling);
-  vector<pair<Image, Image>> result_tiles(nthreads);
-
-#pragma omp parallel for num_threads(nthreads)
-  for (int i = 0; i < nthreads; ++i) {
-    result_tiles[i] = DA3D_block(noisy_tiles[i], guide_tiles[i], sigma, K_high,
-                                 K_low, use_lut, r, sigma_s, gamma_r,
-                                 threshold);
-  }
-  return ColorTransformInverse(MergeTiles(result_tiles, guide.shape(), r,
-                                          s - r - 1, tiling));
+  Image output;
+  Denoiser(params).Denoise(noisy, guide, sigma, &output);
+  return output;
 }
 
 }  // namespace da3d
@@ -8,10 +8,307 @@
 #ifndef DA3D_DA3D_HPP_
 #define DA3D_DA3D_HPP_
 
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "Executor.hpp"
 #include "Image.hpp"
+#include "ImageView.hpp"
 
 namespace da3d {
 
+// How the images of a call are split in tiles among the threads
+enum class Schedule {
+  kPerThread,  // every image in one tile per thread (shared among the images)
+  kThroughput,  // tiles chosen by a halo-overhead cost model for the batch
+  kAuto,  // like kThroughput, also using fewer threads when they would
+          // mostly process padding
+  kFixed,  // tiles of about tile_size pixels: the result is bitwise
+           // identical for any number of threads
+};
+
+// How the patches of an image are chosen and distributed to the threads
+enum class Engine {
+  kTiles,  // every tile has its own weight map, following the schedule
+  kSharedMap,  // a single weight map for the whole image, from which all the
+               // threads claim non-overlapping patches (no tiles, no seams)
+};
+
+// Parameters of the algorithm. They are fixed for the lifetime of a Denoiser.
+struct Parameters {
+  int r = 31;  // radius of the patches
+  float sigma_s = 14.f;  // spatial parameter of the bilateral weights
+  float gamma_r = .7f;  // range parameter of the bilateral weights
+  float threshold = 2.f;  // minimum aggregation weight of every pixel
+  int channels = 1;  // number of channels the FFT plans are prepared for
+  // shrinkage look-up tables, both given or both empty for the analytic curve
+  std::vector<float> K_high{};
+  std::vector<float> K_low{};
+  int nthreads = 0;  // 0 means the concurrency of the executor
+  Schedule schedule = Schedule::kPerThread;
+  int tile_size = 256;  // side of the tiles with Schedule::kFixed
+  Engine engine = Engine::kTiles;  // kSharedMap ignores the schedule
+  // With kTiles, every tile uses two workers of the executor: one prepares
+  // the next patch while the other shrinks and aggregates the current one
+  bool pipelined = false;
+  // Pins every worker thread to its own processor, in
+  // the order of the processors allowed by numactl or taskset, while it
+  // processes a tile. The threads get their affinity back afterwards.
+  bool pin_threads = false;
+};
+
+inline bool operator==(const Parameters &a, const Parameters &b) {
+  return a.r == b.r && a.sigma_s == b.sigma_s && a.gamma_r == b.gamma_r &&
+         a.threshold == b.threshold && a.channels == b.channels &&
+         a.K_high == b.K_high && a.K_low == b.K_low &&
+         a.nthreads == b.nthreads && a.schedule == b.schedule &&
+         a.tile_size == b.tile_size && a.engine == b.engine &&
+         a.pipelined == b.pipelined && a.pin_threads == b.pin_threads;
+}
+
+inline bool operator!=(const Parameters &a, const Parameters &b) {
+  return !(a == b);
+}
+
+// entries of Parameters::K_high and K_low, when given
+const int kLutSize = 9;
+
+// Returns why params cannot be used, or an empty string. The Denoiser
+// requires valid parameters, so the interfaces that take them from users
+// report this first.
+std::string CheckParameters(const Parameters &params);
+
+// One image of a batch. The result is written into out, which must have the
+// shape of guide and must not overlap the inputs.
+struct Frame {
+  ConstImageView noisy;
+  ConstImageView guide;
+  float sigma;
+  ImageView out;
+};
+
+// Stages of the processing of a patch
+enum class Stage {
+  kSelect,  // lines 4-5, position of the minimum weight
+  kExtract,  // lines 6-7
+  kWeights,  // lines 8 and 12, bilateral weights
+  kRegression,  // lines 9-11
+  kModify,  // lines 13-14
+  kFft,  // lines 15-16
+  kShrink,  // lines 17-18
+  kInverseFft,  // line 19
+  kAggregate,  // lines 20-22
+  kUpdate,  // line 24, update of the weight map
+};
+
+const int kStages = 10;  // number of values of Stage
+
+const char *StageName(Stage stage);
+
+// A stage of one patch of a pipelined run. Lane 0 selects and prepares the
+// patches of the tile, lane 1 shrinks and aggregates them (lane 0 does it
+// too while no worker is free for lane 1).
+struct StageEvent {
+  Stage stage;
+  int tile;  // index of the tile in the call
+  int lane;
+  double start;  // seconds from the beginning of the call
+  double end;
+};
+
+// Counters of one tile, or of one thread with Engine::kSharedMap
+struct TileProfile {
+  int frame = 0;  // index of the image in the call
+  int tile = 0;  // index of the tile in its image, or of the thread
+  int worker = 0;  // worker of the executor that processed it
+  int64_t patches = 0;
+  int64_t shortcuts = 0;  // patches with sum(k) < 10, aggregated directly
+  double seconds = 0.;  // wall time, including the preparation of the tile
+  // time spent in every stage, indexed by Stage; with Parameters::pipelined
+  // the stages of the two lanes overlap
+  double stage_seconds[kStages] = {};
+};
+
+// True if the library was built with DA3D_INSTRUMENT, which fills
+// RunStats::profile. Without it the counters are compiled out.
+bool Instrumented();
+
+// What a call to Denoiser::Denoise did
+struct RunStats {
+  int threads = 0;  // threads used (with pipelining, two per tile)
+  int tiles = 0;  // total number of tiles
+  std::vector<std::pair<int, int>> tilings{};  // tile rows x columns per image
+  double padding_ratio = 0.;  // estimated processed area over image area
+  double estimated_efficiency = 0.;  // estimated parallel efficiency
+  double seconds = 0.;  // wall time of the call
+  int64_t patches = 0;  // patches denoised
+  // stages of all the patches, sorted by start, only with
+  // Parameters::pipelined and Denoiser::set_timeline
+  std::vector<StageEvent> timeline{};
+  // counters of every tile, only if Instrumented()
+  std::vector<TileProfile> profile{};
+};
+
+// stats as a JSON object, with the counters also summed per stage and per
+// worker
+std::string RunStatsJson(const RunStats &stats);
+
+// Where the patches of a call were centred and what they cost, for every
+// image, summed over cells of cell x cell pixels
+struct Heatmaps {
+  int cell = 0;
+  std::vector<Image> patches{};  // number of patches centred in every cell
+  // seconds spent on those patches; with Parameters::pipelined the time of
+  // both lanes
+  std::vector<Image> seconds{};
+};
+
+// Set by any thread to stop the calls that check it as soon as possible
+class CancellationToken {
+ public:
+  void Cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+  void Reset() { cancelled_.store(false, std::memory_order_relaxed); }
+  bool cancelled() const {
+    return cancelled_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<bool> cancelled_{false};
+};
+
+// Called with the index of a tile among the tiles of the call and the
+// fraction of the positions of its weight map that reached the threshold,
+// i.e. that need no more patches. Called by the worker threads, so it must
+// be thread-safe and quick.
+using ProgressCallback =
+    std::function<void(int tile, int tiles, double covered)>;
+
+// per-thread scratch state and per-image buffers, defined in DA3D.cpp
+struct BlockWorkspace;
+struct FrameBuffers;
+class Checkpoint;
+class TraceRecorder;
+
+// Reusable denoising context. The FFT plans, the look-up tables and all the
+// scratch buffers are created once and reused by every call to Denoise, so
+// that repeated calls with images of the same size do not allocate memory.
+// A Denoiser must not be used by two threads at the same time, but several
+// Denoisers can share an executor: with a ThreadPool, concurrent calls share
+// its threads.
+class Denoiser {
+ public:
+  // a null executor means DefaultExecutor()
+  explicit Denoiser(const Parameters &params = Parameters(),
+                    std::shared_ptr<Executor> executor = nullptr);
+  ~Denoiser();
+
+  Denoiser(const Denoiser&) = delete;
+  Denoiser& operator=(const Denoiser&) = delete;
+
+  // All the Denoise functions return false if the call was cancelled, in
+  // which case the content of the output is unspecified.
+  bool Denoise(const Image &noisy, const Image &guide, float sigma,
+               Image *out);
+  // Reads the inputs and writes the result through views, so that memory
+  // with a different layout is used in place. out must have the shape of
+  // guide and must not overlap the inputs.
+  bool Denoise(ConstImageView noisy, ConstImageView guide, float sigma,
+               ImageView out);
+  // Denoises count images with the same number of channels in a single
+  // parallel region, spreading both images and tiles across the threads.
+  bool Denoise(const Frame *frames, int count);
+
+  // Lower-level interface, to spread the tiles of an image over several
+  // processes. Denoises some of the tiles of the image split with the given
+  // tiling (indexes in row-major order), without merging them: (*results)[i]
+  // gets the output and the weights of tiles[i], padded as by
+  // utils::SplitTiles and still in the decorrelated color space. They are
+  // valid until the next call, and empty if the call was cancelled.
+  // Requires Engine::kTiles.
+  bool DenoiseTiles(ConstImageView noisy, ConstImageView guide, float sigma,
+                    std::pair<int, int> tiling, const std::vector<int> &tiles,
+                    std::vector<std::pair<Image, Image>> *results);
+
+  // Reports the progress of every tile to callback when it starts and ends,
+  // and at most every interval seconds in between. An empty callback
+  // disables.
+  void set_progress(ProgressCallback callback, double interval = .5) {
+    progress_ = std::move(callback);
+    progress_interval_ = interval;
+  }
+  // The calls check token after every patch and stop when it is cancelled.
+  // Null disables.
+  void set_cancellation(std::shared_ptr<const CancellationToken> token) {
+    cancellation_ = std::move(token);
+  }
+  // Saves the progress of every tile to checkpoint while it is denoised, and
+  // resumes the tiles found there. The tiles are keyed by their geometry and
+  // inputs, so a run resumes on another number of threads only when the
+  // tiling is the same, as always with Schedule::kFixed. Used with
+  // Engine::kTiles; null disables.
+  void set_checkpoint(std::shared_ptr<Checkpoint> checkpoint) {
+    checkpoint_ = std::move(checkpoint);
+  }
+  // Records the timeline of every call into trace; null disables
+  void set_trace(std::shared_ptr<TraceRecorder> trace) {
+    trace_ = std::move(trace);
+  }
+  // Records where every patch is centred and how long it takes, into
+  // heatmaps with cells of cell x cell pixels; 0 disables
+  void set_heatmaps(int cell) { heatmap_cell_ = cell; }
+  // Records the stages of every patch of the pipelined calls into
+  // RunStats::timeline
+  void set_timeline(bool enabled) { timeline_ = enabled; }
+
+  const Parameters &parameters() const { return params_; }
+  int nthreads() const { return nthreads_; }
+  const std::shared_ptr<Executor> &executor() const { return executor_; }
+  // statistics of the last call to Denoise
+  const RunStats &stats() const { return stats_; }
+  // heatmaps of the last call, if enabled
+  const Heatmaps &heatmaps() const { return heatmaps_; }
+
+ private:
+  void PrepareWorkspaces(int channels);
+  // the workspace of a worker of the executor, created on first use
+  BlockWorkspace *Workspace(int worker);
+  // runs DA3D_block on tasks_, threads tiles at a time; returns false if
+  // cancelled
+  bool ProcessTasks(const Frame *frames, int threads, bool pipelined,
+                    double start);
+  // moves the patches recorded by the workspaces into heatmaps_
+  void CollectHeatmaps(const Frame *frames, int count);
+
+  Parameters params_;
+  std::shared_ptr<Executor> executor_;
+  int nthreads_;
+  std::vector<std::unique_ptr<BlockWorkspace>> workspaces_;  // per worker
+  // buffers reused across calls
+  std::vector<std::unique_ptr<FrameBuffers>> frames_;
+  std::vector<std::pair<int, int>> tasks_;  // (frame, tile) pairs
+  RunStats stats_;
+  int heatmap_cell_ = 0;
+  bool timeline_ = false;
+  Heatmaps heatmaps_;
+  std::shared_ptr<Checkpoint> checkpoint_;
+  std::shared_ptr<TraceRecorder> trace_;
+  ProgressCallback progress_;
+  double progress_interval_ = .5;
+  std::shared_ptr<const CancellationToken> cancellation_;
+};
+
+// Merges the results of all the tiles of Denoiser::DenoiseTiles, ordered by
+// index, into out, which has the shape of the image. r is the radius of the
+// patches the tiles were denoised with.
+void MergeTileResults(const std::vector<std::pair<Image, Image>> &results,
+                      int r, std::pair<int, int> tiling, ImageView out);
+
+// A negative nthreads selects the number of threads and tiles automatically
+// (Schedule::kAuto), up to all the available threads.
 Image DA3D(const Image &noisy, const Image &guide, float sigma,
            const std::vector<float> &K_high, const std::vector<float> &K_low,
            bool use_lut = true, int nthreads = 0, int r = 31,
@@ -16,7 +16,9 @@ namespace da3d {
 
 class DftPatch {
  public:
-  DftPatch(int rows, int columns, int channels = 1);
+  // flags are the FFTW planner flags
+  DftPatch(int rows, int columns, int channels = 1,
+           unsigned flags = FFTW_MEASURE);
   ~DftPatch();
   void ToFreq();
   void ToSpace();
@@ -27,6 +29,12 @@ class DftPatch {
   int channels() const { return channels_; }
   float& space(int col, int row, int chan = 0);
   std::complex<float>& freq(int col, int row, int chan = 0);
+  float space(int col, int row, int chan = 0) const {
+    return const_cast<DftPatch *>(this)->space(col, row, chan);
+  }
+  std::complex<float> freq(int col, int row, int chan = 0) const {
+    return const_cast<DftPatch *>(this)->freq(col, row, chan);
+  }
 
  private:
   float *space_;
@@ -50,7 +58,8 @@ inline std::complex<float>& DftPatch::freq(int col, int row, int chan) {
   return freq_[row * fcolumns_ * channels_ + col * channels_ + chan];
 }
 
-inline DftPatch::DftPatch(int rows, int columns, int channels)
+inline DftPatch::DftPatch(int rows, int columns, int channels,
+                          unsigned flags)
     : rows_(rows), columns_(columns), fcolumns_(columns / 2 + 1), channels_(channels) {
   int N = rows * columns * channels;
   int N_half = rows * fcolumns_ * channels;
@@ -63,11 +72,11 @@ inline DftPatch::DftPatch(int rows, int columns, int channels)
     plan_forward_ = fftwf_plan_many_dft_r2c(2, n, channels, space_, NULL,
                                             channels, 1,
                                             reinterpret_cast<fftwf_complex *>(freq_),
-                                            NULL, channels, 1, FFTW_MEASURE);
+                                            NULL, channels, 1, flags);
     plan_backward_ = fftwf_plan_many_dft_c2r(2, n, channels,
                                              reinterpret_cast<fftwf_complex *>(freq_),
                                              NULL, channels, 1, space_, NULL,
-                                             channels, 1, FFTW_MEASURE);
+                                             channels, 1, flags);
   }
 }
 
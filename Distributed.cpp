@@ -0,0 +1,367 @@
+/*
+ * Distributed.cpp
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "Distributed.hpp"
+#include "Utils.hpp"
+
+extern char **environ;
+
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace da3d {
+
+namespace {
+
+const uint32_t kMagic = 0xda3d0001;
+
+// Start of the segment. The offsets are in floats from the start of the
+// segment. results is the table of the offsets of the tile results, one per
+// tile and then one of the done flags.
+struct Header {
+  uint32_t magic;
+  int32_t rows, columns, channels;
+  float sigma;
+  int32_t tiling_rows, tiling_columns;
+  int32_t processes, threads;
+  // parameters
+  int32_t r;
+  float sigma_s, gamma_r, threshold;
+  int32_t fixed, tile_size, pipelined;
+  int32_t k_high_size, k_low_size;
+  uint64_t noisy, guide, k_high, k_low, results;
+};
+
+// floats taken by a region of the given size, 64-byte aligned
+size_t AlignedFloats(size_t bytes) { return (bytes + 63) / 64 * 16; }
+
+size_t HeaderFloats() { return AlignedFloats(sizeof(Header)); }
+
+// Shared memory segment, unlinked by the coordinator when it is done
+class Segment {
+ public:
+  Segment() = default;
+  ~Segment() {
+    if (data_) munmap(data_, bytes_);
+    if (owner_) shm_unlink(name_.c_str());
+  }
+
+  bool Create(size_t floats) {
+    static std::atomic<int> counter(0);
+    char name[64];
+    snprintf(name, sizeof(name), "/da3d-%ld-%d",
+             static_cast<long>(getpid()), counter++);
+    name_ = name;
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) return false;
+    owner_ = true;
+    bytes_ = floats * sizeof(float);
+    bool ok = ftruncate(fd, bytes_) == 0 && Map(fd);
+    close(fd);
+    return ok;
+  }
+
+  bool Open(const char *name) {
+    name_ = name;
+    int fd = shm_open(name, O_RDWR, 0600);
+    if (fd < 0) return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    bytes_ = ok ? st.st_size : 0;
+    ok = ok && bytes_ >= sizeof(Header) && Map(fd);
+    close(fd);
+    return ok;
+  }
+
+  const string &name() const { return name_; }
+  size_t bytes() const { return bytes_; }
+  float *floats() const { return static_cast<float *>(data_); }
+  Header *header() const { return static_cast<Header *>(data_); }
+  // whether count floats from offset are in the segment
+  bool Contains(uint64_t offset, uint64_t count) const {
+    const uint64_t size = bytes_ / sizeof(float);
+    return offset <= size && count <= size - offset;
+  }
+
+ private:
+  bool Map(int fd) {
+    data_ = mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data_ == MAP_FAILED) data_ = nullptr;
+    return data_ != nullptr;
+  }
+
+  string name_;
+  void *data_ = nullptr;
+  size_t bytes_ = 0;
+  bool owner_ = false;
+};
+
+// a * b * c, or 0 if it is 0 or more than limit
+uint64_t Product(uint64_t a, uint64_t b, uint64_t c, uint64_t limit) {
+  if (a == 0 || b == 0 || c == 0 || a > limit || b > limit / a ||
+      c > limit / (a * b)) {
+    return 0;
+  }
+  return a * b * c;
+}
+
+// size of the padded output and weights of a tile
+size_t TileFloats(const Header &h, int index, int r) {
+  const int s = utils::NextPowerOf2(2 * r + 1);
+  pair<int, int> shape = utils::TileShape(h.rows, h.columns, r, s - r - 1,
+                                          {h.tiling_rows, h.tiling_columns},
+                                          index);
+  return static_cast<size_t>(shape.first) * shape.second * (h.channels + 1);
+}
+
+// Copies the header written by the coordinator, and the table of the
+// results, after checking that every region they describe is in the segment
+bool ReadLayout(const Segment &segment, Header *h,
+                vector<uint64_t> *results) {
+  *h = *segment.header();
+  const uint64_t size = segment.bytes() / sizeof(float);
+  const uint64_t samples = Product(h->rows, h->columns, h->channels, size);
+  if (h->magic != kMagic || samples == 0 || h->tiling_rows < 1 ||
+      h->tiling_rows > h->rows || h->tiling_columns < 1 ||
+      h->tiling_columns > h->columns || h->r < 1 || h->r > 1 << 15 ||
+      Product(h->tiling_rows, h->tiling_columns, 1, INT_MAX - 1) == 0) {
+    return false;
+  }
+  // the padded tiles must not overflow TileShape
+  const int s = utils::NextPowerOf2(2 * h->r + 1);
+  if (h->rows > INT_MAX - s || h->columns > INT_MAX - s) return false;
+  if (!segment.Contains(h->noisy, samples) ||
+      !segment.Contains(h->guide, samples) || h->k_high_size < 0 ||
+      !segment.Contains(h->k_high, h->k_high_size) || h->k_low_size < 0 ||
+      !segment.Contains(h->k_low, h->k_low_size)) {
+    return false;
+  }
+  const int tiles = h->tiling_rows * h->tiling_columns;
+  const uint64_t table_floats = sizeof(uint64_t) / sizeof(float) * (tiles + 1);
+  if (h->results % 2 != 0 || !segment.Contains(h->results, table_floats)) {
+    return false;
+  }
+  const uint64_t *table =
+      reinterpret_cast<const uint64_t *>(segment.floats() + h->results);
+  results->assign(table, table + tiles + 1);
+  for (int t = 0; t < tiles; ++t) {
+    pair<int, int> shape = utils::TileShape(
+        h->rows, h->columns, h->r, s - h->r - 1,
+        {h->tiling_rows, h->tiling_columns}, t);
+    const uint64_t floats =
+        Product(shape.first, shape.second, h->channels + 1ull, size);
+    if (floats == 0 || !segment.Contains((*results)[t], floats)) return false;
+  }
+  // the done flags
+  return segment.Contains((*results)[tiles], tiles);
+}
+
+ConstImageView SharedImage(const Header &h, const float *data) {
+  return ConstImageView(data, h.rows, h.columns, h.channels,
+                        static_cast<ptrdiff_t>(h.columns) * h.channels,
+                        h.channels, 1);
+}
+
+}  // namespace
+
+bool DenoiseDistributed(const Image &noisy, const Image &guide, float sigma,
+                        const Parameters &params,
+                        const DistributedOptions &options, Image *out) {
+  assert(noisy.shape() == guide.shape());
+  assert(noisy.channels() == guide.channels());
+  const int r = params.r;
+  const int s = utils::NextPowerOf2(2 * r + 1);
+  const int processes = std::max(1, options.processes);
+  int threads = options.threads;
+  if (threads <= 0) {
+    threads = std::max(1, static_cast<int>(
+        std::thread::hardware_concurrency()) / processes);
+  }
+  pair<int, int> tiling =
+      params.schedule == Schedule::kFixed
+          ? utils::ComputeFixedTiling(guide.rows(), guide.columns(),
+                                      params.tile_size)
+          : utils::ComputeTiling(guide.rows(), guide.columns(),
+                                 processes * threads);
+  const int tiles = tiling.first * tiling.second;
+
+  // layout of the segment
+  Header h = Header();
+  h.magic = kMagic;
+  h.rows = guide.rows();
+  h.columns = guide.columns();
+  h.channels = guide.channels();
+  h.sigma = sigma;
+  h.tiling_rows = tiling.first;
+  h.tiling_columns = tiling.second;
+  h.processes = processes;
+  h.threads = threads;
+  h.r = r;
+  h.sigma_s = params.sigma_s;
+  h.gamma_r = params.gamma_r;
+  h.threshold = params.threshold;
+  h.fixed = params.schedule == Schedule::kFixed;
+  h.tile_size = params.tile_size;
+  h.pipelined = params.pipelined;
+  h.k_high_size = static_cast<int32_t>(params.K_high.size());
+  h.k_low_size = static_cast<int32_t>(params.K_low.size());
+  size_t offset = HeaderFloats();
+  h.results = offset;
+  offset += AlignedFloats(sizeof(uint64_t) * (tiles + 1));
+  h.noisy = offset;
+  offset += noisy.samples();
+  h.guide = offset;
+  offset += guide.samples();
+  h.k_high = offset;
+  offset += h.k_high_size;
+  h.k_low = offset;
+  offset += h.k_low_size;
+  vector<uint64_t> results(tiles + 1);
+  for (int t = 0; t < tiles; ++t) {
+    results[t] = offset;
+    offset += TileFloats(h, t, r);
+  }
+  results[tiles] = offset;
+  offset += tiles;  // done flags
+
+  Segment segment;
+  if (!segment.Create(offset)) return false;
+  float *data = segment.floats();
+  std::memcpy(segment.header(), &h, sizeof(Header));
+  std::memcpy(data + h.results, results.data(),
+              sizeof(uint64_t) * results.size());
+  std::copy(noisy.begin(), noisy.end(), data + h.noisy);
+  std::copy(guide.begin(), guide.end(), data + h.guide);
+  std::copy(params.K_high.begin(), params.K_high.end(), data + h.k_high);
+  std::copy(params.K_low.begin(), params.K_low.end(), data + h.k_low);
+  int32_t *done = reinterpret_cast<int32_t *>(data + results[tiles]);
+  std::fill_n(done, tiles, 0);
+
+  // start the workers, and wait for all of them
+  vector<pid_t> pids;
+  bool ok = true;
+  for (int i = 0; i < processes; ++i) {
+    string index = std::to_string(i);
+    const char *argv[] = {options.worker.c_str(), "-da3d_worker",
+                          segment.name().c_str(), index.c_str(), nullptr};
+    pid_t pid;
+    if (posix_spawn(&pid, options.worker.c_str(), nullptr, nullptr,
+                    const_cast<char **>(argv), environ) != 0) {
+      ok = false;
+      break;
+    }
+    pids.push_back(pid);
+  }
+  for (pid_t pid : pids) {
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      ok = false;
+    }
+  }
+  if (!ok) return false;
+  for (int t = 0; t < tiles; ++t) {
+    if (!done[t]) return false;
+  }
+
+  // merge the tiles of all the workers
+  vector<pair<Image, Image>> tile_results(tiles);
+  for (int t = 0; t < tiles; ++t) {
+    pair<int, int> shape = utils::TileShape(h.rows, h.columns, r, s - r - 1,
+                                            tiling, t);
+    const float *tile = data + results[t];
+    tile_results[t].first = Image(tile, shape.first, shape.second,
+                                  h.channels);
+    tile_results[t].second = Image(
+        tile + static_cast<size_t>(shape.first) * shape.second * h.channels,
+        shape.first, shape.second, 1);
+  }
+  if (out->shape() != guide.shape() || out->channels() != guide.channels()) {
+    out->Resize(guide.rows(), guide.columns(), guide.channels());
+  }
+  MergeTileResults(tile_results, r, tiling, *out);
+  return true;
+}
+
+bool RunDistributedWorker(const char *name, int index) {
+  Segment segment;
+  if (!segment.Open(name)) return false;
+  Header h;
+  vector<uint64_t> offsets;
+  if (!ReadLayout(segment, &h, &offsets)) return false;
+  if (index < 0 || index >= h.processes || h.threads < 1 ||
+      !(h.sigma > 0.f) || !std::isfinite(h.sigma)) {
+    return false;
+  }
+  const int tiles = h.tiling_rows * h.tiling_columns;
+  const float *data = segment.floats();
+
+  Parameters params;
+  params.r = h.r;
+  params.sigma_s = h.sigma_s;
+  params.gamma_r = h.gamma_r;
+  params.threshold = h.threshold;
+  params.channels = h.channels;
+  params.K_high.assign(data + h.k_high, data + h.k_high + h.k_high_size);
+  params.K_low.assign(data + h.k_low, data + h.k_low + h.k_low_size);
+  // up to two threads per tile when pipelined, the others would idle
+  params.nthreads = static_cast<int>(std::min<int64_t>(h.threads, 2 * tiles));
+  if (h.fixed) params.schedule = Schedule::kFixed;
+  params.tile_size = h.tile_size;
+  params.pipelined = h.pipelined != 0;
+  if (!CheckParameters(params).empty()) return false;
+
+  // the tiles are dealt round-robin
+  vector<int> mine;
+  for (int t = index; t < tiles; t += h.processes) mine.push_back(t);
+  vector<pair<Image, Image>> results;
+  Denoiser denoiser(params);
+  if (!denoiser.DenoiseTiles(SharedImage(h, data + h.noisy),
+                             SharedImage(h, data + h.guide), h.sigma,
+                             {h.tiling_rows, h.tiling_columns}, mine,
+                             &results)) {
+    return false;
+  }
+  int32_t *done = reinterpret_cast<int32_t *>(segment.floats() +
+                                               offsets[tiles]);
+  for (size_t i = 0; i < mine.size(); ++i) {
+    // the sizes were checked by ReadLayout
+    assert(static_cast<size_t>(results[i].first.samples() +
+                               results[i].second.samples()) ==
+           TileFloats(h, mine[i], h.r));
+    float *tile = segment.floats() + offsets[mine[i]];
+    tile = std::copy(results[i].first.begin(), results[i].first.end(), tile);
+    std::copy(results[i].second.begin(), results[i].second.end(), tile);
+    done[mine[i]] = 1;
+  }
+  return true;
+}
+
+bool MaybeRunDistributedWorker(int argc, char **argv, int *status) {
+  if (argc != 4 || std::strcmp(argv[1], "-da3d_worker") != 0) return false;
+  *status = RunDistributedWorker(argv[2], atoi(argv[3])) ? EXIT_SUCCESS
+                                                         : EXIT_FAILURE;
+  return true;
+}
+
+}  // namespace da3d
@@ -0,0 +1,48 @@
+/*
+ * Distributed.hpp
+ *
+ * Denoising of a single image by several processes on the same host. The
+ * coordinator puts the inputs in a POSIX shared memory segment and starts
+ * the workers. Every worker reads the tiles it is assigned, halos included,
+ * straight from the shared image, denoises them and writes their padded
+ * output and weights back into the segment, where the coordinator merges
+ * them by summing the weights, as it does for the tiles of the threads.
+ */
+
+#ifndef DA3D_DISTRIBUTED_HPP_
+#define DA3D_DISTRIBUTED_HPP_
+
+#include <string>
+#include "DA3D.hpp"
+#include "Image.hpp"
+
+namespace da3d {
+
+struct DistributedOptions {
+  int processes = 2;
+  int threads = 0;  // per process, 0 means the processors over processes
+  // Program started for every worker with the arguments
+  // -da3d_worker <segment> <index>; it must call RunDistributedWorker, e.g.
+  // through MaybeRunDistributedWorker.
+  std::string worker;
+};
+
+// The tiling follows Parameters::schedule: tiles of tile_size pixels with
+// Schedule::kFixed, which gives the same result as a single process, one
+// tile per thread of every process otherwise. Returns false if the shared
+// memory cannot be created or a worker fails.
+bool DenoiseDistributed(const Image &noisy, const Image &guide, float sigma,
+                        const Parameters &params,
+                        const DistributedOptions &options, Image *out);
+
+// Body of a worker process: denoises the tiles of the segment assigned to
+// the worker. Returns false on failure.
+bool RunDistributedWorker(const char *segment, int index);
+
+// Runs a worker and returns true if the arguments ask for one, setting
+// *status to the exit status of the process.
+bool MaybeRunDistributedWorker(int argc, char **argv, int *status);
+
+}  // namespace da3d
+
+#endif  // DA3D_DISTRIBUTED_HPP_
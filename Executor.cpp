@@ -0,0 +1,165 @@
+/*
+ * Executor.cpp
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
+#include "Executor.hpp"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif  // _OPENMP
+
+using std::max;
+using std::min;
+using std::pair;
+using std::vector;
+
+namespace da3d {
+
+void OpenMPExecutor::ParallelFor(int count, int workers, const Body &body) {
+#pragma omp parallel num_threads(max(1, workers)) if (count > 1)
+  {
+#ifdef _OPENMP
+    const int worker = omp_get_thread_num();
+#else
+    const int worker = 0;
+#endif  // _OPENMP
+#pragma omp for schedule(dynamic)
+    for (int i = 0; i < count; ++i) {
+      body(i, worker);
+    }
+  }
+}
+
+int OpenMPExecutor::concurrency() const {
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif  // _OPENMP
+}
+
+namespace {
+
+// the pool the current thread belongs to, and its index there
+thread_local const ThreadPool *current_pool = nullptr;
+thread_local int current_worker = 0;
+
+}  // namespace
+
+struct ThreadPool::Job {
+  Job(const Body &body, int count, int workers)
+      : body(body), count(count), workers(workers), queues(workers),
+        unclaimed(count), remaining(count) {
+    // slot s owns the indexes s + k * workers, for k in [first, second)
+    for (int s = 0; s < workers; ++s) {
+      queues[s] = {0, (count - s + workers - 1) / workers};
+    }
+  }
+
+  const Body &body;
+  const int count;
+  const int workers;
+  vector<pair<int, int>> queues;
+  int joined = 0;  // slots taken by the threads of the pool
+  int running = 0;  // threads working on the job
+  int unclaimed;  // indexes not yet taken
+  int remaining;  // indexes not yet done
+  std::condition_variable done;
+};
+
+ThreadPool::ThreadPool(int threads) {
+  if (threads <= 0) {
+    threads = max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  }
+  for (int i = 0; i < threads; ++i) {
+    threads_.emplace_back(&ThreadPool::Work, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    assert(jobs_.empty());
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (std::thread &thread : threads_) thread.join();
+}
+
+void ThreadPool::ParallelFor(int count, int workers, const Body &body) {
+  if (count <= 0) return;
+  workers = min(max(1, workers), min(count, size()));
+  if (workers == 1 || current_pool == this) {
+    const int worker = current_pool == this ? current_worker : 0;
+    for (int i = 0; i < count; ++i) body(i, worker);
+    return;
+  }
+  Job job(body, count, workers);
+  std::unique_lock<std::mutex> lock(mutex_);
+  jobs_.push_back(&job);
+  wake_.notify_all();
+  job.done.wait(lock, [&] { return job.remaining == 0 && job.running == 0; });
+}
+
+ThreadPool::Job *ThreadPool::FindJob() {
+  for (Job *job : jobs_) {
+    if (job->joined < job->workers) return job;
+  }
+  return nullptr;
+}
+
+// The next index of a slot: its own first, then the last one of the slot
+// with most indexes left
+bool ThreadPool::Take(Job *job, int slot, int *index) {
+  int victim = slot;
+  if (job->queues[slot].first == job->queues[slot].second) {
+    int most = 0;
+    for (int s = 0; s < job->workers; ++s) {
+      int left = job->queues[s].second - job->queues[s].first;
+      if (left > most) {
+        most = left;
+        victim = s;
+      }
+    }
+    if (most == 0) return false;
+  }
+  pair<int, int> &queue = job->queues[victim];
+  int k = victim == slot ? queue.first++ : --queue.second;
+  *index = victim + k * job->workers;
+  if (--job->unclaimed == 0) {
+    jobs_.erase(std::find(jobs_.begin(), jobs_.end(), job));
+  }
+  return true;
+}
+
+void ThreadPool::Work(int worker) {
+  current_pool = this;
+  current_worker = worker;
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    wake_.wait(lock, [this] { return stop_ || FindJob(); });
+    if (stop_) return;
+    Job *job = FindJob();
+    const int slot = job->joined++;
+    ++job->running;
+    int index;
+    while (Take(job, slot, &index)) {
+      lock.unlock();
+      job->body(index, worker);
+      lock.lock();
+      --job->remaining;
+    }
+    if (--job->running == 0 && job->remaining == 0) job->done.notify_all();
+  }
+}
+
+std::shared_ptr<Executor> DefaultExecutor() {
+  static std::shared_ptr<Executor> executor =
+      std::make_shared<OpenMPExecutor>();
+  return executor;
+}
+
+}  // namespace da3d
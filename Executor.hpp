@@ -0,0 +1,90 @@
+/*
+ * Executor.hpp
+ *
+ * Runs the parallel loops of the algorithm. The OpenMP executor opens a
+ * parallel region per loop; the thread pool keeps its threads between calls
+ * and can be shared by several Denoisers, so that the total number of
+ * threads stays fixed however many requests run at the same time.
+ */
+
+#ifndef DA3D_EXECUTOR_HPP_
+#define DA3D_EXECUTOR_HPP_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace da3d {
+
+class Executor {
+ public:
+  // body(index, worker)
+  using Body = std::function<void(int, int)>;
+
+  virtual ~Executor() = default;
+
+  // Calls body for every index in [0, count) on up to workers threads at a
+  // time, and returns when all the calls are done. The worker index
+  // identifies the calling thread, is in [0, slots(workers)) and is never
+  // used by two calls at the same time, so per-thread state can be indexed by
+  // it.
+  virtual void ParallelFor(int count, int workers, const Body &body) = 0;
+  virtual int slots(int workers) const = 0;
+  // number of threads used when the caller does not ask for a number
+  virtual int concurrency() const = 0;
+};
+
+// One parallel region per loop, with schedule(dynamic). Without OpenMP the
+// loops run in the calling thread.
+class OpenMPExecutor : public Executor {
+ public:
+  void ParallelFor(int count, int workers, const Body &body) override;
+  int slots(int workers) const override { return workers; }
+  int concurrency() const override;
+};
+
+// Persistent threads with work stealing: every worker taking part in a loop
+// gets its share of the indexes (in round-robin order, so that indexes
+// sorted by decreasing cost stay balanced) and steals from the others when it
+// runs out. Loops submitted by different threads are served in order, by as
+// many threads as they ask for, so that concurrent loops share the pool. The
+// threads calling ParallelFor only wait; a loop started from a thread of the
+// pool runs in that thread.
+class ThreadPool : public Executor {
+ public:
+  // threads <= 0 means std::thread::hardware_concurrency()
+  explicit ThreadPool(int threads = 0);
+  ~ThreadPool() override;
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  void ParallelFor(int count, int workers, const Body &body) override;
+  int slots(int) const override { return size(); }
+  int concurrency() const override { return size(); }
+  int size() const { return static_cast<int>(threads_.size()); }
+
+ private:
+  struct Job;
+
+  void Work(int worker);
+  Job *FindJob();
+  bool Take(Job *job, int slot, int *index);
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::deque<Job *> jobs_;  // loops with indexes not yet taken
+  bool stop_ = false;
+};
+
+// The executor used by Denoisers created without one: OpenMP
+std::shared_ptr<Executor> DefaultExecutor();
+
+}  // namespace da3d
+
+#endif  // DA3D_EXECUTOR_HPP_
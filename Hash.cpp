@@ -0,0 +1,88 @@
+/*
+ * Hash.cpp
+ */
+
+#include <cstdio>
+#include <cstring>
+#include "Hash.hpp"
+
+using std::string;
+using std::vector;
+
+namespace da3d {
+
+namespace {
+
+inline uint64_t Rotate(uint64_t x, int bits) {
+  return (x << bits) | (x >> (64 - bits));
+}
+
+// final mix of splitmix64
+inline uint64_t Finalize(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+}  // namespace
+
+void ContentHash::Add(uint64_t value) {
+  a_ = Rotate((a_ ^ value) * 0x87c37b91114253d5ull, 31);
+  b_ = Rotate((b_ ^ value) * 0x4cf5ad432745937full, 33) + a_;
+}
+
+void ContentHash::Add(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  Add(static_cast<uint64_t>(bits));
+}
+
+void ContentHash::Add(ConstImageView image) {
+  Add(static_cast<uint64_t>(image.rows()));
+  Add(static_cast<uint64_t>(image.columns()));
+  Add(static_cast<uint64_t>(image.channels()));
+  for (int row = 0; row < image.rows(); ++row) {
+    for (int col = 0; col < image.columns(); ++col) {
+      for (int chan = 0; chan < image.channels(); ++chan) {
+        Add(image.val(col, row, chan));
+      }
+    }
+  }
+}
+
+void ContentHash::Add(const vector<float> &values) {
+  Add(static_cast<uint64_t>(values.size()));
+  for (float v : values) Add(v);
+}
+
+string ContentHash::Hex() const {
+  char hex[33];
+  snprintf(hex, sizeof(hex), "%016llx%016llx",
+           static_cast<unsigned long long>(Finalize(a_)),
+           static_cast<unsigned long long>(Finalize(b_ ^ a_)));
+  return hex;
+}
+
+void HashTileParameters(const Parameters &params, ContentHash *hash) {
+  hash->Add(static_cast<uint64_t>(params.r));
+  hash->Add(params.sigma_s);
+  hash->Add(params.gamma_r);
+  hash->Add(params.threshold);
+  hash->Add(params.K_high);
+  hash->Add(params.K_low);
+  hash->Add(static_cast<uint64_t>(params.engine));
+}
+
+void HashParameters(const Parameters &params, int nthreads,
+                    ContentHash *hash) {
+  HashTileParameters(params, hash);
+  hash->Add(static_cast<uint64_t>(params.schedule));
+  if (params.schedule == Schedule::kFixed) {
+    hash->Add(static_cast<uint64_t>(params.tile_size));
+  } else {
+    // the tiles follow the number of threads
+    hash->Add(static_cast<uint64_t>(nthreads));
+  }
+}
+
+}  // namespace da3d
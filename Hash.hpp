@@ -0,0 +1,48 @@
+/*
+ * Hash.hpp
+ *
+ * Content hashes of the inputs and parameters of a denoising run, which
+ * identify its results in ResultCache and in Checkpoint.
+ */
+
+#ifndef DA3D_HASH_HPP_
+#define DA3D_HASH_HPP_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "DA3D.hpp"
+#include "ImageView.hpp"
+
+namespace da3d {
+
+// Fast non-cryptographic 128-bit hash, fed in order. Images are hashed
+// sample by sample in row, column, channel order, so that the hash does not
+// depend on their memory layout.
+class ContentHash {
+ public:
+  void Add(uint64_t value);
+  void Add(float value);
+  void Add(ConstImageView image);
+  void Add(const std::vector<float> &values);
+  // 32 hexadecimal digits
+  std::string Hex() const;
+
+ private:
+  uint64_t a_ = 0x9e3779b97f4a7c15ull;
+  uint64_t b_ = 0xc2b2ae3d27d4eb4full;
+};
+
+// Adds the parameters that can change the result of a Denoiser. nthreads is
+// the number of threads it actually uses (Denoiser::nthreads(), not
+// params.nthreads, which may be 0); with Schedule::kFixed it does not
+// change the result.
+void HashParameters(const Parameters &params, int nthreads,
+                    ContentHash *hash);
+// Adds the parameters that can change the result of one tile, given its
+// padded inputs: all but those that only choose the tiling.
+void HashTileParameters(const Parameters &params, ContentHash *hash);
+
+}  // namespace da3d
+
+#endif  // DA3D_HASH_HPP_
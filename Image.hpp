@@ -8,9 +8,11 @@
 #ifndef DA3D_IMAGE_HPP_
 #define DA3D_IMAGE_HPP_
 
+#include <algorithm>
 #include <cassert>
 #include <vector>
 #include <utility>
+#include "Arena.hpp"
 
 namespace da3d {
 
@@ -20,6 +22,9 @@ class Image {
   Image(int rows, int columns, int channels = 1, float val = 0.f);
   // construct from C array
   Image(const float *data, int rows, int columns, int channels = 1);
+  // borrow uninitialized storage from an arena, which must outlive the image
+  // and must not be reset while the image is in use
+  Image(int rows, int columns, int channels, Arena *arena);
 
   // disable copy constructor
   Image(const Image&) = delete;
@@ -27,13 +32,16 @@ class Image {
   // instead of the copy constructor, we want explicit copy
   Image copy() const;
 
-  // default move constructor
-  Image(Image&&) = default;
-  Image& operator=(Image&&) = default;
+  // moving leaves the source empty
+  Image(Image &&other) noexcept;
+  Image& operator=(Image &&other) noexcept;
 
   ~Image() = default;
 
-  void Clear(float val = 0.f) { std::fill(data_.begin(), data_.end(), val); }
+  void Clear(float val = 0.f) { std::fill(begin(), end(), val); }
+  // reshape the image, reusing the current allocation whenever it is large
+  // enough, and fill it with val. A borrowed image becomes an owning one.
+  void Resize(int rows, int columns, int channels = 1, float val = 0.f);
 
   float val(int col, int row, int chan = 0) const;
   float& val(int col, int row, int chan = 0);
@@ -45,28 +53,61 @@ class Image {
   int rows() const { return rows_; }
   int pixels() const { return columns_ * rows_; }
   int samples() const { return channels_ * columns_ * rows_; }
-  float* data() { return data_.data(); }
-  const float* data() const { return data_.data(); }
+  bool borrowed() const { return data_ && storage_.empty(); }
+  float* data() { return data_; }
+  const float* data() const { return data_; }
   std::pair<int, int> shape() const { return {rows_, columns_}; }
-  std::vector<float>::iterator begin() { return data_.begin(); }
-  std::vector<float>::const_iterator begin() const { return data_.begin(); }
-  std::vector<float>::iterator end() { return data_.end(); }
-  std::vector<float>::const_iterator end() const { return data_.end(); }
+  float* begin() { return data_; }
+  const float* begin() const { return data_; }
+  float* end() { return data_ + samples(); }
+  const float* end() const { return data_ + samples(); }
 
  protected:
   int rows_{0};
   int columns_{0};
   int channels_{0};
-  std::vector<float> data_{};
+  std::vector<float> storage_{};  // empty when the memory is borrowed
+  float *data_{nullptr};
 };
 
 inline Image::Image(int rows, int columns, int channels, float val)
     : rows_(rows), columns_(columns), channels_(channels),
-      data_(rows * columns * channels, val) {}
+      storage_(rows * columns * channels, val), data_(storage_.data()) {}
 
 inline Image::Image(const float *data, int rows, int columns, int channels)
     : rows_(rows), columns_(columns), channels_(channels),
-      data_(data, data + rows * columns * channels) {}
+      storage_(data, data + rows * columns * channels),
+      data_(storage_.data()) {}
+
+inline Image::Image(int rows, int columns, int channels, Arena *arena)
+    : rows_(rows), columns_(columns), channels_(channels),
+      data_(arena->Allocate(rows * columns * channels)) {}
+
+inline Image::Image(Image &&other) noexcept
+    : rows_(other.rows_), columns_(other.columns_), channels_(other.channels_),
+      storage_(std::move(other.storage_)), data_(other.data_) {
+  other.rows_ = other.columns_ = other.channels_ = 0;
+  other.data_ = nullptr;
+}
+
+inline Image& Image::operator=(Image &&other) noexcept {
+  rows_ = other.rows_;
+  columns_ = other.columns_;
+  channels_ = other.channels_;
+  storage_ = std::move(other.storage_);
+  data_ = other.data_;
+  other.rows_ = other.columns_ = other.channels_ = 0;
+  other.data_ = nullptr;
+  return *this;
+}
+
+inline void Image::Resize(int rows, int columns, int channels, float val) {
+  rows_ = rows;
+  columns_ = columns;
+  channels_ = channels;
+  storage_.assign(rows * columns * channels, val);
+  data_ = storage_.data();
+}
 
 inline Image Image::copy() const {
   return Image(data(), rows(), columns(), channels());
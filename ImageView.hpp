@@ -0,0 +1,85 @@
+/*
+ * ImageView.hpp
+ *
+ * Non-owning view of an image stored with arbitrary strides. It lets the
+ * denoiser read its inputs from, and write its result to, memory laid out
+ * differently from Image, e.g. MATLAB column-major arrays, without copies.
+ */
+
+#ifndef DA3D_IMAGEVIEW_HPP_
+#define DA3D_IMAGEVIEW_HPP_
+
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+#include "Image.hpp"
+
+namespace da3d {
+
+template <typename T>
+class BasicImageView {
+ public:
+  using ImageType = typename std::conditional<std::is_const<T>::value,
+                                              const Image, Image>::type;
+
+  BasicImageView() = default;
+  // strides are in samples
+  BasicImageView(T *data, int rows, int columns, int channels,
+                 std::ptrdiff_t row_stride, std::ptrdiff_t col_stride,
+                 std::ptrdiff_t chan_stride)
+      : data_(data), rows_(rows), columns_(columns), channels_(channels),
+        row_stride_(row_stride), col_stride_(col_stride),
+        chan_stride_(chan_stride) {}
+  // view of a whole Image
+  BasicImageView(ImageType &img)  // NOLINT(runtime/explicit)
+      : BasicImageView(img.data(), img.rows(), img.columns(), img.channels(),
+                       img.columns() * img.channels(), img.channels(), 1) {}
+  // a mutable view can be used where a constant one is expected
+  template <typename U, typename = typename std::enable_if<
+      std::is_same<const U, T>::value && !std::is_same<U, T>::value>::type>
+  BasicImageView(const BasicImageView<U> &other)  // NOLINT(runtime/explicit)
+      : BasicImageView(other.data(), other.rows(), other.columns(),
+                       other.channels(), other.row_stride(),
+                       other.col_stride(), other.chan_stride()) {}
+
+  // rows x columns x channels array in column-major order, as used by MATLAB
+  static BasicImageView ColumnMajor(T *data, int rows, int columns,
+                                    int channels = 1) {
+    return BasicImageView(data, rows, columns, channels, 1, rows,
+                          static_cast<std::ptrdiff_t>(rows) * columns);
+  }
+
+  T& val(int col, int row, int chan = 0) const {
+    assert(0 <= col && col < columns_);
+    assert(0 <= row && row < rows_);
+    assert(0 <= chan && chan < channels_);
+    return data_[row * row_stride_ + col * col_stride_ + chan * chan_stride_];
+  }
+
+  int channels() const { return channels_; }
+  int columns() const { return columns_; }
+  int rows() const { return rows_; }
+  int samples() const { return channels_ * columns_ * rows_; }
+  std::pair<int, int> shape() const { return {rows_, columns_}; }
+  T* data() const { return data_; }
+  std::ptrdiff_t row_stride() const { return row_stride_; }
+  std::ptrdiff_t col_stride() const { return col_stride_; }
+  std::ptrdiff_t chan_stride() const { return chan_stride_; }
+
+ private:
+  T *data_{nullptr};
+  int rows_{0};
+  int columns_{0};
+  int channels_{0};
+  std::ptrdiff_t row_stride_{0};
+  std::ptrdiff_t col_stride_{0};
+  std::ptrdiff_t chan_stride_{0};
+};
+
+using ImageView = BasicImageView<float>;
+using ConstImageView = BasicImageView<const float>;
+
+}  // namespace da3d
+
+#endif  // DA3D_IMAGEVIEW_HPP_
@@ -0,0 +1,239 @@
+/*
+ * Kernels.cpp
+ */
+
+#include <cmath>
+#include <numeric>
+#include "Kernels.hpp"
+#include "Utils.hpp"
+
+using std::abs;
+using std::accumulate;
+using std::modf;
+using std::norm;
+using std::pair;
+using std::vector;
+
+namespace da3d {
+
+void ExtractPatch(const Image &src, int pr, int pc, Image *dst) {
+  // src is padded, so (pr, pc) becomes the upper left pixel
+  int i = 0, j = (pr * src.columns() + pc) * src.channels();
+  for (int row = 0; row < dst->rows(); ++row) {
+    for (int el = 0; el < dst->columns() * dst->channels(); ++el) {
+      dst->val(i) = src.val(j);
+      ++i;
+      ++j;
+    }
+    j += (src.columns() - dst->columns()) * src.channels();
+  }
+}
+
+void BilateralWeight(const Image &g, Image *k, int r, float gamma_r_sigma2,
+                     float sigma_s2) {
+  for (int row = 0; row < g.rows(); ++row) {
+    for (int col = 0; col < g.columns(); ++col) {
+      float x = 0.f;
+      for (int chan = 0; chan < g.channels(); ++chan) {
+        float y = g.val(col, row, chan) - g.val(r, r, chan);
+        x += y * y;
+      }
+      x /= gamma_r_sigma2;
+      x += ((row - r) * (row - r) + (col - r) * (col - r)) / (2 * sigma_s2);
+      k->val(col, row) = utils::fastexp(-x);
+    }
+  }
+}
+
+/* void ComputeRegressionPlaneIRLS(const Image &y,
+                                const Image &g,
+                                const Image &k,
+                                int r,
+                                vector<pair<float, float>> *reg_plane,
+                                int iterations = 2) {
+  constexpr float delta = 0.0001f;
+  for (pair<float, float> &v : *reg_plane) v = {0.f, 0.f};
+  for (int chan = 0; chan < y.channels(); ++chan) {
+    float x1 = 0.f, x2 = 0.f;
+    for (int t = 0; t < iterations; ++t) {
+      float a = 0.f, b = 0.f, c = 0.f, d = 0.f, e = 0.f;
+      float central = g.val(r, r, chan);
+      for (int row = 0; row < y.rows(); ++row) {
+        for (int col = 0; col < y.columns(); ++col) {
+          int cc = col - r, rr = row - r;
+          float w = k.val(col, row)
+              / max(delta, (y.val(col, row, chan) - central - x1 * rr - x2 * cc));
+          a += rr * rr * w;
+          b += rr * cc * w;
+          c += cc * cc * w;
+          d += rr * (y.val(col, row, chan) - central) * w;
+          e += cc * (y.val(col, row, chan) - central) * w;
+        }
+      }
+      float det = a * c - b * b;
+      if (abs(det) < delta) break;
+
+      // Solves the system
+      // |a   b| |x1|   |d|
+      // |     | |  | = | |
+      // |b   c| |x2|   |e|
+      x1 = (c * d - b * e) / det;
+      x2 = (a * e - b * d) / det;
+    }
+    (*reg_plane)[chan] = {x1, x2};
+  }
+} */
+
+void ComputeRegressionPlane(const Image &y, const Image &g, const Image &k,
+                            int r, vector<pair<float, float>> *reg_plane) {
+  constexpr float epsilon = 0.0001f;
+  float a = 0.f, b = 0.f, c = 0.f;
+  for (int row = 0; row < y.rows(); ++row) {
+    for (int col = 0; col < y.columns(); ++col) {
+      a += (row - r) * (row - r) * k.val(col, row);
+      b += (row - r) * (col - r) * k.val(col, row);
+      c += (col - r) * (col - r) * k.val(col, row);
+    }
+  }
+  float det = a * c - b * b;
+  if (abs(det) < epsilon) {
+    for (int chan = 0; chan < y.channels(); ++chan) {
+      (*reg_plane)[chan] = {0.f, 0.f};
+    }
+  } else {
+    for (int chan = 0; chan < y.channels(); ++chan) {
+      float d = 0.f, e = 0.f;
+      float central = g.val(r, r, chan);
+      for (int row = 0; row < y.rows(); ++row) {
+        for (int col = 0; col < y.columns(); ++col) {
+          d += (row - r) * (y.val(col, row, chan) - central) * k.val(col, row);
+          e += (col - r) * (y.val(col, row, chan) - central) * k.val(col, row);
+        }
+      }
+      // Solves the system
+      // |a   b| |x1|   |d|
+      // |     | |  | = | |
+      // |b   c| |x2|   |e|
+      (*reg_plane)[chan] = {(c * d - b * e) / det, (a * e - b * d) / det};
+    }
+  }
+}
+
+void SubtractPlane(int r, vector<pair<float, float>> reg_plane, Image *y) {
+  for (int row = 0; row < y->rows(); ++row) {
+    for (int col = 0; col < y->columns(); ++col) {
+      for (int chan = 0; chan < y->channels(); ++chan) {
+        y->val(col, row, chan) -= reg_plane[chan].first * (row - r) +
+                                  reg_plane[chan].second * (col - r);
+      }
+    }
+  }
+}
+
+void ModifyPatch(const Image &patch, const Image &k, DftPatch *modified,
+                 float *average) {
+  // compute the total weight of the mask
+  float weight = accumulate(k.begin(), k.end(), 0.f);
+
+  for (int chan = 0; chan < patch.channels(); ++chan) {
+    float avg = 0.f;
+    for (int row = 0; row < patch.rows(); ++row) {
+      for (int col = 0; col < patch.columns(); ++col) {
+        avg += k.val(col, row) * patch.val(col, row, chan);
+      }
+    }
+    avg /= weight;
+    for (int row = 0; row < patch.rows(); ++row) {
+      for (int col = 0; col < patch.columns(); ++col) {
+        modified->space(col, row, chan) =
+            k.val(col, row) * patch.val(col, row, chan) +
+            (1.f - k.val(col, row)) * avg;
+      }
+    }
+    if (average) average[chan] = avg;
+  }
+}
+
+void ShrinkSpectrum(const Image &k, float sigma2, const DftPatch &g_m,
+                    const vector<float> &K_high, const vector<float> &K_low,
+                    DftPatch *y_m) {
+  const int s = k.rows();
+  const bool use_lut = !K_high.empty() && !K_low.empty();
+  float sigma_f2 = 0.f;
+  for (int row = 0; row < s; ++row) {
+    for (int col = 0; col < s; ++col) {
+      sigma_f2 += k.val(col, row) * k.val(col, row);
+    }
+  }
+  sigma_f2 *= sigma2;  // line 17
+  for (int row = 0; row < y_m->frows(); ++row) {
+    for (int col = 0; col < y_m->fcolumns(); ++col) {
+      for (int chan = 0; chan < y_m->channels(); ++chan) {
+        if (row || col) {
+          float x = norm(g_m.freq(col, row, chan)) / sigma_f2;
+          float K;
+          if (use_lut) {
+            if (x >= 2.f) {
+              K = 1.f;
+            } else {
+              float in;
+              float fr = modf(4 * x, &in);
+              int i = static_cast<int>(in);
+              if (((16 < row) && (row < s - 16)) ||
+                  ((16 < col) && (col < s - 16))) {
+                K = K_high[i] * (1.f - fr) + K_high[i + 1] * fr;
+              } else {
+                K = K_low[i] * (1.f - fr) + K_low[i + 1] * fr;
+              }
+            }
+          } else {
+            K = utils::fastexp(-.8f / x);  // line 18
+          }
+          y_m->freq(col, row, chan) *= K;
+        }
+      }
+    }
+  }
+}
+
+void AggregateShrunk(const DftPatch &y_m, const float *average,
+                     const vector<pair<float, float>> &reg_plane, int r,
+                     int pr, int pc, Image *k, Image *output,
+                     Image *weights) {
+  const int s = k->rows();
+  // lines 20,21,25
+  // col and row are the "internal" indexes (with respect to the patch).
+  for (int row = 0; row < s; ++row) {
+    for (int col = 0; col < s; ++col) {
+      for (int chan = 0; chan < output->channels(); ++chan) {
+        float pij = (row - r) * reg_plane[chan].first +
+                    (col - r) * reg_plane[chan].second;
+        float kij = k->val(col, row);
+        output->val(col + pc, row + pr, chan) +=
+            (y_m.space(col, row, chan) - (1.f - kij) * average[chan] +
+            pij * kij) * kij;
+      }
+      k->val(col, row) *= k->val(col, row);  // line 22
+      weights->val(col + pc, row + pr) += k->val(col, row);
+    }
+  }
+}
+
+void AggregateGuide(const Image &g, const vector<pair<float, float>> &reg_plane,
+                    int r, int pr, int pc, Image *k, Image *output,
+                    Image *weights) {
+  const int s = k->rows();
+  for (float& v : *k) v *= v;  // Square the weights
+  for (int row = 0; row < s; ++row) {
+    for (int col = 0; col < s; ++col) {
+      for (int chan = 0; chan < output->channels(); ++chan) {
+        output->val(col + pc, row + pr, chan) +=
+            (g.val(col, row, chan) + reg_plane[chan].first * (row - r) +
+            reg_plane[chan].second * (col - r)) * k->val(col, row);
+      }
+      weights->val(col + pc, row + pr) += k->val(col, row);
+    }
+  }
+}
+
+}  // namespace da3d
@@ -0,0 +1,68 @@
+/*
+ * Kernels.hpp
+ *
+ * The steps of the processing of a patch (the line numbers refer to the
+ * algorithm of the paper), exposed so that they can be measured in
+ * isolation. Patches are s x s, with s = NextPowerOf2(2r + 1).
+ */
+
+#ifndef DA3D_KERNELS_HPP_
+#define DA3D_KERNELS_HPP_
+
+#include <utility>
+#include <vector>
+#include "DftPatch.hpp"
+#include "Image.hpp"
+
+namespace da3d {
+
+// Lines 6-7: copies the patch of the padded image src with upper left pixel
+// (pr, pc) into dst, which has the shape of the patch
+void ExtractPatch(const Image &src, int pr, int pc, Image *dst);
+
+// Lines 8 and 12: bilateral weights of the patch g around its central pixel
+// (r, r)
+void BilateralWeight(const Image &g, Image *k, int r, float gamma_r_sigma2,
+                     float sigma_s2);
+
+// Line 9: slopes of the plane fitted to y - g(r, r) with the weights k, per
+// channel
+void ComputeRegressionPlane(const Image &y, const Image &g, const Image &k,
+                            int r,
+                            std::vector<std::pair<float, float>> *reg_plane);
+
+// Lines 10-11
+void SubtractPlane(int r, std::vector<std::pair<float, float>> reg_plane,
+                   Image *y);
+
+// Lines 13-14: the patch weighted by k, completed with its weighted average,
+// which is stored in average if not null (one value per channel)
+void ModifyPatch(const Image &patch, const Image &k, DftPatch *modified,
+                 float *average = nullptr);
+
+// Lines 17-18: shrinks the spectrum of y_m by the gain computed from the
+// spectrum of the guide g_m and the noise sigma2 weighted by k. Empty
+// look-up tables select the analytic curve.
+void ShrinkSpectrum(const Image &k, float sigma2, const DftPatch &g_m,
+                    const std::vector<float> &K_high,
+                    const std::vector<float> &K_low, DftPatch *y_m);
+
+// Lines 20-22: aggregates the shrunk patch y_m, with upper left pixel
+// (pr, pc), into output and weights. average is the one of ModifyPatch. On
+// return k holds the aggregation weights, its squares.
+void AggregateShrunk(const DftPatch &y_m, const float *average,
+                     const std::vector<std::pair<float, float>> &reg_plane,
+                     int r, int pr, int pc, Image *k, Image *output,
+                     Image *weights);
+
+// The aggregation of a patch whose weights are too small to denoise it
+// (sum(k) < 10): the guide g, with its regression plane, is aggregated with
+// the squared weights, which k holds on return
+void AggregateGuide(const Image &g,
+                    const std::vector<std::pair<float, float>> &reg_plane,
+                    int r, int pr, int pc, Image *k, Image *output,
+                    Image *weights);
+
+}  // namespace da3d
+
+#endif  // DA3D_KERNELS_HPP_
@@ -0,0 +1,282 @@
+/*
+ * Synthetic.cpp
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+#include "Synthetic.hpp"
+#include "Utils.hpp"
+
+using std::string;
+using std::vector;
+
+namespace da3d {
+
+namespace {
+
+const float kPi = 3.14159265f;
+
+// The functions of the math library are not correctly rounded, and differ
+// between platforms, so the sines and the logarithms are fixed polynomials
+// of the arguments, evaluated with the basic operations of IEEE arithmetic.
+
+// sin(2 pi turns), with an error below 1e-11
+double SineTurns(double turns) {
+  double x = turns - std::floor(turns + .5);  // in [-.5, .5]
+  if (x > .25) {
+    x = .5 - x;
+  } else if (x < -.25) {
+    x = -.5 - x;
+  }
+  const double y = 6.283185307179586 * x;  // in [-pi / 2, pi / 2]
+  const double y2 = y * y;
+  // Taylor series up to y^15
+  return y * (1. + y2 * (-1. / 6. + y2 * (1. / 120. + y2 * (-1. / 5040. +
+         y2 * (1. / 362880. + y2 * (-1. / 39916800. + y2 * (1. / 6227020800. +
+         y2 * (-1. / 1307674368000.))))))));
+}
+
+double Sine(double radians) {
+  return SineTurns(radians * .15915494309189535);  // 1 / (2 pi)
+}
+
+double Cosine(double radians) {
+  return SineTurns(radians * .15915494309189535 + .25);
+}
+
+// log(x) for x > 0, with a relative error below 1e-14
+double Log(double x) {
+  int exponent;
+  double m = std::frexp(x, &exponent);  // x = m 2^exponent, m in [.5, 1)
+  if (m < .7071067811865476) {  // in [sqrt(1 / 2), sqrt(2))
+    m *= 2.;
+    --exponent;
+  }
+  const double s = (m - 1.) / (m + 1.);  // |s| < .172
+  const double s2 = s * s;
+  // log(m) = 2 atanh(s), series up to s^17
+  return exponent * .6931471805599453 +
+         2. * s * (1. + s2 * (1. / 3. + s2 * (1. / 5. + s2 * (1. / 7. +
+         s2 * (1. / 9. + s2 * (1. / 11. + s2 * (1. / 13. + s2 * (1. / 15. +
+         s2 * (1. / 17.)))))))));
+}
+
+// Uniform and Gaussian numbers from the raw output of std::mt19937, which
+// is the same everywhere
+class Random {
+ public:
+  explicit Random(unsigned seed) : gen_(seed) {}
+
+  // in [0, 1): the top 24 bits, exact in a float, while rounding all 32
+  // to a float can give 1
+  float Uniform() { return (gen_() >> 8) * (1.f / 16777216.f); }
+  float Uniform(float low, float high) {
+    return low + (high - low) * Uniform();
+  }
+  // in [0, n), since Uniform() * n rounds below n for n < 2^24
+  int Integer(int n) { return static_cast<int>(Uniform() * n); }
+  // Box-Muller
+  float Gaussian() {
+    if (has_spare_) {
+      has_spare_ = false;
+      return spare_;
+    }
+    double u = (gen_() + 1.) * (1. / 4294967297.);  // in (0, 1)
+    double v = gen_() * (1. / 4294967296.);
+    double radius = std::sqrt(-2. * Log(u));  // sqrt is correctly rounded
+    spare_ = static_cast<float>(radius * SineTurns(v));
+    has_spare_ = true;
+    return static_cast<float>(radius * SineTurns(v + .25));
+  }
+
+ private:
+  std::mt19937 gen_;
+  bool has_spare_ = false;
+  float spare_ = 0.f;
+};
+
+enum Kind { kFlat, kEdges, kTexture };
+
+// what is drawn on one cell on top of the background
+struct Cell {
+  Kind kind;
+  // edges: up to three lines a * col + b * row + c = 0, and the steps on
+  // their positive side
+  int lines;
+  float a[3], b[3], c[3], step[3];
+  // texture: a grating and a random mosaic
+  float fx, fy, phase, amplitude;
+  int grain;
+  float grain_amplitude;
+};
+
+// A value in [-1, 1] for every grain of a mosaic, from an integer hash
+float Grain(unsigned x, unsigned y, unsigned seed) {
+  unsigned h = x * 0x8da6b343u ^ y * 0xd8163841u ^ seed * 0xcb1ab31fu;
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+  return h * (2.f / 4294967295.f) - 1.f;
+}
+
+float Background(int col, int row, int chan) {
+  return 128.f + 50.f * static_cast<float>(Sine(row * .011f + chan) *
+                                           Cosine(col * .013f - .5f * chan));
+}
+
+}  // namespace
+
+SyntheticContent BestCaseContent() {
+  SyntheticContent content;
+  content.flat = 1.f;
+  content.edges = content.texture = 0.f;
+  return content;
+}
+
+SyntheticContent TypicalContent() { return SyntheticContent(); }
+
+SyntheticContent WorstCaseContent() {
+  SyntheticContent content;
+  content.texture = 1.f;
+  content.flat = content.edges = 0.f;
+  return content;
+}
+
+bool ParseSyntheticContent(const string &spec, SyntheticContent *content) {
+  if (spec == "best") {
+    *content = BestCaseContent();
+  } else if (spec == "typical") {
+    *content = TypicalContent();
+  } else if (spec == "worst") {
+    *content = WorstCaseContent();
+  } else {
+    float flat, edges, texture;
+    char end;
+    if (sscanf(spec.c_str(), "%f,%f,%f%c", &flat, &edges, &texture,
+               &end) != 3 ||
+        flat < 0.f || edges < 0.f || texture < 0.f ||
+        flat + edges + texture <= 0.f) {
+      return false;
+    }
+    content->flat = flat;
+    content->edges = edges;
+    content->texture = texture;
+  }
+  return true;
+}
+
+void MakeClean(int rows, int columns, int channels,
+               const SyntheticContent &content, unsigned seed, Image *clean) {
+  const int cell = std::max(1, content.cell);
+  const int cell_rows = (rows + cell - 1) / cell;
+  const int cell_columns = (columns + cell - 1) / cell;
+  const int cells = cell_rows * cell_columns;
+  Random random(seed);
+
+  // exactly the requested shares, in random places
+  const float total = content.flat + content.edges + content.texture;
+  const int flat = static_cast<int>(std::lround(cells * content.flat / total));
+  const int edges = std::min(
+      cells - flat,
+      static_cast<int>(std::lround(cells * content.edges / total)));
+  vector<Cell> grid(cells);
+  for (int i = 0; i < cells; ++i) {
+    grid[i].kind = i < flat ? kFlat : i < flat + edges ? kEdges : kTexture;
+  }
+  for (int i = cells - 1; i > 0; --i) {
+    std::swap(grid[i].kind, grid[random.Integer(i + 1)].kind);
+  }
+  for (Cell &c : grid) {
+    c.lines = 1 + random.Integer(3);
+    for (int l = 0; l < 3; ++l) {
+      float angle = random.Uniform(0.f, 2.f * kPi);
+      c.a[l] = static_cast<float>(Cosine(angle));
+      c.b[l] = static_cast<float>(Sine(angle));
+      // through a random point of the cell
+      c.c[l] = -(c.a[l] * random.Uniform(0.f, cell) +
+                 c.b[l] * random.Uniform(0.f, cell));
+      c.step[l] = random.Uniform(30.f, 80.f) * (random.Integer(2) ? 1 : -1);
+    }
+    float period = random.Uniform(3.f, 8.f);
+    float angle = random.Uniform(0.f, kPi);
+    c.fx = static_cast<float>(Cosine(angle)) / period;
+    c.fy = static_cast<float>(Sine(angle)) / period;
+    c.phase = random.Uniform(0.f, 2.f * kPi);
+    c.amplitude = random.Uniform(20.f, 50.f);
+    c.grain = 1 + random.Integer(3);
+    c.grain_amplitude = random.Uniform(40.f, 80.f);
+  }
+
+  clean->Resize(rows, columns, channels);
+  for (int row = 0; row < rows; ++row) {
+    for (int col = 0; col < columns; ++col) {
+      const Cell &c = grid[(row / cell) * cell_columns + col / cell];
+      const int x = col % cell, y = row % cell;
+      float detail = 0.f;
+      if (c.kind == kEdges) {
+        for (int l = 0; l < c.lines; ++l) {
+          if (c.a[l] * x + c.b[l] * y + c.c[l] > 0.f) detail += c.step[l];
+        }
+      }
+      for (int chan = 0; chan < channels; ++chan) {
+        float value = Background(col, row, chan) + detail;
+        if (c.kind == kTexture) {
+          value += c.amplitude *
+                   static_cast<float>(Sine(2.f * kPi * (c.fx * col +
+                                                        c.fy * row) +
+                                           c.phase + chan));
+          value += c.grain_amplitude *
+                   Grain(col / c.grain, row / c.grain, seed + chan);
+        }
+        clean->val(col, row, chan) = std::min(255.f, std::max(0.f, value));
+      }
+    }
+  }
+}
+
+void AddNoise(const Image &clean, float sigma, unsigned seed, Image *noisy) {
+  Random random(seed);
+  noisy->Resize(clean.rows(), clean.columns(), clean.channels());
+  for (int i = 0; i < clean.samples(); ++i) {
+    noisy->val(i) = clean.val(i) + sigma * random.Gaussian();
+  }
+}
+
+void BoxFilter(const Image &image, int radius, Image *filtered) {
+  const int rows = image.rows(), columns = image.columns();
+  const float area = (2 * radius + 1) * (2 * radius + 1);
+  filtered->Resize(rows, columns, image.channels());
+  for (int row = 0; row < rows; ++row) {
+    for (int col = 0; col < columns; ++col) {
+      for (int chan = 0; chan < image.channels(); ++chan) {
+        float sum = 0.f;
+        for (int dr = -radius; dr <= radius; ++dr) {
+          for (int dc = -radius; dc <= radius; ++dc) {
+            sum += image.val(utils::SymmetricCoordinate(col + dc, columns),
+                             utils::SymmetricCoordinate(row + dr, rows),
+                             chan);
+          }
+        }
+        filtered->val(col, row, chan) = sum / area;
+      }
+    }
+  }
+}
+
+void MakeSynthetic(int rows, int columns, int channels,
+                   const SyntheticContent &content, float sigma,
+                   unsigned seed, Image *noisy, Image *guide, Image *clean) {
+  Image image;
+  if (!clean) clean = &image;
+  MakeClean(rows, columns, channels, content, seed, clean);
+  // a different stream for the noise
+  AddNoise(*clean, sigma, seed ^ 0x9e3779b9u, noisy);
+  BoxFilter(*noisy, 1, guide);
+}
+
+}  // namespace da3d
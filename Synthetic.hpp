@@ -0,0 +1,58 @@
+/*
+ * Synthetic.hpp
+ *
+ * Synthetic workloads with a controlled share of flat areas, edges and
+ * texture, which is what the cost of DA3D depends on: flat areas are
+ * covered by few patches, texture needs many. The images depend only on the
+ * arguments and the seed, on any platform with IEEE arithmetic: the random
+ * numbers are drawn from std::mt19937 without the implementation-defined
+ * distributions of the standard library, the sines and logarithms are
+ * polynomials instead of the math library, and Synthetic.cpp is compiled
+ * with -ffp-contract=off, so that processors with FMA round the same.
+ */
+
+#ifndef DA3D_SYNTHETIC_HPP_
+#define DA3D_SYNTHETIC_HPP_
+
+#include <string>
+#include "Image.hpp"
+
+namespace da3d {
+
+// Shares of the cells of the image with every kind of content, normalized
+// by their sum
+struct SyntheticContent {
+  float flat = .4f;  // a smooth background
+  float edges = .3f;  // the background with sharp steps
+  float texture = .3f;  // a fine grating and random mosaic on it
+  int cell = 32;  // side of the square cells the content is assigned to
+};
+
+SyntheticContent BestCaseContent();  // all flat
+SyntheticContent TypicalContent();  // the defaults
+SyntheticContent WorstCaseContent();  // all texture
+
+// Reads "best", "typical", "worst", or the shares "flat,edges,texture".
+// Returns false if spec is invalid.
+bool ParseSyntheticContent(const std::string &spec,
+                           SyntheticContent *content);
+
+// Clean rows x columns x channels image with values in [0, 255]
+void MakeClean(int rows, int columns, int channels,
+               const SyntheticContent &content, unsigned seed, Image *clean);
+// clean plus white Gaussian noise of standard deviation sigma
+void AddNoise(const Image &clean, float sigma, unsigned seed, Image *noisy);
+// Box filter of (2 radius + 1)^2 pixels, with symmetric boundaries: a guide
+// for DA3D when no better estimate is available
+void BoxFilter(const Image &image, int radius, Image *filtered);
+
+// A noisy image and its guide (a 3 x 3 box filter of it), and optionally the
+// clean image
+void MakeSynthetic(int rows, int columns, int channels,
+                   const SyntheticContent &content, float sigma,
+                   unsigned seed, Image *noisy, Image *guide,
+                   Image *clean = nullptr);
+
+}  // namespace da3d
+
+#endif  // DA3D_SYNTHETIC_HPP_
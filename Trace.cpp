@@ -0,0 +1,76 @@
+/*
+ * Trace.cpp
+ */
+
+#include <cstdio>
+#include "Trace.hpp"
+#include "Utils.hpp"
+
+using std::string;
+
+namespace da3d {
+
+TraceRecorder::TraceRecorder(int patch_interval)
+    : patch_interval_(patch_interval), origin_(utils::Seconds()) {}
+
+double TraceRecorder::Now() const { return utils::Seconds() - origin_; }
+
+void TraceRecorder::NameTrack(int track, const string &name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  tracks_.insert({track, name});
+}
+
+void TraceRecorder::Span(int track, const string &name, double start,
+                         double end, const string &args) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  events_.push_back({'X', track, name, start, end - start, args});
+}
+
+void TraceRecorder::Counter(const string &name, const string &series,
+                            double time, double value) {
+  char args[64];
+  snprintf(args, sizeof(args), "{\"%.40s\": %g}", series.c_str(), value);
+  std::lock_guard<std::mutex> lock(mutex_);
+  events_.push_back({'C', 0, name, time, 0., args});
+}
+
+bool TraceRecorder::Write(const string &path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  FILE *file = fopen(path.c_str(), "w");
+  if (!file) return false;
+  // times in microseconds
+  fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf(file, "{\"ph\": \"M\", \"pid\": 1, \"name\": \"process_name\", "
+                "\"args\": {\"name\": \"da3d\"}}");
+  for (const auto &track : tracks_) {
+    fprintf(file, ",\n{\"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                  "\"name\": \"thread_name\", \"args\": {\"name\": \"%s\"}}",
+            track.first, track.second.c_str());
+    fprintf(file, ",\n{\"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                  "\"name\": \"thread_sort_index\", "
+                  "\"args\": {\"sort_index\": %d}}",
+            track.first, track.first);
+  }
+  for (const Event &e : events_) {
+    fprintf(file, ",\n{\"ph\": \"%c\", \"pid\": 1, \"tid\": %d, "
+                  "\"name\": \"%s\", \"ts\": %.3f",
+            e.phase, e.track, e.name.c_str(), e.start * 1e6);
+    if (e.phase == 'X') fprintf(file, ", \"dur\": %.3f", e.duration * 1e6);
+    if (!e.args.empty()) fprintf(file, ", \"args\": %s", e.args.c_str());
+    fprintf(file, "}");
+  }
+  fprintf(file, "\n]}\n");
+  return fclose(file) == 0;
+}
+
+void TraceRecorder::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  events_.clear();
+}
+
+size_t TraceRecorder::size() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return events_.size();
+}
+
+}  // namespace da3d
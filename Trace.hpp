@@ -0,0 +1,67 @@
+/*
+ * Trace.hpp
+ *
+ * Timeline of the calls of a Denoiser in the Chrome trace event format, to
+ * open in chrome://tracing or ui.perfetto.dev: one track per thread with the
+ * phases of the call and a span per tile, a sample of the patches, and the
+ * minimum of the weight map of every tile as a counter.
+ */
+
+#ifndef DA3D_TRACE_HPP_
+#define DA3D_TRACE_HPP_
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace da3d {
+
+// Thread-safe. Times are seconds from the construction of the recorder, so
+// the calls recorded into the same one share a time axis.
+class TraceRecorder {
+ public:
+  // one patch every patch_interval of each tile gets a span and a counter
+  // sample, 0 records no patches
+  explicit TraceRecorder(int patch_interval = 64);
+
+  TraceRecorder(const TraceRecorder&) = delete;
+  TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+  int patch_interval() const { return patch_interval_; }
+  double Now() const;
+
+  // Names the track of a thread; the first name given is kept
+  void NameTrack(int track, const std::string &name);
+  // args is a JSON object, or empty
+  void Span(int track, const std::string &name, double start, double end,
+            const std::string &args = "");
+  // a value of the given series of the counter named name
+  void Counter(const std::string &name, const std::string &series,
+               double time, double value);
+
+  // Writes the events as a JSON trace; false on error
+  bool Write(const std::string &path);
+  void Clear();
+  size_t size();
+
+ private:
+  struct Event {
+    char phase;  // 'X' for a span, 'C' for a counter
+    int track;
+    std::string name;
+    double start;
+    double duration;
+    std::string args;
+  };
+
+  const int patch_interval_;
+  const double origin_;
+  std::mutex mutex_;  // guards all the following
+  std::vector<Event> events_;
+  std::map<int, std::string> tracks_;
+};
+
+}  // namespace da3d
+
+#endif  // DA3D_TRACE_HPP_
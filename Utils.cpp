@@ -2,9 +2,14 @@
 // Created by Nicola Pierazzo on 07/04/16.
 //
 
+#include <cassert>
+#include <chrono>
 #include <cmath>
 #include "Utils.hpp"
 #include <algorithm>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 using std::string;
 using std::vector;
@@ -14,6 +19,8 @@ using std::max;
 using std::min;
 using da3d::Image;
 using da3d::WeightMap;
+using da3d::ImageView;
+using da3d::ConstImageView;
 
 namespace utils {
 
@@ -35,6 +42,43 @@ const char *pick_option(int *c, char **v, const char *o, const char *d) {
   return d;
 }
 
+double Seconds() {
+  using std::chrono::steady_clock;
+  return std::chrono::duration<double>(
+      steady_clock::now().time_since_epoch()).count();
+}
+
+ScopedPin::ScopedPin(int index) {
+#ifdef __linux__
+  if (index < 0) return;
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) != 0) return;
+  vector<int> cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+  }
+  if (cpus.empty()) return;
+  cpu_set_t pinned;
+  CPU_ZERO(&pinned);
+  CPU_SET(cpus[index % cpus.size()], &pinned);
+  if (sched_setaffinity(0, sizeof(pinned), &pinned) == 0) {
+    saved_ = move(cpus);
+  }
+#else
+  (void)index;
+#endif  // __linux__
+}
+
+ScopedPin::~ScopedPin() {
+#ifdef __linux__
+  if (saved_.empty()) return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : saved_) CPU_SET(cpu, &set);
+  sched_setaffinity(0, sizeof(set), &set);
+#endif  // __linux__
+}
+
 #ifndef WIN32
 extern "C" {
 #include "iio.h"
@@ -73,32 +117,156 @@ pair<int, int> ComputeTiling(int rows, int columns, int tiles) {
   }
 }
 
+pair<int, int> ComputeFixedTiling(int rows, int columns, int tile_size) {
+  return {(rows + tile_size - 1) / tile_size,
+          (columns + tile_size - 1) / tile_size};
+}
+
+double TilingCost(int rows, int columns, pair<int, int> tiling, int pad) {
+  // every tile costs its padded area, plus a fixed setup cost of about one
+  // patch (weight map, splitting and merging)
+  double tile_rows = static_cast<double>(rows) / tiling.first + pad;
+  double tile_columns = static_cast<double>(columns) / tiling.second + pad;
+  double setup = static_cast<double>(pad + 1) * (pad + 1);
+  return tiling.first * tiling.second * (tile_rows * tile_columns + setup);
+}
+
+vector<pair<int, int>> ComputeBatchTiling(const vector<pair<int, int>> &shapes,
+                                          int threads, int pad) {
+  const int n = static_cast<int>(shapes.size());
+  vector<int> tiles(n, 1);
+  vector<pair<int, int>> tiling(n, {1, 1});
+  vector<double> cost(n);
+  double total = 0.;
+  for (int i = 0; i < n; ++i) {
+    cost[i] = TilingCost(shapes[i].first, shapes[i].second, tiling[i], pad);
+    total += cost[i];
+  }
+  // The completion time is bounded below both by the total work shared among
+  // the threads and by the largest single tile. Split the image with the
+  // largest tiles as long as this does not make the bound worse: when several
+  // images have the same size, all of them must be split before the bound
+  // improves.
+  while (true) {
+    int worst = 0;
+    for (int i = 1; i < n; ++i) {
+      if (cost[i] / tiles[i] > cost[worst] / tiles[worst]) worst = i;
+    }
+    double bound = max(total / threads, cost[worst] / tiles[worst]);
+    // some tile counts give badly shaped tilings, so try all of them
+    int best_t = 0;
+    double best_bound = 0., best_cost = 0., best_total = 0.;
+    pair<int, int> best_tiling;
+    for (int t = tiles[worst] + 1; t <= threads; ++t) {
+      pair<int, int> new_tiling = ComputeTiling(shapes[worst].first,
+                                                shapes[worst].second, t);
+      double new_cost = TilingCost(shapes[worst].first, shapes[worst].second,
+                                   new_tiling, pad);
+      double new_total = total - cost[worst] + new_cost;
+      double new_largest = new_cost / t;
+      for (int i = 0; i < n; ++i) {
+        if (i != worst) new_largest = max(new_largest, cost[i] / tiles[i]);
+      }
+      double new_bound = max(new_total / threads, new_largest);
+      if (new_cost / t < cost[worst] / tiles[worst] && new_bound <= bound &&
+          (!best_t || new_bound < best_bound)) {
+        best_t = t;
+        best_bound = new_bound;
+        best_cost = new_cost;
+        best_total = new_total;
+        best_tiling = new_tiling;
+      }
+    }
+    if (!best_t) break;
+    tiles[worst] = best_t;
+    tiling[worst] = best_tiling;
+    cost[worst] = best_cost;
+    total = best_total;
+  }
+  return tiling;
+}
+
+double BatchTime(const vector<pair<int, int>> &shapes,
+                 const vector<pair<int, int>> &tilings, int threads,
+                 int pad) {
+  double total = 0., largest = 0.;
+  for (size_t i = 0; i < shapes.size(); ++i) {
+    double cost = TilingCost(shapes[i].first, shapes[i].second, tilings[i],
+                             pad);
+    total += cost;
+    largest = max(largest, cost / (tilings[i].first * tilings[i].second));
+  }
+  return max(total / threads, largest);
+}
+
+int ComputeBatchThreads(const vector<pair<int, int>> &shapes, int max_threads,
+                        int pad, double min_efficiency) {
+  const double serial = BatchTime(shapes,
+                                  ComputeBatchTiling(shapes, 1, pad), 1, pad);
+  for (int threads = max_threads; threads > 1; --threads) {
+    double time = BatchTime(shapes, ComputeBatchTiling(shapes, threads, pad),
+                            threads, pad);
+    if (serial / (time * threads) >= min_efficiency) return threads;
+  }
+  return 1;
+}
+
 vector<Image> SplitTiles(const Image &src,
                          int pad_before,
                          int pad_after,
                          pair<int, int> tiling) {
   vector<Image> result;
-  for (int tr = 0; tr < tiling.first; ++tr) {
-    int rstart = src.rows() * tr / tiling.first - pad_before;
-    int rend = src.rows() * (tr + 1) / tiling.first + pad_after;
-    for (int tc = 0; tc < tiling.second; ++tc) {
-      int cstart = src.columns() * tc / tiling.second - pad_before;
-      int cend = src.columns() * (tc + 1) / tiling.second + pad_after;
-      Image tile(rend - rstart, cend - cstart, src.channels());
-      for (int row = rstart; row < rend; ++row) {
-        for (int col = cstart; col < cend; ++col) {
-          for (int ch = 0; ch < src.channels(); ++ch) {
-            tile.val(col - cstart, row - rstart, ch) = src.val(
-                SymmetricCoordinate(col, src.columns()),
-                SymmetricCoordinate(row, src.rows()),
-                ch);
-          }
-        }
+  SplitTiles(src, pad_before, pad_after, tiling, &result);
+  return result;
+}
+
+pair<int, int> TileShape(int rows, int columns, int pad_before,
+                         int pad_after, pair<int, int> tiling, int index) {
+  int tr = index / tiling.second, tc = index % tiling.second;
+  return {rows * (tr + 1) / tiling.first - rows * tr / tiling.first +
+              pad_before + pad_after,
+          columns * (tc + 1) / tiling.second - columns * tc / tiling.second +
+              pad_before + pad_after};
+}
+
+pair<int, int> TileOrigin(int rows, int columns, pair<int, int> tiling,
+                          int index) {
+  int tr = index / tiling.second, tc = index % tiling.second;
+  return {rows * tr / tiling.first, columns * tc / tiling.second};
+}
+
+void ExtractTile(ConstImageView src, int pad_before, int pad_after,
+                 pair<int, int> tiling, int index, ImageView dst) {
+  int tr = index / tiling.second, tc = index % tiling.second;
+  int rstart = src.rows() * tr / tiling.first - pad_before;
+  int cstart = src.columns() * tc / tiling.second - pad_before;
+  assert(dst.shape() == TileShape(src.rows(), src.columns(), pad_before,
+                                  pad_after, tiling, index));
+  assert(dst.channels() == src.channels());
+  for (int row = 0; row < dst.rows(); ++row) {
+    for (int col = 0; col < dst.columns(); ++col) {
+      for (int ch = 0; ch < src.channels(); ++ch) {
+        dst.val(col, row, ch) = src.val(
+            SymmetricCoordinate(col + cstart, src.columns()),
+            SymmetricCoordinate(row + rstart, src.rows()),
+            ch);
       }
-      result.push_back(move(tile));
     }
   }
-  return result;
+}
+
+void SplitTiles(const Image &src,
+                int pad_before,
+                int pad_after,
+                pair<int, int> tiling,
+                vector<Image> *dst) {
+  dst->resize(tiling.first * tiling.second);
+  for (int t = 0; t < tiling.first * tiling.second; ++t) {
+    pair<int, int> shape = TileShape(src.rows(), src.columns(), pad_before,
+                                     pad_after, tiling, t);
+    (*dst)[t].Resize(shape.first, shape.second, src.channels());
+    ExtractTile(src, pad_before, pad_after, tiling, t, (*dst)[t]);
+  }
 }
 
 Image MergeTiles(const vector<pair<Image, Image>> &src,
@@ -106,9 +274,29 @@ Image MergeTiles(const vector<pair<Image, Image>> &src,
                  int pad_before,
                  int pad_after,
                  pair<int, int> tiling) {
+  Image result(shape.first, shape.second, src[0].first.channels());
+  Image weights;
+  MergeTiles(src, shape, pad_before, pad_after, tiling, result, &weights);
+  return result;
+}
+
+void MergeTiles(const vector<pair<Image, Image>> &src,
+                pair<int, int> shape,
+                int pad_before,
+                int pad_after,
+                pair<int, int> tiling,
+                ImageView result,
+                Image *weights) {
   int channels = src[0].first.channels();
-  Image result(shape.first, shape.second, channels);
-  Image weights(shape.first, shape.second);
+  assert(result.shape() == shape && result.channels() == channels);
+  for (int row = 0; row < shape.first; ++row) {
+    for (int col = 0; col < shape.second; ++col) {
+      for (int ch = 0; ch < channels; ++ch) {
+        result.val(col, row, ch) = 0.f;
+      }
+    }
+  }
+  weights->Resize(shape.first, shape.second);
   auto tile = src.begin();
   for (int tr = 0; tr < tiling.first; ++tr) {
     int rstart = shape.first * tr / tiling.first - pad_before;
@@ -122,7 +310,7 @@ Image MergeTiles(const vector<pair<Image, Image>> &src,
             result.val(col, row, ch) +=
                 tile->first.val(col - cstart, row - rstart, ch);
           }
-          weights.val(col, row) += tile->second.val(col - cstart, row - rstart);
+          weights->val(col, row) += tile->second.val(col - cstart, row - rstart);
         }
       }
       ++tile;
@@ -131,11 +319,10 @@ Image MergeTiles(const vector<pair<Image, Image>> &src,
   for (int row = 0; row < shape.first; ++row) {
     for (int col = 0; col < shape.second; ++col) {
       for (int ch = 0; ch < channels; ++ch) {
-        result.val(col, row, ch) /= weights.val(col, row);
+        result.val(col, row, ch) /= weights->val(col, row);
       }
     }
   }
-  return result;
 }
 
 }  // namespace utils
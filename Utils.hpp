@@ -13,6 +13,7 @@
 #include <vector>
 #include <utility>
 #include "Image.hpp"
+#include "ImageView.hpp"
 #include "WeightMap.hpp"
 
 namespace utils {
@@ -53,6 +54,28 @@ inline int SymmetricCoordinate(int pos, int size) {
   return pos;
 }
 
+// monotonic wall clock, in seconds
+double Seconds();
+
+// Pins the calling thread, while the object lives, to the index-th (modulo
+// their number) of the processors it may run on when the object is created,
+// so that it respects numactl, taskset and later changes of the cgroup. The
+// previous affinity is restored on destruction, so that the threads of the
+// caller are not left pinned. Does nothing for a negative index, or if
+// pinning is not supported.
+class ScopedPin {
+ public:
+  explicit ScopedPin(int index);
+  ~ScopedPin();
+  ScopedPin(const ScopedPin&) = delete;
+  ScopedPin& operator=(const ScopedPin&) = delete;
+
+  bool pinned() const { return !saved_.empty(); }
+
+ private:
+  std::vector<int> saved_;  // the processors allowed before, if pinned
+};
+
 #ifndef WIN32
 da3d::Image read_image(const std::string &filename);
 void save_image(const da3d::Image &image, const std::string &filename);
@@ -60,11 +83,56 @@ void save_image(const da3d::Image &image, const std::string &filename);
 
 const char *pick_option(int *c, char **v, const char *o, const char *d);
 std::pair<int, int> ComputeTiling(int rows, int columns, int tiles);
+// Tiling with tiles of at most tile_size x tile_size pixels, which depends
+// only on the size of the image.
+std::pair<int, int> ComputeFixedTiling(int rows, int columns, int tile_size);
+// Estimated cost, in processed pixels, of denoising a rows x columns image
+// split with the given tiling, where every tile is padded by pad pixels.
+double TilingCost(int rows, int columns, std::pair<int, int> tiling, int pad);
+// Chooses the tiling of every image of a batch (given as (rows, columns)
+// pairs) so that the estimated completion time on the given number of
+// threads is minimum: small images are processed whole, one per thread, and
+// large ones are split, trading halo overhead for parallelism.
+std::vector<std::pair<int, int>> ComputeBatchTiling(
+    const std::vector<std::pair<int, int>> &shapes, int threads, int pad);
+// Estimated completion time, in processed pixels per thread, of a batch with
+// the given tilings on the given number of threads.
+double BatchTime(const std::vector<std::pair<int, int>> &shapes,
+                 const std::vector<std::pair<int, int>> &tilings, int threads,
+                 int pad);
+// Chooses the number of threads, up to max_threads, for a batch tiled with
+// ComputeBatchTiling: the largest one whose estimated parallel efficiency
+// (speedup over one thread divided by the number of threads) is at least
+// min_efficiency. Small images are mostly padding when split in many tiles,
+// so they get few threads.
+int ComputeBatchThreads(const std::vector<std::pair<int, int>> &shapes,
+                        int max_threads, int pad, double min_efficiency = .5);
+// Shape of the tile with the given (row-major) index, padded as in SplitTiles
+std::pair<int, int> TileShape(int rows, int columns, int pad_before,
+                              int pad_after, std::pair<int, int> tiling,
+                              int index);
+// Upper left pixel of the tile with the given index, without padding
+std::pair<int, int> TileOrigin(int rows, int columns,
+                               std::pair<int, int> tiling, int index);
+// Copies one tile of src, padded symmetrically as in SplitTiles, into dst,
+// which must have the shape given by TileShape. This lets every thread copy
+// the tiles it processes, into memory local to it.
+void ExtractTile(da3d::ConstImageView src, int pad_before, int pad_after,
+                 std::pair<int, int> tiling, int index, da3d::ImageView dst);
 std::vector<da3d::Image> SplitTiles(const da3d::Image &src, int pad_before,
                                     int pad_after, std::pair<int, int> tiling);
+// same as above, but reuses the images already present in dst
+void SplitTiles(const da3d::Image &src, int pad_before, int pad_after,
+                std::pair<int, int> tiling, std::vector<da3d::Image> *dst);
 da3d::Image MergeTiles(const std::vector<std::pair<da3d::Image, da3d::Image>> &src,
                        std::pair<int, int> shape, int pad_before, int pad_after,
                        std::pair<int, int> tiling);
+// same as above, writing into result, which must have the right shape, and
+// using weights as scratch space
+void MergeTiles(const std::vector<std::pair<da3d::Image, da3d::Image>> &src,
+                std::pair<int, int> shape, int pad_before, int pad_after,
+                std::pair<int, int> tiling, da3d::ImageView result,
+                da3d::Image *weights);
 }  // namespace utils
 
 #endif  // DA3D_UTILS_HPP_
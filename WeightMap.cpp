@@ -13,6 +13,7 @@
 #include <algorithm>
 #include "WeightMap.hpp"
 #include "Image.hpp"
+#include "Arena.hpp"
 #include "Utils.hpp"
 
 using std::max;
@@ -27,7 +28,7 @@ WeightMap::WeightMap(int rows, int columns) {
   Init(rows, columns);
 }
 
-void WeightMap::Init(int rows, int columns) {
+void WeightMap::Init(int rows, int columns, Arena *arena) {
   assert (rows > 0 && columns > 0);
   int height_rows = utils::NumberOfBits(rows - 1) + 1;
   int height_columns = utils::NumberOfBits(columns - 1) + 1;
@@ -37,14 +38,37 @@ void WeightMap::Init(int rows, int columns) {
   rows_.resize(num_levels_);
   columns_.resize(num_levels_);
   data_.resize(num_levels_);
+  raw_.clear();
+  blocked_.clear();
 
-  // initialization of layers
+  // size of the layers
   int rows_rounded = utils::NextPowerOf2(rows);
   int cols_rounded = utils::NextPowerOf2(columns);
+  int total = 0;
   for (int l = 0; l < num_levels_; ++l) {
     rows_[l] = rows_rounded;
     columns_[l] = cols_rounded;
-    data_[l].resize(rows_rounded * cols_rounded);
+    total += rows_rounded * cols_rounded;
+    rows_rounded = ((rows_rounded + 3) >> 2) << 1;  // it stays at least 2
+    cols_rounded = ((cols_rounded + 3) >> 2) << 1;
+  }
+
+  // all the layers live in a single buffer
+  float *base;
+  if (arena) {
+    storage_.clear();
+    base = arena->Allocate(total);
+  } else {
+    storage_.resize(total);
+    base = storage_.data();
+  }
+
+  // initialization of layers
+  for (int l = 0; l < num_levels_; ++l) {
+    data_[l] = base;
+    base += rows_[l] * columns_[l];
+    rows_rounded = rows_[l];
+    cols_rounded = columns_[l];
     // zeros in the good area, MAXFLT elsewhere
     for (int row = 0; row < rows; ++row) {
       for (int col = 0; col < columns; ++col)
@@ -60,8 +84,6 @@ void WeightMap::Init(int rows, int columns) {
     }
     rows = (rows + 1) >> 1;  // it stays at least 1
     columns = (columns + 1) >> 1;
-    rows_rounded = ((rows_rounded + 3) >> 2) << 1;  // it stays at least 2
-    cols_rounded = ((cols_rounded + 3) >> 2) << 1;
   }
   assert(rows == 1);
   assert(columns == 1);
@@ -99,10 +121,84 @@ void WeightMap::IncreaseWeights(const Image &weights, int row0, int col0) {
   // Updates the level zero
   for (int row = firstrow; row <= lastrow; ++row) {
     for (int col = firstcol; col <= lastcol; ++col) {
+      if (raw_.empty()) {
         val(col, row) += weights.val(col - col0, row - row0);
+      } else {
+        const int i = columns_[0] * row + col;
+        raw_[i] += weights.val(col - col0, row - row0);
+        if (!blocked_[i]) data_[0][i] = raw_[i];
+      }
+    }
+  }
+  UpdateLevels(firstrow, lastrow, firstcol, lastcol);
+}
+
+void WeightMap::Block(int row0, int col0, int rows, int columns) {
+  if (raw_.empty()) {
+    raw_.assign(data_[0], data_[0] + rows_[0] * columns_[0]);
+    blocked_.assign(raw_.size(), 0);
+  }
+  int firstrow = max(0, row0);
+  int lastrow = min(height(), row0 + rows) - 1;
+  int firstcol = max(0, col0);
+  int lastcol = min(width(), col0 + columns) - 1;
+  for (int row = firstrow; row <= lastrow; ++row) {
+    for (int col = firstcol; col <= lastcol; ++col) {
+      const int i = columns_[0] * row + col;
+      if (blocked_[i]++ == 0)
+        data_[0][i] = std::numeric_limits<float>::infinity();
     }
   }
-  // Updates the other levels
+  UpdateLevels(firstrow, lastrow, firstcol, lastcol);
+}
+
+void WeightMap::Unblock(int row0, int col0, int rows, int columns) {
+  assert(!raw_.empty());
+  int firstrow = max(0, row0);
+  int lastrow = min(height(), row0 + rows) - 1;
+  int firstcol = max(0, col0);
+  int lastcol = min(width(), col0 + columns) - 1;
+  for (int row = firstrow; row <= lastrow; ++row) {
+    for (int col = firstcol; col <= lastcol; ++col) {
+      const int i = columns_[0] * row + col;
+      assert(blocked_[i] > 0);
+      if (--blocked_[i] == 0) data_[0][i] = raw_[i];
+    }
+  }
+  UpdateLevels(firstrow, lastrow, firstcol, lastcol);
+}
+
+void WeightMap::GetWeights(float *weights) const {
+  assert(raw_.empty());
+  for (int row = 0; row < height(); ++row) {
+    for (int col = 0; col < width(); ++col) *weights++ = val(col, row);
+  }
+}
+
+double WeightMap::Covered(float threshold) const {
+  int covered = 0;
+  for (int row = 0; row < height(); ++row) {
+    for (int col = 0; col < width(); ++col) {
+      // blocked positions hold infinity at level zero
+      float weight =
+          raw_.empty() ? val(col, row) : raw_[columns_[0] * row + col];
+      covered += weight >= threshold;
+    }
+  }
+  return covered / (static_cast<double>(height()) * width());
+}
+
+void WeightMap::SetWeights(const float *weights) {
+  assert(raw_.empty());
+  for (int row = 0; row < height(); ++row) {
+    for (int col = 0; col < width(); ++col) val(col, row) = *weights++;
+  }
+  UpdateLevels(0, height() - 1, 0, width() - 1);
+}
+
+// Propagates a change of the level zero to the other levels
+void WeightMap::UpdateLevels(int firstrow, int lastrow, int firstcol,
+                             int lastcol) {
   for (int l = 1; l < num_levels_; ++l) {
     for (int row = firstrow >> l; row <= lastrow >> l; ++row) {
       for (int col = firstcol >> l; col <= lastcol >> l; ++col) {
@@ -14,26 +14,50 @@
 namespace da3d {
 
 class Image;
+class Arena;
 
 class WeightMap {
  public:
   WeightMap() = default;
   WeightMap(int rows, int columns);
   ~WeightMap() = default;
-  void Init(int rows, int columns);
+  WeightMap(const WeightMap&) = delete;
+  WeightMap& operator=(const WeightMap&) = delete;
+  // If arena is not null, the levels are borrowed from it: the arena must not
+  // be reset while the map is in use.
+  void Init(int rows, int columns, Arena *arena = nullptr);
   float Minimum() const;
   std::pair<int, int> FindMinimum() const;
   void IncreaseWeights(const Image &weights, int row0, int col0);
+  // Hides the positions of a rectangle from Minimum and FindMinimum until the
+  // matching call to Unblock. Rectangles can overlap, and the weights of
+  // blocked positions are still increased.
+  void Block(int row0, int col0, int rows, int columns);
+  void Unblock(int row0, int col0, int rows, int columns);
+  // Copy the height() x width() weights of level zero, row by row, to or
+  // from weights, to save and restore the state of a map. No position can be
+  // blocked.
+  void GetWeights(float *weights) const;
+  // fraction of the positions with a weight of at least threshold
+  double Covered(float threshold) const;
+  void SetWeights(const float *weights);
   int width() const { return width_; }
   int height() const { return height_; }
   int num_levels() const { return num_levels_; }
   float val(int col, int row, int level = 0) const;
   float &val(int col, int row, int level = 0);
-  const float* data() const { return data_[0].data(); }
+  const float* data() const { return data_[0]; }
  private:
+  void UpdateLevels(int firstrow, int lastrow, int firstcol, int lastcol);
+
   int num_levels_{0}, width_{0}, height_{0};
   std::vector<int> rows_, columns_;
-  std::vector<std::vector<float>> data_;
+  std::vector<float *> data_;  // one pointer per level, into storage_ or an arena
+  std::vector<float> storage_;
+  // while positions are blocked level zero holds infinity for them, and
+  // their weights are kept in raw_
+  std::vector<float> raw_;
+  std::vector<int> blocked_;  // number of rectangles covering each position
 };
 
 inline float WeightMap::val(int col, int row, int level) const {
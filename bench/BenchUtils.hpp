@@ -0,0 +1,28 @@
+/*
+ * BenchUtils.hpp
+ *
+ * Helpers shared by the benchmark programs.
+ */
+
+#ifndef DA3D_BENCH_BENCHUTILS_HPP_
+#define DA3D_BENCH_BENCHUTILS_HPP_
+
+#include "Image.hpp"
+#include "Synthetic.hpp"
+
+namespace bench {
+
+// A synthetic image (Synthetic.hpp), by default with the typical mix of
+// flat areas, edges and texture, corrupted by seeded Gaussian noise. The
+// guide is a 3x3 box filter of the noisy image.
+inline void MakeInput(int rows, int columns, int channels, float sigma,
+                      unsigned seed, da3d::Image *noisy, da3d::Image *guide,
+                      const da3d::SyntheticContent &content =
+                          da3d::TypicalContent()) {
+  da3d::MakeSynthetic(rows, columns, channels, content, sigma, seed, noisy,
+                      guide);
+}
+
+}  // namespace bench
+
+#endif  // DA3D_BENCH_BENCHUTILS_HPP_
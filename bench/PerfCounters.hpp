@@ -0,0 +1,145 @@
+/*
+ * PerfCounters.hpp
+ *
+ * Hardware counters of the calling thread, and of the threads it creates
+ * while they are enabled once those have exited, read through Linux
+ * perf_event_open. Counters that the kernel, the processor or the
+ * permissions (/proc/sys/kernel/perf_event_paranoid) do not allow are
+ * reported as unavailable, and the benchmarks then only print times.
+ */
+
+#ifndef DA3D_BENCH_PERFCOUNTERS_HPP_
+#define DA3D_BENCH_PERFCOUNTERS_HPP_
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace bench {
+
+enum PerfEvent { kCycles, kInstructions, kCacheMisses, kTlbMisses,
+                 kPerfEvents };
+
+// Bytes moved from memory by a cache miss, to estimate the traffic
+const int kCacheLineBytes = 64;
+
+// Counts of an interval, scaled for the time the counters were multiplexed.
+// Negative when unavailable.
+struct PerfSample {
+  double count[kPerfEvents];
+
+  bool available(PerfEvent e) const { return count[e] >= 0.; }
+  // per unit of work, e.g. per call or per patch; NaN if unavailable
+  double Per(PerfEvent e, double units) const {
+    return available(e) && units > 0. ? count[e] / units : NAN;
+  }
+  double Ipc() const {
+    return available(kCycles) && available(kInstructions) && count[kCycles]
+               ? count[kInstructions] / count[kCycles] : NAN;
+  }
+  // estimated from the last level cache misses
+  double Bytes(double units) const {
+    return Per(kCacheMisses, units) * kCacheLineBytes;
+  }
+};
+
+inline const char *PerfEventName(PerfEvent e) {
+  static const char *names[kPerfEvents] = {"cycles", "instructions",
+                                           "cache_misses", "tlb_misses"};
+  return names[e];
+}
+
+class PerfCounters {
+ public:
+  // Opens the counters, disabled
+  PerfCounters() {
+    for (int e = 0; e < kPerfEvents; ++e) fds_[e] = -1;
+#ifdef __linux__
+    const uint32_t types[kPerfEvents] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+        PERF_TYPE_HW_CACHE};
+    const uint64_t configs[kPerfEvents] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+    for (int e = 0; e < kPerfEvents; ++e) {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = types[e];
+      attr.config = configs[e];
+      attr.disabled = 1;
+      attr.inherit = 1;  // the worker threads created while counting
+      attr.exclude_kernel = 1;  // allowed with perf_event_paranoid <= 2
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                         PERF_FORMAT_TOTAL_TIME_RUNNING;
+      // each counter alone, so that one missing does not hide the others
+      fds_[e] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1,
+                                         -1, 0));
+    }
+#endif
+  }
+  ~PerfCounters() {
+#ifdef __linux__
+    for (int fd : fds_) {
+      if (fd >= 0) close(fd);
+    }
+#endif
+  }
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  // If any counter could be opened
+  bool available() const {
+    for (int fd : fds_) {
+      if (fd >= 0) return true;
+    }
+    return false;
+  }
+
+  // Resets and enables the counters
+  void Start() {
+#ifdef __linux__
+    for (int fd : fds_) {
+      if (fd < 0) continue;
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  // Disables the counters and reads them
+  PerfSample Stop() {
+    PerfSample sample;
+    for (int e = 0; e < kPerfEvents; ++e) sample.count[e] = -1.;
+#ifdef __linux__
+    for (int e = 0; e < kPerfEvents; ++e) {
+      if (fds_[e] < 0) continue;
+      ioctl(fds_[e], PERF_EVENT_IOC_DISABLE, 0);
+      uint64_t values[3];  // value, time enabled, time running
+      if (read(fds_[e], values, sizeof(values)) != sizeof(values) ||
+          values[2] == 0) {
+        continue;  // never scheduled on the processor
+      }
+      sample.count[e] = static_cast<double>(values[0]) * values[1] /
+                        values[2];
+    }
+#endif
+    return sample;
+  }
+
+ private:
+  int fds_[kPerfEvents];
+};
+
+}  // namespace bench
+
+#endif  // DA3D_BENCH_PERFCOUNTERS_HPP_
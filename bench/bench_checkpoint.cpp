@@ -0,0 +1,141 @@
+/*
+ * bench_checkpoint.cpp
+ *
+ * Simulates a preempted run: a child process (this same program) denoises
+ * with checkpoints and is killed part way, then the run is resumed from the
+ * checkpoints, possibly on another number of threads. Reports the time
+ * saved by resuming and checks the result against an uninterrupted run on
+ * the same fixed tile grid.
+ */
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "BenchUtils.hpp"
+#include "Checkpoint.hpp"
+#include "DA3D.hpp"
+#include "Image.hpp"
+#include "Utils.hpp"
+
+extern char **environ;
+
+using std::string;
+using da3d::Checkpoint;
+using da3d::Denoiser;
+using da3d::Image;
+using da3d::Parameters;
+using da3d::Schedule;
+using utils::pick_option;
+using utils::Seconds;
+
+int main(int argc, char **argv) {
+  const char *directory = pick_option(&argc, argv, "directory",
+                                      "/tmp/da3d-checkpoint");
+  int rows = atoi(pick_option(&argc, argv, "rows", "1024"));
+  int columns = atoi(pick_option(&argc, argv, "columns", "1024"));
+  int tile_size = atoi(pick_option(&argc, argv, "tile_size", "256"));
+  int nthreads = atoi(pick_option(&argc, argv, "nthreads", "0"));
+  int resume_nthreads = atoi(pick_option(&argc, argv, "resume_nthreads",
+                                         std::to_string(nthreads).c_str()));
+  double interval = atof(pick_option(&argc, argv, "interval", ".5"));
+  double kill_at = atof(pick_option(&argc, argv, "kill_at", ".6"));
+  bool pipelined = pick_option(&argc, argv, "pipelined", nullptr) != nullptr;
+  bool child = pick_option(&argc, argv, "child", nullptr) != nullptr;
+  float sigma = 20.f;
+  if (argc > 1 || kill_at <= 0. || kill_at >= 1.) {
+    fprintf(stderr, "usage: %s [-directory DIR] [-rows R] [-columns C] "
+                    "[-tile_size T] [-nthreads N] [-resume_nthreads N] "
+                    "[-interval S] [-kill_at F] [-pipelined]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  Image noisy, guide;
+  bench::MakeInput(rows, columns, 1, sigma, 1234, &noisy, &guide);
+  Parameters params;
+  params.nthreads = nthreads;
+  params.schedule = Schedule::kFixed;
+  params.tile_size = tile_size;
+  params.pipelined = pipelined;
+  Image out;
+  if (child) {
+    // runs until killed
+    Denoiser denoiser(params);
+    denoiser.set_checkpoint(std::make_shared<Checkpoint>(directory,
+                                                         interval));
+    denoiser.Denoise(noisy, guide, sigma, &out);
+    return EXIT_SUCCESS;
+  }
+
+  Image expected;
+  double start = Seconds();
+  Denoiser uninterrupted(params);
+  uninterrupted.Denoise(noisy, guide, sigma, &expected);
+  double full = Seconds() - start;
+
+  // the interrupted run
+  mkdir(directory, 0755);
+  char self[4096];
+  ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+  string path = length > 0 ? string(self, length) : string(argv[0]);
+  std::vector<string> args = {
+      path, "-child", "-directory", directory, "-rows", std::to_string(rows),
+      "-columns", std::to_string(columns), "-tile_size",
+      std::to_string(tile_size), "-nthreads", std::to_string(nthreads),
+      "-interval", std::to_string(interval)};
+  if (pipelined) args.push_back("-pipelined");
+  std::vector<char *> child_argv;
+  for (string &arg : args) child_argv.push_back(&arg[0]);
+  child_argv.push_back(nullptr);
+  pid_t pid;
+  if (posix_spawn(&pid, path.c_str(), nullptr, nullptr, child_argv.data(),
+                  environ) != 0) {
+    fprintf(stderr, "cannot start %s\n", path.c_str());
+    return EXIT_FAILURE;
+  }
+  std::this_thread::sleep_for(std::chrono::duration<double>(kill_at * full));
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+
+  // the resumed run
+  std::shared_ptr<Checkpoint> checkpoint =
+      std::make_shared<Checkpoint>(directory, interval);
+  params.nthreads = resume_nthreads;
+  Denoiser denoiser(params);
+  denoiser.set_checkpoint(checkpoint);
+  start = Seconds();
+  denoiser.Denoise(noisy, guide, sigma, &out);
+  double resumed = Seconds() - start;
+  checkpoint->Flush();
+  Checkpoint::Stats stats = checkpoint->stats();
+  checkpoint->Clear();
+
+  bool identical = memcmp(expected.data(), out.data(),
+                          sizeof(float) * expected.samples()) == 0;
+  printf("image %dx%d, tiles of %d, %d threads resumed on %d%s, "
+         "snapshots every %g s\n", rows, columns, tile_size,
+         uninterrupted.nthreads(), denoiser.nthreads(),
+         pipelined ? " (pipelined)" : "", interval);
+  printf("uninterrupted       %10.3f s\n", full);
+  printf("killed after        %10.3f s\n", kill_at * full);
+  printf("resumed             %10.3f s\n", resumed);
+  printf("tiles resumed       %10lld (%lld complete)\n",
+         static_cast<long long>(stats.restored),
+         static_cast<long long>(stats.restored_complete));
+  printf("identical: %s\n", identical ? "yes" : "NO");
+  if (stats.restored == 0) {
+    // the snapshots were not found, or the child was killed before any
+    fprintf(stderr, "no tile was resumed\n");
+    return EXIT_FAILURE;
+  }
+  return identical ? EXIT_SUCCESS : EXIT_FAILURE;
+}
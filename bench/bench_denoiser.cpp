@@ -0,0 +1,159 @@
+/*
+ * bench_denoiser.cpp
+ *
+ * Measures the latency of repeated calls with the same parameters, comparing
+ * the one-shot DA3D() function with a reused Denoiser context. With -profile
+ * the stats of the last call are written as JSON, with the counters of every
+ * tile when the library is built with DA3D_INSTRUMENT. With -trace one more
+ * call is recorded as a Chrome trace, and with -heatmaps the patch density and
+ * cost maps of one more call are written as PREFIX_patches.tif and
+ * PREFIX_seconds.tif. -content selects the synthetic input (Synthetic.hpp):
+ * best, typical, worst, or the shares flat,edges,texture.
+ *
+ * With -perf the calls of a Denoiser with its own ThreadPool, whose threads
+ * are created and joined while counting, are measured with the hardware
+ * counters (PerfCounters.hpp), reported per patch.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+#include "BenchUtils.hpp"
+#include "DA3D.hpp"
+#include "Image.hpp"
+#include "PerfCounters.hpp"
+#include "Synthetic.hpp"
+#include "Trace.hpp"
+#include "Utils.hpp"
+
+using std::string;
+using std::vector;
+using da3d::Image;
+using da3d::Denoiser;
+using da3d::Parameters;
+using utils::pick_option;
+using utils::Seconds;
+
+int main(int argc, char **argv) {
+  int rows = atoi(pick_option(&argc, argv, "rows", "256"));
+  int columns = atoi(pick_option(&argc, argv, "columns", "256"));
+  int channels = atoi(pick_option(&argc, argv, "channels", "1"));
+  int calls = atoi(pick_option(&argc, argv, "calls", "10"));
+  int nthreads = atoi(pick_option(&argc, argv, "nthreads", "0"));
+  bool pin = pick_option(&argc, argv, "pin", nullptr) != nullptr;
+  bool perf = pick_option(&argc, argv, "perf", nullptr) != nullptr;
+  const char *profile = pick_option(&argc, argv, "profile", "");
+  const char *trace_file = pick_option(&argc, argv, "trace", "");
+  int trace_patches = atoi(pick_option(&argc, argv, "trace_patches", "64"));
+  const char *heatmaps = pick_option(&argc, argv, "heatmaps", "");
+  int heatmap_cell = atoi(pick_option(&argc, argv, "heatmap_cell", "1"));
+  float sigma = static_cast<float>(atof(pick_option(&argc, argv, "sigma",
+                                                    "20")));
+  da3d::SyntheticContent content;
+  bool content_ok = da3d::ParseSyntheticContent(
+      pick_option(&argc, argv, "content", "typical"), &content);
+  if (argc > 1 || calls < 1 || heatmap_cell < 1 || !content_ok) {
+    fprintf(stderr, "usage: %s [-rows R] [-columns C] [-channels N] "
+                    "[-calls N] [-nthreads N] [-pin] [-perf] [-sigma S] "
+                    "[-profile file.json] [-trace file.json] "
+                    "[-trace_patches N] [-heatmaps PREFIX] "
+                    "[-heatmap_cell N] [-content best|typical|worst|F,E,T]\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  Image noisy, guide;
+  bench::MakeInput(rows, columns, channels, sigma, 1234, &noisy, &guide,
+                   content);
+  vector<float> K_high, K_low;
+
+  // one-shot API: every call plans the FFTs and allocates its buffers
+  double start = Seconds();
+  for (int i = 0; i < calls; ++i) {
+    Image out = da3d::DA3D(noisy, guide, sigma, K_high, K_low, false,
+                           nthreads);
+  }
+  double oneshot = (Seconds() - start) / calls;
+
+  // reusable context: setup is paid once
+  Parameters params;
+  params.channels = channels;
+  params.nthreads = nthreads;
+  params.pin_threads = pin;
+  start = Seconds();
+  Denoiser denoiser(params);
+  double setup = Seconds() - start;
+  Image out;
+  start = Seconds();
+  denoiser.Denoise(noisy, guide, sigma, &out);
+  double first = Seconds() - start;
+  start = Seconds();
+  for (int i = 0; i < calls; ++i) {
+    denoiser.Denoise(noisy, guide, sigma, &out);
+  }
+  double reused = (Seconds() - start) / calls;
+
+  printf("image %dx%dx%d, %d threads%s, %d calls\n", rows, columns, channels,
+         denoiser.nthreads(), pin ? " (pinned)" : "", calls);
+  printf("DA3D()            %10.3f ms/call\n", oneshot * 1e3);
+  printf("Denoiser setup    %10.3f ms\n", setup * 1e3);
+  printf("Denoiser first    %10.3f ms\n", first * 1e3);
+  printf("Denoiser reused   %10.3f ms/call\n", reused * 1e3);
+  if (perf) {
+    bench::PerfCounters counters;
+    if (!counters.available()) {
+      fprintf(stderr, "hardware counters unavailable (see "
+                      "/proc/sys/kernel/perf_event_paranoid)\n");
+    } else {
+      long long patches = 0;
+      counters.Start();
+      {
+        Denoiser counted(params, std::make_shared<da3d::ThreadPool>(
+                                     params.nthreads));
+        for (int i = 0; i < calls; ++i) {
+          counted.Denoise(noisy, guide, sigma, &out);
+          patches += counted.stats().patches;
+        }
+      }  // joins the threads, whose counts are added on exit
+      bench::PerfSample sample = counters.Stop();
+      printf("per patch (%lld):\n", patches);
+      for (int i = 0; i < bench::kPerfEvents; ++i) {
+        bench::PerfEvent event = static_cast<bench::PerfEvent>(i);
+        printf("  %-16s%12.1f\n", bench::PerfEventName(event),
+               sample.Per(event, patches));
+      }
+      printf("  %-16s%12.3f\n", "ipc", sample.Ipc());
+      printf("  %-16s%12.1f\n", "bytes", sample.Bytes(patches));
+    }
+  }
+  if (profile[0]) {
+    FILE *f = fopen(profile, "w");
+    if (!f) {
+      fprintf(stderr, "cannot write %s\n", profile);
+      return EXIT_FAILURE;
+    }
+    fprintf(f, "%s\n", da3d::RunStatsJson(denoiser.stats()).c_str());
+    fclose(f);
+  }
+  if (trace_file[0]) {
+    std::shared_ptr<da3d::TraceRecorder> trace =
+        std::make_shared<da3d::TraceRecorder>(trace_patches);
+    denoiser.set_trace(trace);
+    denoiser.Denoise(noisy, guide, sigma, &out);
+    if (!trace->Write(trace_file)) {
+      fprintf(stderr, "cannot write %s\n", trace_file);
+      return EXIT_FAILURE;
+    }
+    denoiser.set_trace(nullptr);
+  }
+  if (heatmaps[0]) {
+    denoiser.set_heatmaps(heatmap_cell);
+    denoiser.Denoise(noisy, guide, sigma, &out);
+    const da3d::Heatmaps &maps = denoiser.heatmaps();
+    utils::save_image(maps.patches[0], string(heatmaps) + "_patches.tif");
+    utils::save_image(maps.seconds[0], string(heatmaps) + "_seconds.tif");
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,108 @@
+/*
+ * bench_distributed.cpp
+ *
+ * Runs the distributed mode on the local host with an increasing number of
+ * worker processes, which are this same program started again. The results
+ * are checked against a single-process run on the same fixed tile grid.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "BenchUtils.hpp"
+#include "DA3D.hpp"
+#include "Distributed.hpp"
+#include "Image.hpp"
+#include "Utils.hpp"
+
+using std::string;
+using std::vector;
+using da3d::Image;
+using da3d::Denoiser;
+using da3d::DistributedOptions;
+using da3d::Parameters;
+using da3d::Schedule;
+using utils::pick_option;
+using utils::Seconds;
+
+namespace {
+
+// path of the running program, used to start the workers
+string SelfPath(const char *argv0) {
+  char path[4096];
+  ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+  if (length <= 0) return argv0;
+  path[length] = '\0';
+  return path;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int status;
+  if (da3d::MaybeRunDistributedWorker(argc, argv, &status)) return status;
+
+  int rows = atoi(pick_option(&argc, argv, "rows", "512"));
+  int columns = atoi(pick_option(&argc, argv, "columns", "512"));
+  int channels = atoi(pick_option(&argc, argv, "channels", "1"));
+  int tile_size = atoi(pick_option(&argc, argv, "tile_size", "128"));
+  int nthreads = atoi(pick_option(&argc, argv, "nthreads", "1"));
+  const char *list = pick_option(&argc, argv, "processes", "1,2,4");
+  float sigma = static_cast<float>(atof(pick_option(&argc, argv, "sigma",
+                                                    "20")));
+  if (argc > 1 || tile_size < 1) {
+    fprintf(stderr, "usage: %s [-rows R] [-columns C] [-channels N] "
+                    "[-tile_size T] [-nthreads N] [-processes 1,2,4] "
+                    "[-sigma S]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  vector<int> processes;
+  std::stringstream items(list);
+  for (string item; std::getline(items, item, ',');) {
+    processes.push_back(atoi(item.c_str()));
+  }
+
+  Image noisy, guide;
+  bench::MakeInput(rows, columns, channels, sigma, 1234, &noisy, &guide);
+  Parameters params;
+  params.channels = channels;
+  params.nthreads = nthreads;
+  params.schedule = Schedule::kFixed;
+  params.tile_size = tile_size;
+  Image expected;
+  double start = Seconds();
+  Denoiser(params).Denoise(noisy, guide, sigma, &expected);
+  double single = Seconds() - start;
+
+  printf("image %dx%dx%d, tiles of %d, %d threads per process\n", rows,
+         columns, channels, tile_size, nthreads);
+  printf("processes       seconds   speedup  identical\n");
+  printf("in-process %12.3f %9.2f        yes\n", single, 1.);
+  DistributedOptions options;
+  options.threads = nthreads;
+  options.worker = SelfPath(argv[0]);
+  bool all = true;
+  for (int p : processes) {
+    options.processes = p;
+    Image out;
+    start = Seconds();
+    bool ok = da3d::DenoiseDistributed(noisy, guide, sigma, params, options,
+                                       &out);
+    double seconds = Seconds() - start;
+    if (!ok) {
+      printf("%10d       failed\n", p);
+      all = false;
+      continue;
+    }
+    bool identical = memcmp(expected.data(), out.data(),
+                            sizeof(float) * expected.samples()) == 0;
+    all = all && identical;
+    printf("%10d %12.3f %9.2f %10s\n", p, seconds, single / seconds,
+           identical ? "yes" : "NO");
+  }
+  return all ? EXIT_SUCCESS : EXIT_FAILURE;
+}
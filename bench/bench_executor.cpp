@@ -0,0 +1,116 @@
+/*
+ * bench_executor.cpp
+ *
+ * Serves concurrent requests, each with its own Denoiser, comparing the
+ * OpenMP executor (a parallel region per loop and per request, so the
+ * requests together start requests x nthreads threads) with one ThreadPool
+ * shared by all the Denoisers, which caps the total number of threads. The
+ * results are checked against a single-request run.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "BenchUtils.hpp"
+#include "DA3D.hpp"
+#include "Executor.hpp"
+#include "Image.hpp"
+#include "Utils.hpp"
+
+using std::shared_ptr;
+using std::vector;
+using da3d::Image;
+using da3d::Denoiser;
+using da3d::Executor;
+using da3d::Parameters;
+using da3d::Schedule;
+using utils::pick_option;
+using utils::Seconds;
+
+namespace {
+
+// Runs the requests on their own threads, every one calling its Denoiser
+// calls times. Returns the wall time.
+double Serve(const vector<Image> &noisy, const vector<Image> &guide,
+             float sigma, const Parameters &params,
+             const shared_ptr<Executor> &executor, int calls,
+             vector<Image> *out) {
+  const int requests = static_cast<int>(noisy.size());
+  vector<std::unique_ptr<Denoiser>> denoisers;
+  for (int i = 0; i < requests; ++i) {
+    denoisers.emplace_back(new Denoiser(params, executor));
+  }
+  double start = Seconds();
+  vector<std::thread> clients;
+  for (int i = 0; i < requests; ++i) {
+    clients.emplace_back([&, i] {
+      for (int c = 0; c < calls; ++c) {
+        denoisers[i]->Denoise(noisy[i], guide[i], sigma, &(*out)[i]);
+      }
+    });
+  }
+  for (std::thread &client : clients) client.join();
+  return Seconds() - start;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int rows = atoi(pick_option(&argc, argv, "rows", "512"));
+  int columns = atoi(pick_option(&argc, argv, "columns", "512"));
+  int channels = atoi(pick_option(&argc, argv, "channels", "1"));
+  int requests = atoi(pick_option(&argc, argv, "requests", "4"));
+  int calls = atoi(pick_option(&argc, argv, "calls", "2"));
+  int nthreads = atoi(pick_option(&argc, argv, "nthreads", "0"));
+  int pool_size = atoi(pick_option(&argc, argv, "pool", "0"));
+  float sigma = static_cast<float>(atof(pick_option(&argc, argv, "sigma",
+                                                    "20")));
+  if (argc > 1 || requests < 1 || calls < 1) {
+    fprintf(stderr, "usage: %s [-rows R] [-columns C] [-channels N] "
+                    "[-requests N] [-calls N] [-nthreads N] [-pool N] "
+                    "[-sigma S]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  vector<Image> noisy(requests), guide(requests), expected(requests);
+  for (int i = 0; i < requests; ++i) {
+    bench::MakeInput(rows, columns, channels, sigma, 1234 + i, &noisy[i],
+                     &guide[i]);
+  }
+  // the fixed grid makes the results independent of the executor
+  Parameters params;
+  params.channels = channels;
+  params.nthreads = nthreads;
+  params.schedule = Schedule::kFixed;
+  for (int i = 0; i < requests; ++i) {
+    Denoiser(params).Denoise(noisy[i], guide[i], sigma, &expected[i]);
+  }
+
+  shared_ptr<Executor> openmp = da3d::DefaultExecutor();
+  shared_ptr<Executor> pool = std::make_shared<da3d::ThreadPool>(pool_size);
+  vector<Image> out_openmp(requests), out_pool(requests);
+  double openmp_time = Serve(noisy, guide, sigma, params, openmp, calls,
+                             &out_openmp);
+  double pool_time = Serve(noisy, guide, sigma, params, pool, calls,
+                           &out_pool);
+
+  bool identical = true;
+  for (int i = 0; i < requests; ++i) {
+    size_t bytes = sizeof(float) * expected[i].samples();
+    identical = identical &&
+                memcmp(expected[i].data(), out_openmp[i].data(), bytes) == 0 &&
+                memcmp(expected[i].data(), out_pool[i].data(), bytes) == 0;
+  }
+  const int images = requests * calls;
+  printf("%d requests x %d calls, images %dx%dx%d\n", requests, calls, rows,
+         columns, channels);
+  printf("OpenMP, %d threads per request %10.3f images/s\n",
+         nthreads ? nthreads : openmp->concurrency(), images / openmp_time);
+  printf("shared pool of %d threads    %10.3f images/s\n",
+         pool->concurrency(), images / pool_time);
+  printf("identical: %s\n", identical ? "yes" : "NO");
+  return identical ? EXIT_SUCCESS : EXIT_FAILURE;
+}
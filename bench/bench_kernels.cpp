@@ -0,0 +1,257 @@
+/*
+ * bench_kernels.cpp
+ *
+ * Times every step of the processing of a patch (Kernels.hpp), the FFTs and
+ * the weight map operations in isolation, for several patch radii and
+ * numbers of channels, on random data. Every kernel is repeated until it
+ * runs for at least -min_time seconds. Prints CSV, or JSON with -json.
+ *
+ * The kernels that modify their input in place (the inverse FFT, which
+ * destroys the spectrum, the shrinkage and the aggregations, which square the
+ * weights) get a fresh copy of it at every call, and the time includes the
+ * copy.
+ *
+ * With -perf every kernel also reports, per call (i.e. per patch for the
+ * patch kernels), the cycles, instructions, IPC, last level cache and TLB
+ * misses and the memory traffic they imply (PerfCounters.hpp). The columns
+ * are empty, or null in JSON, where the counters are unavailable.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "DftPatch.hpp"
+#include "PerfCounters.hpp"
+#include "Image.hpp"
+#include "Kernels.hpp"
+#include "Utils.hpp"
+#include "WeightMap.hpp"
+
+using std::pair;
+using std::string;
+using std::vector;
+using da3d::DftPatch;
+using da3d::Image;
+using da3d::WeightMap;
+using utils::pick_option;
+using utils::Seconds;
+
+namespace {
+
+struct Result {
+  string kernel;
+  int r;
+  int s;
+  int channels;
+  long long calls;
+  double ns_per_call;
+  bench::PerfSample sample;  // of all the calls
+};
+
+// What Measure learned about its last batch
+struct Batch {
+  bench::PerfCounters *perf;  // null to only time
+  long long calls;
+  bench::PerfSample sample;
+};
+
+vector<int> ParseList(const char *list) {
+  vector<int> values;
+  std::stringstream stream(list);
+  string item;
+  while (std::getline(stream, item, ',')) values.push_back(atoi(item.c_str()));
+  return values;
+}
+
+// Calls f in batches of doubling size until a batch takes min_time, and
+// returns the time per call of that batch, whose size and counters are
+// stored in batch
+template <class F>
+double Measure(F f, double min_time, Batch *batch) {
+  f();  // warm up
+  for (long long n = 1;; n *= 2) {
+    if (batch->perf) batch->perf->Start();
+    double start = Seconds();
+    for (long long i = 0; i < n; ++i) f();
+    double elapsed = Seconds() - start;
+    if (batch->perf) batch->sample = batch->perf->Stop();
+    if (elapsed >= min_time || n >= (1LL << 40)) {
+      batch->calls = n;
+      return elapsed / n * 1e9;
+    }
+  }
+}
+
+// value, or missing if it is NaN
+string Format(double value, const char *format, const char *missing) {
+  if (std::isnan(value)) return missing;
+  char text[64];
+  snprintf(text, sizeof(text), format, value);
+  return text;
+}
+
+void Fill(std::mt19937 *gen, float low, float high, Image *image) {
+  std::uniform_real_distribution<float> value(low, high);
+  for (float &v : *image) v = value(*gen);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  vector<int> radii = ParseList(pick_option(&argc, argv, "r", "7,15,31"));
+  vector<int> channel_counts = ParseList(pick_option(&argc, argv, "channels",
+                                                     "1,3"));
+  int map_size = atoi(pick_option(&argc, argv, "map", "256"));
+  double min_time = atof(pick_option(&argc, argv, "min_time", ".2"));
+  bool lut = pick_option(&argc, argv, "lut", nullptr) != nullptr;
+  bool json = pick_option(&argc, argv, "json", nullptr) != nullptr;
+  bool perf = pick_option(&argc, argv, "perf", nullptr) != nullptr;
+  float sigma = 20.f;
+  if (argc > 1 || radii.empty() || channel_counts.empty() || map_size < 1) {
+    fprintf(stderr, "usage: %s [-r R1,R2,...] [-channels C1,C2,...] "
+                    "[-map N] [-min_time S] [-lut] [-perf] [-json]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  bench::PerfCounters counters;
+  if (perf && !counters.available()) {
+    fprintf(stderr, "hardware counters unavailable (see "
+                    "/proc/sys/kernel/perf_event_paranoid), timing only\n");
+  }
+
+  // look-up tables sampling the analytic curve, as read from the MEX file
+  vector<float> K_high, K_low;
+  if (lut) {
+    for (int i = 0; i <= 8; ++i) {
+      K_high.push_back(i ? utils::fastexp(-.8f / (i / 4.f)) : 0.f);
+      K_low.push_back(K_high.back());
+    }
+  }
+
+  vector<Result> results;
+  std::mt19937 gen(1234);
+  for (int r : radii) {
+    const int s = utils::NextPowerOf2(2 * r + 1);
+    for (int channels : channel_counts) {
+      // set by Measure, before add reads it
+      Batch batch = {perf ? &counters : nullptr, 0, bench::PerfSample()};
+      auto add = [&](const char *kernel, double ns) {
+        results.push_back({kernel, r, s, channels, batch.calls, ns,
+                           batch.sample});
+      };
+      const float sigma2 = sigma * sigma;
+      const float gamma_r_sigma2 = .7f * sigma2, sigma_s2 = 14.f * 14.f;
+      Image padded(2 * s, 2 * s, channels);
+      Fill(&gen, 0.f, 255.f, &padded);
+      Image y(s, s, channels), g(s, s, channels), k(s, s), k_saved(s, s);
+      da3d::ExtractPatch(padded, s / 2, s / 2, &y);
+      da3d::ExtractPatch(padded, s / 3, s / 3, &g);
+      vector<pair<float, float>> reg_plane(channels);
+      vector<float> average(channels);
+      DftPatch y_m(s, s, channels, FFTW_ESTIMATE);
+      DftPatch g_m(s, s, channels, FFTW_ESTIMATE);
+
+      add("extract", Measure([&] {
+            da3d::ExtractPatch(padded, s / 2, s / 2, &y);
+          }, min_time, &batch));
+      add("bilateral_weight", Measure([&] {
+            da3d::BilateralWeight(g, &k, r, gamma_r_sigma2, sigma_s2);
+          }, min_time, &batch));
+      add("regression_plane", Measure([&] {
+            da3d::ComputeRegressionPlane(y, g, k, r, &reg_plane);
+          }, min_time, &batch));
+      // the plane is small, so y stays finite
+      add("subtract_plane", Measure([&] {
+            da3d::SubtractPlane(r, reg_plane, &y);
+          }, min_time, &batch));
+      add("modify_patch", Measure([&] {
+            da3d::ModifyPatch(y, k, &y_m, average.data());
+          }, min_time, &batch));
+      da3d::ModifyPatch(g, k, &g_m);
+      // out of place, the forward transform preserves its input
+      add("fft_forward", Measure([&] { y_m.ToFreq(); }, min_time, &batch));
+      g_m.ToFreq();
+      const int spectrum = s * (s / 2 + 1) * channels;
+      vector<std::complex<float>> saved(&y_m.freq(0, 0),
+                                        &y_m.freq(0, 0) + spectrum);
+      add("fft_inverse", Measure([&] {
+            std::copy(saved.begin(), saved.end(), &y_m.freq(0, 0));
+            y_m.ToSpace();
+          }, min_time, &batch));
+      add("shrink", Measure([&] {
+            std::copy(saved.begin(), saved.end(), &y_m.freq(0, 0));
+            da3d::ShrinkSpectrum(k, sigma2, g_m, K_high, K_low, &y_m);
+          }, min_time, &batch));
+      Image output(2 * s, 2 * s, channels), weights(2 * s, 2 * s);
+      std::copy(k.begin(), k.end(), k_saved.begin());
+      add("aggregate", Measure([&] {
+            std::copy(k_saved.begin(), k_saved.end(), k.begin());
+            da3d::AggregateShrunk(y_m, average.data(), reg_plane, r, s / 2,
+                                  s / 2, &k, &output, &weights);
+          }, min_time, &batch));
+      add("aggregate_guide", Measure([&] {
+            std::copy(k_saved.begin(), k_saved.end(), k.begin());
+            da3d::AggregateGuide(g, reg_plane, r, s / 2, s / 2, &k, &output,
+                                 &weights);
+          }, min_time, &batch));
+
+      // the map of a tile of map_size x map_size pixels, with the patches
+      // swept over it
+      if (channels != channel_counts[0]) continue;  // independent of them
+      WeightMap map(map_size, map_size);
+      std::copy(k_saved.begin(), k_saved.end(), k.begin());
+      for (float &v : k) v *= v;
+      add("find_minimum", Measure([&] { map.FindMinimum(); }, min_time,
+                                  &batch));
+      int position = 0;
+      add("increase_weights", Measure([&] {
+            position = (position + 7919) % (map_size * map_size);
+            map.IncreaseWeights(k, position / map_size - r,
+                                position % map_size - r);
+          }, min_time, &batch));
+    }
+  }
+
+  // the counters per call, and the bytes implied by the cache misses
+  auto counts = [&](const Result &e, const char *missing) {
+    const char *separator = json ? ", " : ",";
+    string text;
+    for (int i = 0; i < bench::kPerfEvents; ++i) {
+      bench::PerfEvent event = static_cast<bench::PerfEvent>(i);
+      if (json) text += string(", \"") + bench::PerfEventName(event) + "\": ";
+      else text += separator;
+      text += Format(e.sample.Per(event, e.calls), "%.1f", missing);
+    }
+    text += json ? ", \"ipc\": " : separator;
+    text += Format(e.sample.Ipc(), "%.3f", missing);
+    text += json ? ", \"bytes\": " : separator;
+    text += Format(e.sample.Bytes(e.calls), "%.1f", missing);
+    return text;
+  };
+  if (json) {
+    printf("[");
+    for (size_t i = 0; i < results.size(); ++i) {
+      const Result &e = results[i];
+      printf("%s\n  {\"kernel\": \"%s\", \"r\": %d, \"s\": %d, "
+             "\"channels\": %d, \"calls\": %lld, \"ns_per_call\": %.1f%s}",
+             i ? "," : "", e.kernel.c_str(), e.r, e.s, e.channels, e.calls,
+             e.ns_per_call, perf ? counts(e, "null").c_str() : "");
+    }
+    printf("\n]\n");
+  } else {
+    printf("kernel,r,s,channels,calls,ns_per_call%s\n",
+           perf ? ",cycles,instructions,cache_misses,tlb_misses,ipc,bytes"
+                : "");
+    for (const Result &e : results) {
+      printf("%s,%d,%d,%d,%lld,%.1f%s\n", e.kernel.c_str(), e.r, e.s,
+             e.channels, e.calls, e.ns_per_call,
+             perf ? counts(e, "").c_str() : "");
+    }
+  }
+  return EXIT_SUCCESS;
+}
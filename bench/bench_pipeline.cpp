@@ -0,0 +1,134 @@
+/*
+ * bench_pipeline.cpp
+ *
+ * Compares the pipelined execution of the tiles with the sequential one on
+ * the same tile grid, checking that the results are bitwise identical, and
+ * summarizes the per-stage timeline of the pipelined run: the time spent in
+ * every stage by each lane, and how long the two lanes of a tile were busy at
+ * the same time. With -timeline the events are also written as CSV.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+#include "BenchUtils.hpp"
+#include "DA3D.hpp"
+#include "Image.hpp"
+#include "Utils.hpp"
+
+using std::vector;
+using da3d::Image;
+using da3d::Denoiser;
+using da3d::Parameters;
+using da3d::Schedule;
+using da3d::Stage;
+using da3d::StageEvent;
+using utils::pick_option;
+using utils::Seconds;
+
+namespace {
+
+// Time during which both lanes of a tile were running a stage. The events of
+// a lane do not overlap each other.
+double BusyTogether(const vector<StageEvent> &timeline) {
+  std::map<int, vector<StageEvent>> lanes[2];
+  for (const StageEvent &e : timeline) lanes[e.lane][e.tile].push_back(e);
+  double total = 0.;
+  for (const auto &tile : lanes[0]) {
+    const vector<StageEvent> &a = tile.second;
+    const vector<StageEvent> &b = lanes[1][tile.first];
+    size_t i = 0, j = 0;
+    while (i < a.size() && j < b.size()) {
+      total += std::max(0., std::min(a[i].end, b[j].end) -
+                            std::max(a[i].start, b[j].start));
+      if (a[i].end < b[j].end) ++i; else ++j;
+    }
+  }
+  return total;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int rows = atoi(pick_option(&argc, argv, "rows", "512"));
+  int columns = atoi(pick_option(&argc, argv, "columns", "512"));
+  int channels = atoi(pick_option(&argc, argv, "channels", "1"));
+  int nthreads = atoi(pick_option(&argc, argv, "nthreads", "2"));
+  int tile_size = atoi(pick_option(&argc, argv, "tile_size", "256"));
+  const char *timeline_file = pick_option(&argc, argv, "timeline", "");
+  float sigma = static_cast<float>(atof(pick_option(&argc, argv, "sigma",
+                                                    "20")));
+  if (argc > 1) {
+    fprintf(stderr, "usage: %s [-rows R] [-columns C] [-channels N] "
+                    "[-nthreads N] [-tile_size N] [-timeline file.csv] "
+                    "[-sigma S]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  Image noisy, guide;
+  bench::MakeInput(rows, columns, channels, sigma, 1234, &noisy, &guide);
+
+  // the fixed grid gives both runs the same tiles
+  Parameters params;
+  params.channels = channels;
+  params.nthreads = nthreads;
+  params.schedule = Schedule::kFixed;
+  params.tile_size = tile_size;
+  Denoiser sequential(params);
+  params.pipelined = true;
+  Denoiser pipelined(params);
+  pipelined.set_timeline(true);
+
+  Image expected, out;
+  double start = Seconds();
+  sequential.Denoise(noisy, guide, sigma, &expected);
+  double sequential_time = Seconds() - start;
+  start = Seconds();
+  pipelined.Denoise(noisy, guide, sigma, &out);
+  double pipelined_time = Seconds() - start;
+  bool identical = memcmp(expected.data(), out.data(),
+                          sizeof(float) * out.samples()) == 0;
+
+  const vector<StageEvent> &timeline = pipelined.stats().timeline;
+  double busy[2] = {0., 0.};
+  std::map<Stage, double> stage_time[2];
+  for (const StageEvent &e : timeline) {
+    busy[e.lane] += e.end - e.start;
+    stage_time[e.lane][e.stage] += e.end - e.start;
+  }
+  double together = BusyTogether(timeline);
+
+  printf("image %dx%dx%d, %d threads, tiles of %d pixels\n", rows, columns,
+         channels, nthreads, tile_size);
+  printf("sequential   %10.3f ms\n", sequential_time * 1e3);
+  printf("pipelined    %10.3f ms (%d tiles at a time, identical: %s)\n",
+         pipelined_time * 1e3, (pipelined.stats().threads + 1) / 2,
+         identical ? "yes" : "NO");
+  printf("%-12s %12s %12s\n", "stage", "lane 0 (ms)", "lane 1 (ms)");
+  for (int i = 0; i <= static_cast<int>(Stage::kUpdate); ++i) {
+    Stage stage = static_cast<Stage>(i);
+    printf("%-12s %12.3f %12.3f\n", da3d::StageName(stage),
+           stage_time[0][stage] * 1e3, stage_time[1][stage] * 1e3);
+  }
+  printf("%-12s %12.3f %12.3f\n", "total", busy[0] * 1e3, busy[1] * 1e3);
+  printf("both lanes busy %10.3f ms (%.1f%% of lane 1)\n", together * 1e3,
+         busy[1] > 0. ? 100. * together / busy[1] : 0.);
+
+  if (timeline_file[0]) {
+    FILE *f = fopen(timeline_file, "w");
+    if (!f) {
+      fprintf(stderr, "cannot write %s\n", timeline_file);
+      return EXIT_FAILURE;
+    }
+    fprintf(f, "tile,lane,stage,start,end\n");
+    for (const StageEvent &e : timeline) {
+      fprintf(f, "%d,%d,%s,%.9f,%.9f\n", e.tile, e.lane,
+              da3d::StageName(e.stage), e.start, e.end);
+    }
+    fclose(f);
+  }
+  return identical ? EXIT_SUCCESS : EXIT_FAILURE;
+}
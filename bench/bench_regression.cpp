@@ -0,0 +1,228 @@
+/*
+ * bench_regression.cpp
+ *
+ * Guards optimizations against silent changes of the result. DA3D() denoises
+ * a fixed corpus of synthetic images (Synthetic.hpp), and every output is
+ * compared with its golden copy (maximum absolute difference) and with the
+ * clean image (PSNR), and its time with a saved baseline. The program fails
+ * if an output differs from its golden copy by more than -max_diff, if its
+ * PSNR drops by more than -psnr_drop dB, or if it is slower by more than
+ * -slowdown (a fraction of the baseline time; -no_time skips the check, e.g.
+ * on another machine).
+ *
+ * -record writes the golden outputs, DIR/<case>.tif, and the baseline,
+ * DIR/baseline.csv, from the current build instead of checking them.
+ * The number of threads, which sets the tiling and so the output, is fixed
+ * by -nthreads, not by the machine.
+ *
+ * bench/golden, the default DIR from the root of the sources, has the
+ * outputs of the code before the optimizations, which ctest checks. They
+ * were computed with FFTW 3.3.5 (SSE2 and AVX), 4 threads and FFTW_MEASURE
+ * plans; other builds and plans round the transforms differently, which
+ * moves the outputs by about 2e-4, well below the default -max_diff.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include "DA3D.hpp"
+#include "Image.hpp"
+#include "Synthetic.hpp"
+#include "Utils.hpp"
+
+using std::map;
+using std::string;
+using std::vector;
+using da3d::Image;
+using da3d::SyntheticContent;
+using utils::pick_option;
+using utils::Seconds;
+
+namespace {
+
+struct Case {
+  const char *name;
+  int rows, columns, channels;
+  SyntheticContent content;
+  float sigma;
+  unsigned seed;
+};
+
+struct Baseline {
+  double psnr;
+  double seconds;
+};
+
+vector<Case> Corpus() {
+  return {
+      {"flat_gray", 160, 160, 1, da3d::BestCaseContent(), 20.f, 11},
+      {"typical_gray", 160, 160, 1, da3d::TypicalContent(), 20.f, 12},
+      {"worst_gray", 160, 160, 1, da3d::WorstCaseContent(), 20.f, 13},
+      {"typical_color", 96, 96, 3, da3d::TypicalContent(), 30.f, 14},
+      {"typical_low_noise", 160, 160, 1, da3d::TypicalContent(), 5.f, 15},
+  };
+}
+
+double Psnr(const Image &a, const Image &b) {
+  double mse = 0.;
+  for (int i = 0; i < a.samples(); ++i) {
+    double d = a.val(i) - b.val(i);
+    mse += d * d;
+  }
+  mse /= a.samples();
+  return mse > 0. ? 10. * std::log10(255. * 255. / mse) : INFINITY;
+}
+
+double MaxDifference(const Image &a, const Image &b) {
+  double max = 0.;
+  for (int i = 0; i < a.samples(); ++i) {
+    max = std::max(max, static_cast<double>(std::fabs(a.val(i) - b.val(i))));
+  }
+  return max;
+}
+
+// Returns why filename cannot be a golden output of the given number of
+// samples, or an empty string. iio exits on the files it cannot read, so
+// they are reported here first: -record writes uncompressed TIFF files,
+// with all the samples after the header.
+string CheckGolden(const string &filename, int samples) {
+  FILE *f = fopen(filename.c_str(), "rb");
+  if (!f) return std::strerror(errno);
+  char magic[4];
+  const bool tiff = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+                    (std::memcmp(magic, "II*\0", 4) == 0 ||
+                     std::memcmp(magic, "MM\0*", 4) == 0);
+  const bool sized = fseek(f, 0, SEEK_END) == 0 &&
+                     ftell(f) >= static_cast<long>(sizeof(float)) * samples;
+  fclose(f);
+  if (!tiff) return "not a TIFF file";
+  if (!sized) return "too short for the output";
+  return "";
+}
+
+// Reads the lines "case,psnr,seconds" after the header
+bool ReadBaseline(const string &filename, map<string, Baseline> *baseline) {
+  FILE *f = fopen(filename.c_str(), "r");
+  if (!f) return false;
+  char line[256], name[128];
+  Baseline b;
+  if (!fgets(line, sizeof(line), f)) line[0] = '\0';  // header
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%127[^,],%lf,%lf", name, &b.psnr, &b.seconds) == 3) {
+      (*baseline)[name] = b;
+    }
+  }
+  fclose(f);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const char *dir = pick_option(&argc, argv, "golden", "bench/golden");
+  bool record = pick_option(&argc, argv, "record", nullptr) != nullptr;
+  bool no_time = pick_option(&argc, argv, "no_time", nullptr) != nullptr;
+  int nthreads = atoi(pick_option(&argc, argv, "nthreads", "4"));
+  int repeat = atoi(pick_option(&argc, argv, "repeat", "3"));
+  double max_diff = atof(pick_option(&argc, argv, "max_diff", ".01"));
+  double psnr_drop = atof(pick_option(&argc, argv, "psnr_drop", ".05"));
+  double slowdown = atof(pick_option(&argc, argv, "slowdown", ".15"));
+  if (argc > 1 || nthreads < 1 || repeat < 1) {
+    fprintf(stderr, "usage: %s [-golden DIR] [-record] [-nthreads N] "
+                    "[-repeat N] [-max_diff D] [-psnr_drop DB] "
+                    "[-slowdown F] [-no_time]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  const string baseline_file = string(dir) + "/baseline.csv";
+  map<string, Baseline> baseline;
+  if (!record && !ReadBaseline(baseline_file, &baseline)) {
+    fprintf(stderr, "cannot read %s; create it with -record\n",
+            baseline_file.c_str());
+    return EXIT_FAILURE;
+  }
+
+  vector<float> K_high, K_low;  // the analytic curve
+  vector<Case> corpus = Corpus();
+  vector<Baseline> measured;
+  int failures = 0;
+  printf("%-18s %9s %9s %9s %9s %9s  %s\n", "case", "psnr", "base", "diff",
+         "seconds", "base", "status");
+  for (const Case &c : corpus) {
+    Image noisy, guide, clean;
+    da3d::MakeSynthetic(c.rows, c.columns, c.channels, c.content, c.sigma,
+                        c.seed, &noisy, &guide, &clean);
+    Image out;
+    double seconds = 0.;
+    for (int i = 0; i < repeat; ++i) {
+      double start = Seconds();
+      out = da3d::DA3D(noisy, guide, c.sigma, K_high, K_low, false, nthreads);
+      double elapsed = Seconds() - start;
+      if (i == 0 || elapsed < seconds) seconds = elapsed;
+    }
+    const double psnr = Psnr(out, clean);
+    const string golden_file = string(dir) + "/" + c.name + ".tif";
+    measured.push_back({psnr, seconds});
+    if (record) {
+      utils::save_image(out, golden_file);
+      printf("%-18s %9.4f %9s %9s %9.4f %9s  recorded\n", c.name, psnr, "",
+             "", seconds, "");
+      continue;
+    }
+
+    string status;
+    double diff = NAN;
+    const string problem = CheckGolden(golden_file, out.samples());
+    if (!problem.empty()) {
+      fprintf(stderr, "cannot read %s: %s\n", golden_file.c_str(),
+              problem.c_str());
+      status = "unreadable golden";
+    } else if (!baseline.count(c.name)) {
+      fprintf(stderr, "no %s in %s\n", c.name, baseline_file.c_str());
+      status = "missing baseline";
+    } else {
+      Image golden = utils::read_image(golden_file);
+      if (golden.rows() != out.rows() || golden.columns() != out.columns() ||
+          golden.channels() != out.channels()) {
+        status = "golden shape";
+      } else {
+        diff = MaxDifference(out, golden);
+        if (diff > max_diff) status += " output";
+      }
+      const Baseline &b = baseline[c.name];
+      if (psnr < b.psnr - psnr_drop) status += " quality";
+      if (!no_time && seconds > b.seconds * (1. + slowdown)) status += " time";
+    }
+    const Baseline b = baseline.count(c.name) ? baseline[c.name]
+                                              : Baseline{NAN, NAN};
+    printf("%-18s %9.4f %9.4f %9.4f %9.4f %9.4f  %s\n", c.name, psnr, b.psnr,
+           diff, seconds, b.seconds,
+           status.empty() ? "ok" : ("FAIL:" + status).c_str());
+    if (!status.empty()) ++failures;
+  }
+
+  if (record) {
+    FILE *f = fopen(baseline_file.c_str(), "w");
+    if (!f) {
+      fprintf(stderr, "cannot write %s\n", baseline_file.c_str());
+      return EXIT_FAILURE;
+    }
+    fprintf(f, "case,psnr,seconds\n");
+    for (size_t i = 0; i < corpus.size(); ++i) {
+      fprintf(f, "%s,%.6f,%.6f\n", corpus[i].name, measured[i].psnr,
+              measured[i].seconds);
+    }
+    fclose(f);
+    return EXIT_SUCCESS;
+  }
+  if (failures) {
+    fprintf(stderr, "%d of %zu cases failed\n", failures, corpus.size());
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,89 @@
+/*
+ * bench_reproducible.cpp
+ *
+ * Runs the fixed tile grid schedule with several thread counts, checking that
+ * the results are bitwise identical, and compares its time with the default
+ * one-tile-per-thread schedule. The exit status is non-zero if any result
+ * differs.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "BenchUtils.hpp"
+#include "DA3D.hpp"
+#include "Image.hpp"
+#include "Utils.hpp"
+
+using std::string;
+using std::vector;
+using da3d::Image;
+using da3d::Denoiser;
+using da3d::Parameters;
+using da3d::Schedule;
+using utils::pick_option;
+using utils::Seconds;
+
+int main(int argc, char **argv) {
+  int rows = atoi(pick_option(&argc, argv, "rows", "512"));
+  int columns = atoi(pick_option(&argc, argv, "columns", "512"));
+  int channels = atoi(pick_option(&argc, argv, "channels", "1"));
+  int tile_size = atoi(pick_option(&argc, argv, "tile_size", "256"));
+  string threads_list = pick_option(&argc, argv, "threads", "1,2,7,32");
+  float sigma = static_cast<float>(atof(pick_option(&argc, argv, "sigma",
+                                                    "20")));
+  if (argc > 1) {
+    fprintf(stderr, "usage: %s [-rows R] [-columns C] [-channels N] "
+                    "[-tile_size N] [-threads 1,2,7,32] [-sigma S]\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+  vector<int> threads;
+  std::istringstream list(threads_list);
+  for (string item; std::getline(list, item, ',');) {
+    threads.push_back(atoi(item.c_str()));
+  }
+
+  Image noisy, guide;
+  bench::MakeInput(rows, columns, channels, sigma, 1234, &noisy, &guide);
+
+  printf("image %dx%dx%d, tiles of %d pixels\n", rows, columns, channels,
+         tile_size);
+  printf("%8s %16s %16s %10s\n", "threads", "fixed (ms)", "per thread (ms)",
+         "identical");
+  Image reference;
+  bool all_identical = true;
+  for (int n : threads) {
+    Parameters params;
+    params.channels = channels;
+    params.nthreads = n;
+    Denoiser per_thread(params);
+    params.schedule = Schedule::kFixed;
+    params.tile_size = tile_size;
+    Denoiser fixed(params);
+
+    Image out;
+    double start = Seconds();
+    fixed.Denoise(noisy, guide, sigma, &out);
+    double fixed_time = Seconds() - start;
+    Image other;
+    start = Seconds();
+    per_thread.Denoise(noisy, guide, sigma, &other);
+    double per_thread_time = Seconds() - start;
+
+    bool identical = true;
+    if (reference.samples() == 0) {
+      reference = std::move(out);
+    } else {
+      identical = std::memcmp(reference.data(), out.data(),
+                              sizeof(float) * out.samples()) == 0;
+    }
+    all_identical = all_identical && identical;
+    printf("%8d %16.3f %16.3f %10s\n", n, fixed_time * 1e3,
+           per_thread_time * 1e3, identical ? "yes" : "NO");
+  }
+  return all_identical ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,235 @@
+/*
+ * bench_scaling.cpp
+ *
+ * Strong and weak scaling of a Denoiser on synthetic inputs. Strong scaling
+ * denoises images of fixed sizes with a growing number of threads; weak
+ * scaling grows the image with the threads, at a fixed number of pixels per
+ * thread. Every configuration runs in its own child process, so that its
+ * peak resident memory is measured alone. The report, CSV or JSON, has the
+ * wall time (the best of -repeat calls), the patches per second, the
+ * parallel efficiency against the fewest threads, and the peak RSS.
+ *
+ * -content selects the synthetic input (Synthetic.hpp): best, typical,
+ * worst, or the shares flat,edges,texture.
+ *
+ * The defaults take a few minutes on a laptop; -sizes 25,100 measures
+ * 100-megapixel inputs, which need about 2 GB per channel.
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "BenchUtils.hpp"
+#include "DA3D.hpp"
+#include "Image.hpp"
+#include "Synthetic.hpp"
+#include "Utils.hpp"
+
+using std::string;
+using std::vector;
+using da3d::Denoiser;
+using da3d::Image;
+using da3d::Parameters;
+using da3d::Schedule;
+using utils::pick_option;
+using utils::Seconds;
+
+namespace {
+
+struct Measurement {
+  double seconds;
+  long long patches;
+  double peak_rss_mb;
+};
+
+struct Row {
+  const char *mode;
+  int threads;
+  int rows, columns;
+  Measurement m;
+  double efficiency;
+};
+
+vector<double> ParseList(const char *list) {
+  vector<double> values;
+  std::stringstream stream(list);
+  string item;
+  while (std::getline(stream, item, ',')) values.push_back(atof(item.c_str()));
+  return values;
+}
+
+// Denoises a rows x columns synthetic image in a child process. Returns
+// false if the child failed (e.g. out of memory).
+bool Run(int rows, int columns, int channels, int threads,
+         const da3d::SyntheticContent &content, const Parameters &base,
+         int repeat, Measurement *m) {
+  int fds[2];
+  if (pipe(fds) != 0) return false;
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) return false;
+  if (pid == 0) {
+    close(fds[0]);
+    const float sigma = 20.f;
+    Image noisy, guide, out;
+    bench::MakeInput(rows, columns, channels, sigma, 1234, &noisy, &guide,
+                     content);
+    Parameters params = base;
+    params.channels = channels;
+    params.nthreads = threads;
+    Denoiser denoiser(params);
+    Measurement result = {0., 0, 0.};
+    for (int i = 0; i < repeat; ++i) {
+      double start = Seconds();
+      denoiser.Denoise(noisy, guide, sigma, &out);
+      double seconds = Seconds() - start;
+      if (i == 0 || seconds < result.seconds) result.seconds = seconds;
+      result.patches = denoiser.stats().patches;
+    }
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    result.peak_rss_mb = usage.ru_maxrss / 1024.;  // kilobytes on Linux
+    bool ok = write(fds[1], &result, sizeof(result)) == sizeof(result);
+    _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+  close(fds[1]);
+  bool ok = read(fds[0], m, sizeof(*m)) == sizeof(*m);
+  close(fds[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  return ok && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+// A square-ish image of the given number of megapixels
+void Shape(double megapixels, int *rows, int *columns) {
+  *rows = std::max(1, static_cast<int>(std::sqrt(megapixels * 1e6)));
+  *columns = std::max(1, static_cast<int>(megapixels * 1e6 / *rows));
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const char *mode = pick_option(&argc, argv, "mode", "both");
+  string default_threads = "1";
+  const int hardware = std::max(1u, std::thread::hardware_concurrency());
+  for (int t = 2; t < hardware; t *= 2) {
+    default_threads += "," + std::to_string(t);
+  }
+  if (hardware > 1) default_threads += "," + std::to_string(hardware);
+  vector<double> thread_counts = ParseList(
+      pick_option(&argc, argv, "threads", default_threads.c_str()));
+  vector<double> sizes = ParseList(pick_option(&argc, argv, "sizes",
+                                               ".25,1"));
+  double per_thread = atof(pick_option(&argc, argv, "per_thread", ".25"));
+  int channels = atoi(pick_option(&argc, argv, "channels", "1"));
+  int repeat = atoi(pick_option(&argc, argv, "repeat", "1"));
+  bool fixed = pick_option(&argc, argv, "fixed", nullptr) != nullptr;
+  bool json = pick_option(&argc, argv, "json", nullptr) != nullptr;
+  const char *out_file = pick_option(&argc, argv, "out", "");
+  da3d::SyntheticContent content;
+  bool content_ok = da3d::ParseSyntheticContent(
+      pick_option(&argc, argv, "content", "typical"), &content);
+  const bool strong = strcmp(mode, "strong") == 0 || strcmp(mode, "both") == 0;
+  const bool weak = strcmp(mode, "weak") == 0 || strcmp(mode, "both") == 0;
+  if (argc > 1 || (!strong && !weak) || thread_counts.empty() ||
+      repeat < 1 || channels < 1 || !content_ok) {
+    fprintf(stderr, "usage: %s [-mode strong|weak|both] [-threads T1,T2,...] "
+                    "[-sizes MP1,MP2,...] [-per_thread MP] [-channels N] "
+                    "[-repeat N] [-content best|typical|worst|F,E,T] "
+                    "[-fixed] [-json] [-out FILE]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  Parameters params;
+  if (fixed) params.schedule = Schedule::kFixed;
+  vector<Row> report;
+  auto measure = [&](const char *name, int threads, double megapixels,
+                     double base_seconds, int base_threads) {
+    Row row = {name, threads, 0, 0, {0., 0, 0.}, 0.};
+    Shape(megapixels, &row.rows, &row.columns);
+    if (!Run(row.rows, row.columns, channels, threads, content, params,
+             repeat, &row.m)) {
+      fprintf(stderr, "%s: %dx%d with %d threads failed\n", name, row.rows,
+              row.columns, threads);
+      return false;
+    }
+    // strong: the same work on more threads; weak: proportional work
+    if (base_seconds > 0.) {
+      row.efficiency = strcmp(name, "strong") == 0
+                           ? base_seconds * base_threads /
+                                 (row.m.seconds * threads)
+                           : base_seconds / row.m.seconds;
+    } else {
+      row.efficiency = 1.;
+    }
+    report.push_back(row);
+    fprintf(stderr, "%s %d threads %dx%d: %.3f s\n", name, threads,
+            row.rows, row.columns, row.m.seconds);
+    return true;
+  };
+  if (strong) {
+    for (double megapixels : sizes) {
+      double base = 0.;
+      int base_threads = 0;
+      for (double t : thread_counts) {
+        if (!measure("strong", static_cast<int>(t), megapixels, base,
+                     base_threads)) {
+          continue;
+        }
+        if (base == 0.) {
+          base = report.back().m.seconds;
+          base_threads = static_cast<int>(t);
+        }
+      }
+    }
+  }
+  if (weak) {
+    double base = 0.;
+    for (double t : thread_counts) {
+      if (!measure("weak", static_cast<int>(t), per_thread * t, base, 0)) {
+        continue;
+      }
+      if (base == 0.) base = report.back().m.seconds;
+    }
+  }
+
+  FILE *out = out_file[0] ? fopen(out_file, "w") : stdout;
+  if (!out) {
+    fprintf(stderr, "cannot write %s\n", out_file);
+    return EXIT_FAILURE;
+  }
+  if (json) fprintf(out, "[");
+  else fprintf(out, "mode,threads,rows,columns,channels,megapixels,seconds,"
+                    "patches,patches_per_second,efficiency,peak_rss_mb\n");
+  for (size_t i = 0; i < report.size(); ++i) {
+    const Row &r = report[i];
+    const double megapixels = r.rows * static_cast<double>(r.columns) / 1e6;
+    const double rate = r.m.patches / r.m.seconds;
+    if (json) {
+      fprintf(out, "%s\n  {\"mode\": \"%s\", \"threads\": %d, \"rows\": %d, "
+                   "\"columns\": %d, \"channels\": %d, \"megapixels\": %.4f, "
+                   "\"seconds\": %.6f, \"patches\": %lld, "
+                   "\"patches_per_second\": %.1f, \"efficiency\": %.4f, "
+                   "\"peak_rss_mb\": %.1f}",
+              i ? "," : "", r.mode, r.threads, r.rows, r.columns, channels,
+              megapixels, r.m.seconds, r.m.patches, rate, r.efficiency,
+              r.m.peak_rss_mb);
+    } else {
+      fprintf(out, "%s,%d,%d,%d,%d,%.4f,%.6f,%lld,%.1f,%.4f,%.1f\n", r.mode,
+              r.threads, r.rows, r.columns, channels, megapixels,
+              r.m.seconds, r.m.patches, rate, r.efficiency,
+              r.m.peak_rss_mb);
+    }
+  }
+  if (json) fprintf(out, "\n]\n");
+  if (out != stdout) fclose(out);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,107 @@
+/*
+ * bench_throughput.cpp
+ *
+ * Images per second on a batch of same-size images, comparing one call per
+ * image (every image split in one tile per thread), a single batched call
+ * with one tile per thread shared among the images, and single batched calls
+ * with the tiles (and optionally the threads) chosen by the cost model, and
+ * the engine where all the threads share the weight map of every image.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "BenchUtils.hpp"
+#include "DA3D.hpp"
+#include "Image.hpp"
+#include "Utils.hpp"
+
+using std::vector;
+using da3d::Image;
+using da3d::Denoiser;
+using da3d::Engine;
+using da3d::Frame;
+using da3d::Parameters;
+using da3d::Schedule;
+using utils::pick_option;
+using utils::Seconds;
+
+int main(int argc, char **argv) {
+  int rows = atoi(pick_option(&argc, argv, "rows", "512"));
+  int columns = atoi(pick_option(&argc, argv, "columns", "512"));
+  int channels = atoi(pick_option(&argc, argv, "channels", "1"));
+  int images = atoi(pick_option(&argc, argv, "images", "16"));
+  int nthreads = atoi(pick_option(&argc, argv, "nthreads", "0"));
+  float sigma = static_cast<float>(atof(pick_option(&argc, argv, "sigma",
+                                                    "20")));
+  if (argc > 1 || images < 1) {
+    fprintf(stderr, "usage: %s [-rows R] [-columns C] [-channels N] "
+                    "[-images N] [-nthreads N] [-sigma S]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  vector<Image> noisy(images), guide(images), out(images);
+  for (int i = 0; i < images; ++i) {
+    bench::MakeInput(rows, columns, channels, sigma, 1234 + i, &noisy[i],
+                     &guide[i]);
+    out[i] = Image(rows, columns, channels);
+  }
+  vector<Frame> frames;
+  for (int i = 0; i < images; ++i) {
+    frames.push_back({noisy[i], guide[i], sigma, out[i]});
+  }
+
+  Parameters params;
+  params.channels = channels;
+  params.nthreads = nthreads;
+  Denoiser per_thread(params);
+  params.schedule = Schedule::kThroughput;
+  Denoiser throughput(params);
+  params.schedule = Schedule::kAuto;
+  Denoiser automatic(params);
+  params.schedule = Schedule::kPerThread;
+  params.engine = Engine::kSharedMap;
+  Denoiser shared_map(params);
+
+  // warm up all the contexts, so that only the steady state is measured
+  per_thread.Denoise(frames.data(), images);
+  throughput.Denoise(frames.data(), images);
+  automatic.Denoise(frames.data(), images);
+  shared_map.Denoise(frames.data(), images);
+
+  double start = Seconds();
+  for (int i = 0; i < images; ++i) {
+    per_thread.Denoise(noisy[i], guide[i], sigma, &out[i]);
+  }
+  double per_image = Seconds() - start;
+
+  start = Seconds();
+  per_thread.Denoise(frames.data(), images);
+  double batched = Seconds() - start;
+
+  start = Seconds();
+  throughput.Denoise(frames.data(), images);
+  double cost_model = Seconds() - start;
+
+  start = Seconds();
+  automatic.Denoise(frames.data(), images);
+  double auto_threads = Seconds() - start;
+
+  start = Seconds();
+  shared_map.Denoise(frames.data(), images);
+  double shared = Seconds() - start;
+
+  const da3d::RunStats &tp = throughput.stats();
+  const da3d::RunStats &au = automatic.stats();
+  printf("%d images %dx%dx%d, %d threads\n", images, rows, columns, channels,
+         throughput.nthreads());
+  printf("per-image calls      %10.3f images/s\n", images / per_image);
+  printf("batch, per thread    %10.3f images/s\n", images / batched);
+  printf("batch, cost model    %10.3f images/s (tiling %dx%d)\n",
+         images / cost_model, tp.tilings[0].first, tp.tilings[0].second);
+  printf("batch, auto threads  %10.3f images/s (tiling %dx%d, %d threads)\n",
+         images / auto_threads, au.tilings[0].first, au.tilings[0].second,
+         au.threads);
+  printf("batch, shared map    %10.3f images/s\n", images / shared);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# numa_scaling.sh
+#
+# Scaling of a reused Denoiser with the number of threads under several NUMA
+# placements, with and without thread pinning. On a dual-socket host numactl
+# emulates the cases of interest:
+#   local       threads and memory on node 0
+#   remote      threads on node 0, memory on node 1 (the worst case, which
+#               all the tiles used to be in for the threads of one socket)
+#   interleave  threads anywhere, pages spread over all the nodes
+#   default     threads anywhere, pages placed by first touch
+# The configurations that need a second node are skipped on single-node
+# hosts. Prints CSV: placement,pinned,threads,ms_per_call
+#
+# usage: numa_scaling.sh [path/to/bench_denoiser] [size] [max_threads]
+
+BENCH=${1:-./bench_denoiser}
+SIZE=${2:-1024}
+MAX_THREADS=${3:-$(nproc)}
+
+if ! command -v numactl >/dev/null 2>&1; then
+  echo "numactl not found" >&2
+  exit 1
+fi
+NODES=$(numactl --hardware | sed -n 's/^available: \([0-9]*\) nodes.*/\1/p')
+
+run() {
+  placement=$1; shift
+  for pin in 0 1; do
+    threads=1
+    while [ "$threads" -le "$MAX_THREADS" ]; do
+      flag=""
+      [ "$pin" -eq 1 ] && flag="-pin"
+      ms=$("$@" "$BENCH" -rows "$SIZE" -columns "$SIZE" -calls 3 \
+           -nthreads "$threads" $flag |
+           sed -n 's/^Denoiser reused *\([0-9.]*\).*/\1/p')
+      echo "$placement,$pin,$threads,$ms"
+      threads=$((threads * 2))
+    done
+  done
+}
+
+echo "placement,pinned,threads,ms_per_call"
+run local numactl --cpunodebind=0 --membind=0
+if [ "${NODES:-1}" -gt 1 ]; then
+  run remote numactl --cpunodebind=0 --membind=1
+  run interleave numactl --interleave=all
+fi
+run default env
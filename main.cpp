@@ -5,53 +5,338 @@
  *      Author: nicola
  */
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <fftw3.h>
 #include "Image.hpp"
+#include "ImageView.hpp"
 #include "Utils.hpp"
 #include "DA3D.hpp"
+#include "Executor.hpp"
 #include "mex.h"
 
-using da3d::Image;
-using da3d::DA3D;
+using da3d::ConstImageView;
+using da3d::Denoiser;
+using da3d::ImageView;
+using da3d::Parameters;
+using utils::Seconds;
 
+namespace {
 
-Image read_image(const mxArray* im)
+// Process-wide state kept between calls. While a context exists the MEX file
+// is locked, so that MATLAB does not unload it together with the FFT plans,
+// the look-up tables and the per-thread scratch buffers. FFTW keeps the
+// wisdom gathered while planning, so that a context with new parameters is
+// also planned quickly.
+std::unique_ptr<Denoiser> context;
+// Threads used instead of OpenMP when the parameters have executor 'pool',
+// created by the first such call with nthreads threads (0 means one per
+// processor) and kept until the context is cleared
+std::shared_ptr<da3d::Executor> pool;
+
+void ClearContext() {
+   context.reset();
+   pool.reset();
+   fftwf_forget_wisdom();
+   if (mexIsLocked()) mexUnlock();
+}
+
+std::vector<float> read_vector(const mxArray* v)
+{
+   std::vector<float> result(mxGetNumberOfElements(v));
+   if (mxIsSingle(v)) {
+      const float *data = (const float*)mxGetData(v);
+      std::copy_n(data, result.size(), result.begin());
+   } else {
+      if (!mxIsDouble(v))
+         mexErrMsgIdAndTxt("da3d:parameters",
+                           "Look-up tables must be single or double");
+      const double *data = mxGetPr(v);
+      std::copy_n(data, result.size(), result.begin());
+   }
+   return result;
+}
+
+// The value of the parameter name, which must be a real scalar
+double read_scalar(const mxArray* f, const char *name)
+{
+   if (!mxIsNumeric(f) && !mxIsLogical(f))
+      mexErrMsgIdAndTxt("da3d:parameters", "Parameter %s must be numeric",
+                        name);
+   if (mxGetNumberOfElements(f) != 1)
+      mexErrMsgIdAndTxt("da3d:parameters", "Parameter %s must be a scalar",
+                        name);
+   return mxGetScalar(f);
+}
+
+// The value of the parameter name, which must be an integer
+int read_int(const mxArray* f, const char *name)
+{
+   double value = read_scalar(f, name);
+   if (!(std::fabs(value) <= 1 << 30) || value != std::floor(value))
+      mexErrMsgIdAndTxt("da3d:parameters", "Parameter %s must be an integer",
+                        name);
+   return (int)value;
+}
+
+// The value of the parameter name, which must be a string
+std::string read_string(const mxArray* f, const char *name)
+{
+   char *chars = mxArrayToString(f);
+   if (!chars)
+      mexErrMsgIdAndTxt("da3d:parameters", "Parameter %s must be a string",
+                        name);
+   std::string result(chars);
+   mxFree(chars);
+   return result;
+}
+
+// Optional fields: r, sigma_s, gamma_r, threshold, nthreads, K_high, K_low,
+// schedule ('per_thread', 'throughput', 'auto' or 'fixed'), tile_size,
+// engine ('tiles' or 'shared_map'), pipelined, pin_threads. The executor
+// ('openmp' or 'pool') is read by read_executor, heatmap_cell by
+// read_heatmap_cell.
+Parameters read_parameters(const mxArray* s)
+{
+   Parameters params;
+   if (!s) return params;
+   if (!mxIsStruct(s))
+      mexErrMsgIdAndTxt("da3d:parameters", "Parameters must be a struct");
+   const mxArray *f;
+   if ((f = mxGetField(s, 0, "r"))) params.r = read_int(f, "r");
+   if ((f = mxGetField(s, 0, "sigma_s"))) params.sigma_s = read_scalar(f, "sigma_s");
+   if ((f = mxGetField(s, 0, "gamma_r"))) params.gamma_r = read_scalar(f, "gamma_r");
+   if ((f = mxGetField(s, 0, "threshold"))) params.threshold = read_scalar(f, "threshold");
+   if ((f = mxGetField(s, 0, "nthreads"))) params.nthreads = read_int(f, "nthreads");
+   if ((f = mxGetField(s, 0, "K_high"))) params.K_high = read_vector(f);
+   if ((f = mxGetField(s, 0, "K_low"))) params.K_low = read_vector(f);
+   if ((f = mxGetField(s, 0, "tile_size"))) params.tile_size = read_int(f, "tile_size");
+   if ((f = mxGetField(s, 0, "pipelined"))) params.pipelined = read_scalar(f, "pipelined") != 0;
+   if ((f = mxGetField(s, 0, "pin_threads"))) params.pin_threads = read_scalar(f, "pin_threads") != 0;
+   if ((f = mxGetField(s, 0, "schedule"))) {
+      std::string name = read_string(f, "schedule");
+      if (name == "throughput")
+         params.schedule = da3d::Schedule::kThroughput;
+      else if (name == "auto")
+         params.schedule = da3d::Schedule::kAuto;
+      else if (name == "fixed")
+         params.schedule = da3d::Schedule::kFixed;
+      else if (name != "per_thread")
+         mexErrMsgIdAndTxt("da3d:parameters", "Unknown schedule '%s'",
+                           name.c_str());
+   }
+   if ((f = mxGetField(s, 0, "engine"))) {
+      std::string name = read_string(f, "engine");
+      if (name == "shared_map")
+         params.engine = da3d::Engine::kSharedMap;
+      else if (name != "tiles")
+         mexErrMsgIdAndTxt("da3d:parameters", "Unknown engine '%s'",
+                           name.c_str());
+   }
+   std::string error = da3d::CheckParameters(params);
+   if (!error.empty())
+      mexErrMsgIdAndTxt("da3d:parameters", "Invalid parameters: %s",
+                        error.c_str());
+   return params;
+}
+
+std::shared_ptr<da3d::Executor> read_executor(const mxArray* s, int nthreads)
+{
+   const mxArray *f = s ? mxGetField(s, 0, "executor") : nullptr;
+   if (!f) return da3d::DefaultExecutor();
+   std::string name = read_string(f, "executor");
+   bool use_pool = (name == "pool");
+   if (!use_pool && name != "openmp")
+      mexErrMsgIdAndTxt("da3d:parameters", "Unknown executor '%s'",
+                        name.c_str());
+   if (!use_pool) return da3d::DefaultExecutor();
+   if (!pool) pool = std::make_shared<da3d::ThreadPool>(nthreads);
+   return pool;
+}
+
+mxArray* save_stats(bool reused, double setup, double denoise, double total,
+                    const da3d::RunStats &run)
+{
+   const char *fields[] = {"reused", "setup_time", "denoise_time",
+                           "total_time", "threads", "tiles", "padding_ratio",
+                           "estimated_efficiency", "patches", "profile"};
+   mxArray *stats = mxCreateStructMatrix(1, 1, 10, fields);
+   mxSetField(stats, 0, "reused", mxCreateLogicalScalar(reused));
+   mxSetField(stats, 0, "setup_time", mxCreateDoubleScalar(setup));
+   mxSetField(stats, 0, "denoise_time", mxCreateDoubleScalar(denoise));
+   mxSetField(stats, 0, "total_time", mxCreateDoubleScalar(total));
+   mxSetField(stats, 0, "threads", mxCreateDoubleScalar(run.threads));
+   mxSetField(stats, 0, "tiles", mxCreateDoubleScalar(run.tiles));
+   mxSetField(stats, 0, "padding_ratio",
+              mxCreateDoubleScalar(run.padding_ratio));
+   mxSetField(stats, 0, "estimated_efficiency",
+              mxCreateDoubleScalar(run.estimated_efficiency));
+   mxSetField(stats, 0, "patches", mxCreateDoubleScalar(run.patches));
+   mxSetField(stats, 0, "profile",
+              mxCreateString(da3d::RunStatsJson(run).c_str()));
+   return stats;
+}
+
+int read_heatmap_cell(const mxArray* s)
 {
-   int w, h, c;
-   mxAssert(mxIsSingle(im), "Input image must be of type single");
+   const mxArray *f = s ? mxGetField(s, 0, "heatmap_cell") : nullptr;
+   return f ? std::max(1, read_int(f, "heatmap_cell")) : 1;
+}
+
+// rows x columns x frames array of the heatmaps of every frame
+mxArray* save_pages(const std::vector<da3d::Image> &pages)
+{
+   mwSize dims[3] = {(mwSize)pages[0].rows(), (mwSize)pages[0].columns(),
+                     (mwSize)pages.size()};
+   mxArray *array = mxCreateNumericArray(3, dims, mxSINGLE_CLASS, mxREAL);
+   float *data = (float*)mxGetData(array);
+   for (const da3d::Image &page : pages) {
+      for (int col = 0; col < page.columns(); ++col)
+         for (int row = 0; row < page.rows(); ++row)
+            *data++ = page.val(col, row);
+   }
+   return array;
+}
+
+mxArray* save_heatmaps(const da3d::Heatmaps &heatmaps)
+{
+   const char *fields[] = {"cell", "patches", "seconds"};
+   mxArray *maps = mxCreateStructMatrix(1, 1, 3, fields);
+   mxSetField(maps, 0, "cell", mxCreateDoubleScalar(heatmaps.cell));
+   mxSetField(maps, 0, "patches", save_pages(heatmaps.patches));
+   mxSetField(maps, 0, "seconds", save_pages(heatmaps.seconds));
+   return maps;
+}
+
+}  // namespace
+
+// Wraps the rows x columns x channels x frames MATLAB array without copying
+// it, as one view per frame. name is the argument in the error messages.
+std::vector<ConstImageView> read_images(const mxArray* im, const char *name)
+{
+   if (!mxIsSingle(im))
+      mexErrMsgIdAndTxt("da3d:input", "%s must be of class single", name);
    int ndim = mxGetNumberOfDimensions(im);
+   if (ndim > 4)
+      mexErrMsgIdAndTxt("da3d:input", "%s must have at most four dimensions",
+                        name);
+   if (mxIsEmpty(im))
+      mexErrMsgIdAndTxt("da3d:input", "%s must not be empty", name);
    const mwSize* dims = mxGetDimensions(im);
-   w = dims[0];
-   h = dims[1];
-   c = (ndim > 2) ? dims[2] : 1;
+   int h = dims[0];
+   int w = dims[1];
+   int c = (ndim > 2) ? dims[2] : 1;
+   int n = (ndim > 3) ? dims[3] : 1;
 
-   float *data = (float*)mxGetData(im);
-   return Image(data, h, w, c);
+   const float *data = (const float*)mxGetData(im);
+   std::vector<ConstImageView> frames;
+   for (int i = 0; i < n; ++i)
+      frames.push_back(ConstImageView::ColumnMajor(data + (size_t)i*h*w*c,
+                                                   h, w, c));
+   return frames;
 }
 
-mxArray* save_image(const Image& im)
+// Allocates a MATLAB array with the shape of im, which the result is written
+// into directly through the views
+mxArray* create_images(const mxArray* im, std::vector<ImageView> *frames)
 {
-   mwSize dims[3] = { im.columns(), im.rows(), im.channels() };
-   mxArray* image = mxCreateNumericArray(3, dims, mxSINGLE_CLASS, mxREAL);
-   std::copy_n(im.data(), dims[0]*dims[1]*dims[2], (float*)mxGetData(image));
+   mwSize ndim = mxGetNumberOfDimensions(im);
+   const mwSize* dims = mxGetDimensions(im);
+   mxArray* image = mxCreateUninitNumericArray(ndim, (size_t*)dims,
+                                               mxSINGLE_CLASS, mxREAL);
+   int h = dims[0];
+   int w = dims[1];
+   int c = (ndim > 2) ? dims[2] : 1;
+   int n = (ndim > 3) ? dims[3] : 1;
+   float *data = (float*)mxGetData(image);
+   frames->clear();
+   for (int i = 0; i < n; ++i)
+      frames->push_back(ImageView::ColumnMajor(data + (size_t)i*h*w*c,
+                                               h, w, c));
    return image;
 }
 
+// out = da3d(input, guide, sigma[, params])
+// input and guide are rows x columns x channels x frames arrays: all the
+// frames are denoised together
+// [out, stats] = da3d(...) also returns the time spent in each phase, and
+// in stats.profile the counters of every tile as JSON (filled only when built
+// with DA3D_INSTRUMENT)
+// [out, stats, heatmaps] = da3d(...) also returns heatmaps.patches, the
+// number of patches centered in every cell of params.heatmap_cell pixels
+// (default 1), and heatmaps.seconds, the time spent on them, with a page per
+// frame
+// da3d('clear') releases the cached context and unlocks the MEX file
 void mexFunction(int nlhs, mxArray *plhs[],
    int nrhs, const mxArray *prhs[])
 {
+   if (nrhs == 1 && mxIsChar(prhs[0])) {
+      char *command = mxArrayToString(prhs[0]);
+      bool clear = (std::strcmp(command, "clear") == 0);
+      mxFree(command);
+      if (!clear)
+         mexErrMsgIdAndTxt("da3d:command", "Unknown command");
+      ClearContext();
+      return;
+   }
+
 #ifndef _OPENMP
-   cerr << "Warning: OpenMP not available. The algorithm will run in a single" <<
-      " thread." << endl;
+   mexWarnMsgIdAndTxt("da3d:openmp", "OpenMP not available. The algorithm "
+                      "will run in a single thread.");
 #endif
 
-   mxAssert(nrhs >= 3, "Needs three input arguments, input, guide and sigma");
-   Image input = read_image(prhs[0]);
-   Image guide = read_image(prhs[1]);
+   if (nrhs < 3)
+      mexErrMsgIdAndTxt("da3d:input", "Needs three input arguments, input, "
+                        "guide and sigma");
+   double start = Seconds();
+   std::vector<ConstImageView> input = read_images(prhs[0], "Input");
+   std::vector<ConstImageView> guide = read_images(prhs[1], "Guide");
+   if (input.size() != guide.size())
+      mexErrMsgIdAndTxt("da3d:input", "Input and guide must have the same "
+                        "number of frames");
+   if (input[0].shape() != guide[0].shape() ||
+       input[0].channels() != guide[0].channels())
+      mexErrMsgIdAndTxt("da3d:input", "Input and guide must have the same "
+                        "size");
+   if (!mxIsNumeric(prhs[2]) || mxGetNumberOfElements(prhs[2]) != 1)
+      mexErrMsgIdAndTxt("da3d:input", "Sigma must be a numeric scalar");
    float sigma = mxGetScalar(prhs[2]);
 
-   std::vector<float> K_high, K_low;
-   Image output = DA3D(input, guide, sigma, K_high, K_low, false);
+   // the context is rebuilt only when the parameters change
+   Parameters params = read_parameters(nrhs > 3 ? prhs[3] : nullptr);
+   params.channels = guide[0].channels();
+   std::shared_ptr<da3d::Executor> executor =
+      read_executor(nrhs > 3 ? prhs[3] : nullptr, params.nthreads);
+   bool reused = context && context->parameters() == params &&
+                 context->executor() == executor;
+   double setup = Seconds();
+   if (!reused) {
+      context.reset(new Denoiser(params, executor));
+      if (!mexIsLocked()) {
+         mexLock();
+         mexAtExit(ClearContext);
+      }
+   }
+   setup = Seconds() - setup;
 
-   if (nlhs > 0)
-      plhs[0] = save_image(output);
-}
\ No newline at end of file
+   std::vector<ImageView> output;
+   mxArray *result = create_images(prhs[1], &output);
+   std::vector<da3d::Frame> frames;
+   for (size_t i = 0; i < guide.size(); ++i)
+      frames.push_back({input[i], guide[i], sigma, output[i]});
+   context->set_heatmaps(
+      nlhs > 2 ? read_heatmap_cell(nrhs > 3 ? prhs[3] : nullptr) : 0);
+   double denoise = Seconds();
+   context->Denoise(frames.data(), frames.size());
+   denoise = Seconds() - denoise;
+
+   plhs[0] = result;
+   if (nlhs > 1)
+      plhs[1] = save_stats(reused, setup, denoise, Seconds() - start,
+                            context->stats());
+   if (nlhs > 2)
+      plhs[2] = save_heatmaps(context->heatmaps());
+}
@@ -0,0 +1,155 @@
+/*
+ * Protocol.hpp
+ *
+ * Messages exchanged by da3d_server and its clients over a Unix domain
+ * socket. A connection carries one request and its response. The images are
+ * either named by paths, which the server reads and writes itself, or sent
+ * with the request, in which case the result comes back with the response.
+ */
+
+#ifndef DA3D_SERVER_PROTOCOL_HPP_
+#define DA3D_SERVER_PROTOCOL_HPP_
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "DA3D.hpp"
+
+namespace server {
+
+const uint32_t kMagic = 0xda3d5e01;
+const char kDefaultSocket[] = "/tmp/da3d.sock";
+const int32_t kCancelled = 2;
+// Limits of the requests the server accepts
+const int32_t kMaxRadius = 255;
+const int32_t kMaxThreads = 1024;
+
+enum Command : int32_t {
+  kDenoise = 0,
+  kStats = 1,  // the response message is the statistics, in JSON
+  kShutdown = 2,  // stops accepting jobs, finishes the queued ones and exits
+};
+
+struct WireParameters {
+  int32_t r;
+  float sigma_s, gamma_r, threshold;
+  int32_t nthreads, schedule, tile_size, engine, pipelined;
+  int32_t k_high_size, k_low_size;  // floats following the request
+};
+
+// Followed by K_high and K_low, then either the noisy and guide images
+// (rows > 0) or the three paths.
+struct Request {
+  uint32_t magic;
+  int32_t command;
+  int32_t priority;  // higher first, FIFO among equal priorities
+  // seconds from the submission after which the job is cancelled, 0 for
+  // none. A job is also cancelled when its client disconnects.
+  float deadline;
+  float sigma;
+  WireParameters params;
+  int32_t rows, columns, channels;
+  int32_t noisy_path, guide_path, out_path;  // lengths
+};
+
+// Followed by message_size characters (the error or the statistics), then
+// the result if the images were sent with the request.
+struct Response {
+  int32_t status;  // 0 on success, kCancelled, or 1 on other errors
+  int32_t rows, columns, channels;
+  double queued;  // seconds spent in the queue
+  double run;  // seconds spent denoising
+  int32_t message_size;
+};
+
+inline WireParameters ToWire(const da3d::Parameters &params) {
+  WireParameters w;
+  w.r = params.r;
+  w.sigma_s = params.sigma_s;
+  w.gamma_r = params.gamma_r;
+  w.threshold = params.threshold;
+  w.nthreads = params.nthreads;
+  w.schedule = static_cast<int32_t>(params.schedule);
+  w.tile_size = params.tile_size;
+  w.engine = static_cast<int32_t>(params.engine);
+  w.pipelined = params.pipelined;
+  w.k_high_size = static_cast<int32_t>(params.K_high.size());
+  w.k_low_size = static_cast<int32_t>(params.K_low.size());
+  return w;
+}
+
+// Returns why w exceeds the limits of the server, or an empty string. The
+// parameters themselves are checked by da3d::CheckParameters.
+inline std::string CheckLimits(const WireParameters &w) {
+  if (w.r > kMaxRadius) return "r must be at most 255";
+  if (w.schedule == static_cast<int32_t>(da3d::Schedule::kFixed) &&
+      w.tile_size > 1 << 16) {
+    return "tile_size must be at most 65536";
+  }
+  if (w.nthreads > kMaxThreads) return "nthreads must be at most 1024";
+  return "";
+}
+
+// The look-up tables and the channels are filled by the caller
+inline da3d::Parameters FromWire(const WireParameters &w) {
+  da3d::Parameters params;
+  params.r = w.r;
+  params.sigma_s = w.sigma_s;
+  params.gamma_r = w.gamma_r;
+  params.threshold = w.threshold;
+  params.nthreads = w.nthreads;
+  params.schedule = static_cast<da3d::Schedule>(w.schedule);
+  params.tile_size = w.tile_size;
+  params.engine = static_cast<da3d::Engine>(w.engine);
+  params.pipelined = w.pipelined != 0;
+  return params;
+}
+
+inline bool ReadAll(int fd, void *data, size_t bytes) {
+  char *p = static_cast<char *>(data);
+  while (bytes > 0) {
+    ssize_t n = read(fd, p, bytes);
+    if (n <= 0) return false;
+    p += n;
+    bytes -= n;
+  }
+  return true;
+}
+
+inline bool WriteAll(int fd, const void *data, size_t bytes) {
+  const char *p = static_cast<const char *>(data);
+  while (bytes > 0) {
+    ssize_t n = write(fd, p, bytes);
+    if (n <= 0) return false;
+    p += n;
+    bytes -= n;
+  }
+  return true;
+}
+
+inline bool ReadString(int fd, int size, std::string *s) {
+  if (size < 0 || size > 4096) return false;
+  s->resize(size);
+  return ReadAll(fd, &(*s)[0], size);
+}
+
+inline bool WriteString(int fd, const std::string &s) {
+  return WriteAll(fd, s.data(), s.size());
+}
+
+inline bool SocketAddress(const char *path, sockaddr_un *address) {
+  std::memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (std::strlen(path) >= sizeof(address->sun_path)) return false;
+  std::strcpy(address->sun_path, path);
+  return true;
+}
+
+}  // namespace server
+
+#endif  // DA3D_SERVER_PROTOCOL_HPP_
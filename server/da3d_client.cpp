@@ -0,0 +1,166 @@
+/*
+ * da3d_client.cpp
+ *
+ * Submits a job to da3d_server, or asks it for its statistics or to stop.
+ * By default the server reads and writes the images itself; with -send the
+ * client reads them and they travel through the socket.
+ */
+
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "DA3D.hpp"
+#include "Image.hpp"
+#include "Protocol.hpp"
+#include "Utils.hpp"
+
+extern "C" {
+#include "iio.h"
+}
+
+using std::string;
+using da3d::Image;
+using da3d::Parameters;
+using utils::pick_option;
+using utils::Seconds;
+
+namespace {
+
+int Connect(const char *path) {
+  sockaddr_un address;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || !server::SocketAddress(path, &address) ||
+      connect(fd, reinterpret_cast<sockaddr *>(&address),
+              sizeof(address)) != 0) {
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// the server does not share the working directory of the client
+string AbsolutePath(const char *path) {
+  if (path[0] == '/') return path;
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd))) return path;
+  return string(cwd) + "/" + path;
+}
+
+bool ReadImage(const char *path, Image *image) {
+  int w, h, c;
+  float *data = iio_read_image_float_vec(path, &w, &h, &c);
+  if (!data) return false;
+  *image = Image(data, h, w, c);
+  free(data);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const char *path = pick_option(&argc, argv, "socket",
+                                 server::kDefaultSocket);
+  bool stats = pick_option(&argc, argv, "stats", nullptr) != nullptr;
+  bool stop = pick_option(&argc, argv, "shutdown", nullptr) != nullptr;
+  bool send = pick_option(&argc, argv, "send", nullptr) != nullptr;
+  bool quiet = pick_option(&argc, argv, "quiet", nullptr) != nullptr;
+  int priority = atoi(pick_option(&argc, argv, "priority", "0"));
+  float deadline = atof(pick_option(&argc, argv, "deadline", "0"));
+  Parameters params;
+  params.r = atoi(pick_option(&argc, argv, "r", "31"));
+  params.sigma_s = atof(pick_option(&argc, argv, "sigma_s", "14"));
+  params.gamma_r = atof(pick_option(&argc, argv, "gamma_r", ".7"));
+  params.threshold = atof(pick_option(&argc, argv, "threshold", "2"));
+  params.nthreads = atoi(pick_option(&argc, argv, "nthreads", "0"));
+  params.tile_size = atoi(pick_option(&argc, argv, "tile_size", "256"));
+  if (pick_option(&argc, argv, "fixed", nullptr)) {
+    params.schedule = da3d::Schedule::kFixed;
+  }
+  bool command = stats || stop;
+  if ((command && argc != 1) || (!command && argc != 5)) {
+    fprintf(stderr, "usage: %s [-socket PATH] [-priority P] [-deadline S] "
+                    "[-send] [-quiet] [-r R] [-sigma_s S] [-gamma_r G] "
+                    "[-threshold T] [-nthreads N] [-fixed] [-tile_size T] "
+                    "noisy guide sigma out\n"
+                    "       %s [-socket PATH] -stats | -shutdown\n",
+            argv[0], argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  server::Request request = server::Request();
+  request.magic = server::kMagic;
+  request.command = stats ? server::kStats
+                          : (stop ? server::kShutdown : server::kDenoise);
+  request.priority = priority;
+  request.deadline = deadline;
+  request.params = server::ToWire(params);
+  Image noisy, guide;
+  string paths[3];
+  if (!command) {
+    request.sigma = static_cast<float>(atof(argv[3]));
+    if (send) {
+      if (!ReadImage(argv[1], &noisy) || !ReadImage(argv[2], &guide)) {
+        fprintf(stderr, "cannot read the images\n");
+        return EXIT_FAILURE;
+      }
+      request.rows = noisy.rows();
+      request.columns = noisy.columns();
+      request.channels = noisy.channels();
+    } else {
+      paths[0] = AbsolutePath(argv[1]);
+      paths[1] = AbsolutePath(argv[2]);
+      paths[2] = AbsolutePath(argv[4]);
+      request.noisy_path = static_cast<int32_t>(paths[0].size());
+      request.guide_path = static_cast<int32_t>(paths[1].size());
+      request.out_path = static_cast<int32_t>(paths[2].size());
+    }
+  }
+
+  double start = Seconds();
+  int fd = Connect(path);
+  if (fd < 0) {
+    fprintf(stderr, "cannot connect to %s\n", path);
+    return EXIT_FAILURE;
+  }
+  bool ok = server::WriteAll(fd, &request, sizeof(request));
+  if (ok && send) {
+    ok = server::WriteAll(fd, noisy.data(),
+                          sizeof(float) * noisy.samples()) &&
+         server::WriteAll(fd, guide.data(), sizeof(float) * guide.samples());
+  } else if (ok && !command) {
+    for (const string &p : paths) ok = ok && server::WriteString(fd, p);
+  }
+  server::Response response;
+  string message;
+  ok = ok && server::ReadAll(fd, &response, sizeof(response)) &&
+       server::ReadString(fd, response.message_size, &message);
+  Image out;
+  if (ok && send && response.status == 0) {
+    out.Resize(response.rows, response.columns, response.channels);
+    ok = server::ReadAll(fd, out.data(), sizeof(float) * out.samples());
+  }
+  close(fd);
+  if (!ok) {
+    fprintf(stderr, "connection to %s lost\n", path);
+    return EXIT_FAILURE;
+  }
+  if (response.status != 0) {
+    fprintf(stderr, "job failed: %s\n", message.c_str());
+    return EXIT_FAILURE;
+  }
+  if (stats) printf("%s\n", message.c_str());
+  if (send) {
+    iio_save_image_float_vec(argv[4], out.data(), out.columns(), out.rows(),
+                             out.channels());
+  }
+  if (!command && !quiet) {
+    printf("queued %.3f s, run %.3f s, total %.3f s\n", response.queued,
+           response.run, Seconds() - start);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,533 @@
+/*
+ * da3d_server.cpp
+ *
+ * Long-running denoising daemon. Jobs arrive on a Unix domain socket and are
+ * run by a few worker threads in order of priority. The Denoisers are kept
+ * warm between jobs, one set per parameter set, so that the FFT plans, the
+ * look-up tables and the scratch buffers are made once; all of them share a
+ * single thread pool, which caps the number of threads of the process.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <csignal>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "Cache.hpp"
+#include "DA3D.hpp"
+#include "Executor.hpp"
+#include "Image.hpp"
+#include "Protocol.hpp"
+#include "Utils.hpp"
+
+extern "C" {
+#include "iio.h"
+}
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using da3d::Denoiser;
+using da3d::Image;
+using da3d::Parameters;
+using utils::pick_option;
+using utils::Seconds;
+
+namespace {
+
+struct Job {
+  server::Request request;
+  Parameters params;
+  Image noisy, guide, out;
+  string noisy_path, guide_path, out_path;
+  std::shared_ptr<da3d::CancellationToken> token =
+      std::make_shared<da3d::CancellationToken>();
+  int64_t sequence = 0;
+  double submitted = 0.;
+  // filled by the worker
+  server::Response response{};
+  string message;
+  bool rejected = false;  // invalid request, answered without running
+  bool done = false;
+  std::mutex mutex;
+  std::condition_variable finished;
+};
+
+struct JobOrder {
+  bool operator()(const Job *a, const Job *b) const {
+    if (a->request.priority != b->request.priority) {
+      return a->request.priority < b->request.priority;
+    }
+    return a->sequence > b->sequence;
+  }
+};
+
+// Mean and percentiles of the last samples
+class Latencies {
+ public:
+  void Add(double seconds) {
+    if (samples_.size() == kWindow) samples_.pop_front();
+    samples_.push_back(seconds);
+  }
+
+  string Json() const {
+    vector<double> sorted(samples_.begin(), samples_.end());
+    std::sort(sorted.begin(), sorted.end());
+    double mean = 0.;
+    for (double s : sorted) mean += s;
+    if (!sorted.empty()) mean /= sorted.size();
+    std::ostringstream json;
+    json << "{\"mean\": " << mean << ", \"p50\": " << Percentile(sorted, .5)
+         << ", \"p95\": " << Percentile(sorted, .95)
+         << ", \"p99\": " << Percentile(sorted, .99)
+         << ", \"max\": " << (sorted.empty() ? 0. : sorted.back()) << "}";
+    return json.str();
+  }
+
+ private:
+  static const size_t kWindow = 1000;
+
+  static double Percentile(const vector<double> &sorted, double p) {
+    if (sorted.empty()) return 0.;
+    size_t i = static_cast<size_t>(p * (sorted.size() - 1) + .5);
+    return sorted[i];
+  }
+
+  std::deque<double> samples_;
+};
+
+// Idle Denoisers by parameter set, at most capacity of them in total. The
+// least recently used are destroyed first.
+class ContextCache {
+ public:
+  ContextCache(std::shared_ptr<da3d::Executor> executor, int capacity)
+      : executor_(executor), capacity_(capacity) {}
+
+  unique_ptr<Denoiser> Acquire(const Parameters &params, bool *warm) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto it = idle_.begin(); it != idle_.end(); ++it) {
+        if ((*it)->parameters() == params) {
+          unique_ptr<Denoiser> denoiser = std::move(*it);
+          idle_.erase(it);
+          *warm = true;
+          return denoiser;
+        }
+      }
+    }
+    *warm = false;
+    return unique_ptr<Denoiser>(new Denoiser(params, executor_));
+  }
+
+  void Release(unique_ptr<Denoiser> denoiser) {
+    unique_ptr<Denoiser> evicted;
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_.push_front(std::move(denoiser));
+    if (static_cast<int>(idle_.size()) > capacity_) {
+      evicted = std::move(idle_.back());
+      idle_.pop_back();
+    }
+  }
+
+  int size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return static_cast<int>(idle_.size());
+  }
+
+ private:
+  std::shared_ptr<da3d::Executor> executor_;
+  const int capacity_;
+  std::mutex mutex_;
+  std::deque<unique_ptr<Denoiser>> idle_;  // most recently used first
+};
+
+class Server {
+ public:
+  // listener is shut down when a client asks to stop; cache may be null
+  Server(int listener, int workers, int contexts, int pool_threads,
+         unique_ptr<da3d::ResultCache> cache)
+      : listener_(listener),
+        pool_(std::make_shared<da3d::ThreadPool>(pool_threads)),
+        contexts_(pool_, contexts), cache_(std::move(cache)),
+        start_(Seconds()) {
+    for (int i = 0; i < workers; ++i) {
+      workers_.emplace_back([this] { Work(); });
+    }
+  }
+
+  // Reads the request on fd, waits for its job and answers
+  void Handle(int fd) {
+    Job job;
+    bool ok = ReadRequest(fd, &job);
+    if (!ok) {
+      close(fd);
+      return;
+    }
+    switch (job.request.command) {
+      case server::kStats:
+        job.message = Stats();
+        break;
+      case server::kShutdown:
+        Stop();
+        break;
+      default: {
+        if (job.rejected) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          ++rejected_;
+          break;
+        }
+        if (!Submit(&job)) {
+          job.response.status = 1;
+          job.message = "shutting down";
+          break;
+        }
+        // the job is cancelled when its client goes away or its deadline
+        // passes, so that it does not keep the threads busy
+        std::unique_lock<std::mutex> lock(job.mutex);
+        while (!job.finished.wait_for(lock, std::chrono::milliseconds(50),
+                                      [&job] { return job.done; })) {
+          pollfd hangup = {fd, POLLIN | POLLRDHUP, 0};
+          if (poll(&hangup, 1, 0) > 0 ||
+              (job.request.deadline > 0 &&
+               Seconds() - job.submitted > job.request.deadline)) {
+            job.token->Cancel();
+          }
+        }
+      }
+    }
+    job.response.message_size = static_cast<int32_t>(job.message.size());
+    bool images = job.request.rows > 0 && job.response.status == 0 &&
+                  job.request.command == server::kDenoise;
+    if (!images) {
+      job.response.rows = job.response.columns = job.response.channels = 0;
+    }
+    ok = server::WriteAll(fd, &job.response, sizeof(job.response)) &&
+         server::WriteString(fd, job.message);
+    if (ok && images) {
+      server::WriteAll(fd, job.out.data(), sizeof(float) * job.out.samples());
+    }
+    close(fd);
+  }
+
+  bool stopping() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stopping_;
+  }
+
+  // Lets the workers finish the queued jobs
+  void Join() {
+    for (std::thread &worker : workers_) worker.join();
+  }
+
+ private:
+  // Returns false if the request cannot be read. A request that is read but
+  // invalid is marked as rejected, with the reason in its message, after
+  // all its data is consumed, so that the client reads the response.
+  bool ReadRequest(int fd, Job *job) {
+    server::Request &request = job->request;
+    if (!server::ReadAll(fd, &request, sizeof(request)) ||
+        request.magic != server::kMagic) {
+      return false;
+    }
+    if (request.command == server::kStats ||
+        request.command == server::kShutdown) {
+      return true;
+    }
+    if (request.command != server::kDenoise) return false;
+    const server::WireParameters &w = request.params;
+    if (w.k_high_size < 0 || w.k_low_size < 0 || w.k_high_size > 1 << 20 ||
+        w.k_low_size > 1 << 20) {
+      return false;
+    }
+    vector<float> K_high(w.k_high_size), K_low(w.k_low_size);
+    if (!server::ReadAll(fd, K_high.data(), sizeof(float) * w.k_high_size) ||
+        !server::ReadAll(fd, K_low.data(), sizeof(float) * w.k_low_size)) {
+      return false;
+    }
+    if (request.rows > 0) {
+      if (request.columns <= 0 || request.channels <= 0 ||
+          static_cast<int64_t>(request.rows) * request.columns *
+              request.channels > (int64_t(1) << 30)) {
+        return false;
+      }
+      job->noisy.Resize(request.rows, request.columns, request.channels);
+      job->guide.Resize(request.rows, request.columns, request.channels);
+      if (!server::ReadAll(fd, job->noisy.data(),
+                           sizeof(float) * job->noisy.samples()) ||
+          !server::ReadAll(fd, job->guide.data(),
+                           sizeof(float) * job->guide.samples())) {
+        return false;
+      }
+    } else if (!server::ReadString(fd, request.noisy_path,
+                                   &job->noisy_path) ||
+               !server::ReadString(fd, request.guide_path,
+                                   &job->guide_path) ||
+               !server::ReadString(fd, request.out_path, &job->out_path)) {
+      return false;
+    }
+
+    // the channels are those of the images, set by Run
+    job->params = server::FromWire(w);
+    job->params.K_high = std::move(K_high);
+    job->params.K_low = std::move(K_low);
+    string error = server::CheckLimits(w);
+    if (error.empty()) error = da3d::CheckParameters(job->params);
+    if (error.empty() && (!(request.sigma > 0.f) ||
+                          !std::isfinite(request.sigma))) {
+      error = "sigma must be positive";
+    }
+    if (error.empty() && (!(request.deadline >= 0.f) ||
+                          !std::isfinite(request.deadline))) {
+      error = "deadline must be positive or 0";
+    }
+    if (!error.empty()) {
+      job->rejected = true;
+      job->response.status = 1;
+      job->message = "invalid request: " + error;
+    }
+    return true;
+  }
+
+  bool Submit(Job *job) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_) return false;
+    job->sequence = sequence_++;
+    job->submitted = Seconds();
+    queue_.push(job);
+    ++received_;
+    max_queued_ = std::max(max_queued_, static_cast<int>(queue_.size()));
+    ready_.notify_one();
+    return true;
+  }
+
+  void Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    ready_.notify_all();
+    shutdown(listener_, SHUT_RDWR);  // wakes up accept
+  }
+
+  void Work() {
+    for (;;) {
+      Job *job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+        if (queue_.empty()) return;
+        job = queue_.top();
+        queue_.pop();
+        ++running_;
+      }
+      double started = Seconds();
+      bool warm = false;
+      bool ok = Run(job, &warm);
+      double finished = Seconds();
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --running_;
+        if (job->response.status == server::kCancelled) {
+          ++cancelled_;
+        } else {
+          ++(ok ? completed_ : failed_);
+        }
+        ++(warm ? warm_ : cold_);
+        queued_.Add(started - job->submitted);
+        run_.Add(finished - started);
+        total_.Add(finished - job->submitted);
+      }
+      std::lock_guard<std::mutex> lock(job->mutex);
+      job->response.queued = started - job->submitted;
+      job->response.run = finished - started;
+      job->done = true;
+      job->finished.notify_one();
+    }
+  }
+
+  bool Run(Job *job, bool *warm) {
+    if (job->token->cancelled()) return Cancelled(job);
+    if (job->request.rows <= 0 && !ReadImages(job)) {
+      job->response.status = 1;
+      job->message = "cannot read " + job->noisy_path + " or " +
+                     job->guide_path;
+      return false;
+    }
+    if (job->noisy.shape() != job->guide.shape() ||
+        job->noisy.channels() != job->guide.channels()) {
+      job->response.status = 1;
+      job->message = "input and guide must have the same size";
+      return false;
+    }
+    job->params.channels = job->guide.channels();
+    unique_ptr<Denoiser> denoiser = contexts_.Acquire(job->params, warm);
+    denoiser->set_cancellation(job->token);
+    bool completed;
+    if (cache_) {
+      job->out.Resize(job->guide.rows(), job->guide.columns(),
+                      job->guide.channels());
+      completed = da3d::DenoiseCached(denoiser.get(), cache_.get(),
+                                      job->noisy, job->guide,
+                                      job->request.sigma, job->out);
+    } else {
+      completed = denoiser->Denoise(job->noisy, job->guide,
+                                    job->request.sigma, &job->out);
+    }
+    denoiser->set_cancellation(nullptr);
+    contexts_.Release(std::move(denoiser));
+    if (!completed) return Cancelled(job);
+    job->response.rows = job->out.rows();
+    job->response.columns = job->out.columns();
+    job->response.channels = job->out.channels();
+    if (job->request.rows <= 0) {
+      iio_save_image_float_vec(const_cast<char *>(job->out_path.c_str()),
+                               job->out.data(), job->out.columns(),
+                               job->out.rows(), job->out.channels());
+    }
+    return true;
+  }
+
+  static bool Cancelled(Job *job) {
+    job->response.status = server::kCancelled;
+    job->message = "cancelled";
+    return false;
+  }
+
+  static bool ReadImage(const string &path, Image *image) {
+    // iio exits on errors, so unreadable files are rejected first
+    if (path.empty() || access(path.c_str(), R_OK) != 0) return false;
+    int w, h, c;
+    float *data = iio_read_image_float_vec(path.c_str(), &w, &h, &c);
+    if (!data) return false;
+    *image = Image(data, h, w, c);
+    free(data);
+    return true;
+  }
+
+  static bool ReadImages(Job *job) {
+    return ReadImage(job->noisy_path, &job->noisy) &&
+           ReadImage(job->guide_path, &job->guide);
+  }
+
+  string Stats() {
+    std::ostringstream json;
+    std::lock_guard<std::mutex> lock(mutex_);
+    json << "{\"uptime\": " << Seconds() - start_
+         << ", \"received\": " << received_
+         << ", \"completed\": " << completed_ << ", \"failed\": " << failed_
+         << ", \"cancelled\": " << cancelled_
+         << ", \"rejected\": " << rejected_
+         << ", \"queued\": " << queue_.size() << ", \"running\": " << running_
+         << ", \"max_queued\": " << max_queued_
+         << ", \"warm_contexts\": " << warm_
+         << ", \"cold_contexts\": " << cold_
+         << ", \"idle_contexts\": " << contexts_.size()
+         << ", \"pool_threads\": " << pool_->concurrency();
+    if (cache_) {
+      da3d::ResultCache::Stats cache = cache_->stats();
+      json << ", \"cache\": {\"entries\": " << cache_->entries()
+           << ", \"bytes\": " << cache_->bytes()
+           << ", \"hits\": " << cache.hits
+           << ", \"misses\": " << cache.misses
+           << ", \"tile_hits\": " << cache.tile_hits
+           << ", \"tile_misses\": " << cache.tile_misses
+           << ", \"evictions\": " << cache.evictions << "}";
+    }
+    json << ", \"queue_seconds\": " << queued_.Json()
+         << ", \"run_seconds\": " << run_.Json()
+         << ", \"total_seconds\": " << total_.Json() << "}";
+    return json.str();
+  }
+
+  const int listener_;
+  std::shared_ptr<da3d::ThreadPool> pool_;
+  ContextCache contexts_;
+  unique_ptr<da3d::ResultCache> cache_;
+  const double start_;
+  vector<std::thread> workers_;
+
+  std::mutex mutex_;  // guards all the following
+  std::condition_variable ready_;
+  std::priority_queue<Job *, vector<Job *>, JobOrder> queue_;
+  bool stopping_ = false;
+  int64_t sequence_ = 0;
+  int64_t received_ = 0, completed_ = 0, failed_ = 0, cancelled_ = 0;
+  int64_t rejected_ = 0;
+  int64_t warm_ = 0, cold_ = 0;
+  int running_ = 0, max_queued_ = 0;
+  Latencies queued_, run_, total_;
+};
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const char *path = pick_option(&argc, argv, "socket",
+                                 server::kDefaultSocket);
+  int workers = atoi(pick_option(&argc, argv, "workers", "2"));
+  int contexts = atoi(pick_option(&argc, argv, "contexts", "8"));
+  int threads = atoi(pick_option(&argc, argv, "threads", "0"));
+  const char *cache_dir = pick_option(&argc, argv, "cache", "");
+  double cache_mb = atof(pick_option(&argc, argv, "cache_mb", "1024"));
+  if (argc > 1 || workers < 1 || contexts < 1) {
+    fprintf(stderr, "usage: %s [-socket PATH] [-workers N] [-contexts N] "
+                    "[-threads N] [-cache DIR] [-cache_mb MB]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  sockaddr_un address;
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 || !server::SocketAddress(path, &address)) {
+    fprintf(stderr, "cannot create socket %s\n", path);
+    return EXIT_FAILURE;
+  }
+  unlink(path);
+  if (bind(listener, reinterpret_cast<sockaddr *>(&address),
+           sizeof(address)) != 0 || listen(listener, 64) != 0) {
+    fprintf(stderr, "cannot listen on %s\n", path);
+    return EXIT_FAILURE;
+  }
+
+  unique_ptr<da3d::ResultCache> cache;
+  if (cache_dir[0]) {
+    cache.reset(new da3d::ResultCache(
+        cache_dir, static_cast<size_t>(cache_mb * (1 << 20))));
+  }
+  Server daemon(listener, workers, contexts, threads, std::move(cache));
+  fprintf(stderr, "listening on %s, %d workers\n", path, workers);
+  std::mutex mutex;
+  std::condition_variable idle;
+  int connections = 0;
+  while (!daemon.stopping()) {
+    int fd = accept(listener, nullptr, nullptr);
+    if (fd < 0) continue;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++connections;
+    }
+    std::thread([&, fd] {
+      daemon.Handle(fd);
+      std::lock_guard<std::mutex> lock(mutex);
+      --connections;
+      idle.notify_all();
+    }).detach();
+  }
+  close(listener);
+  unlink(path);
+  daemon.Join();
+  std::unique_lock<std::mutex> lock(mutex);
+  idle.wait(lock, [&connections] { return connections == 0; });
+  return EXIT_SUCCESS;
+}
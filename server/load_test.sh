@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# load_test.sh
+#
+# Starts a da3d_server and submits jobs from several concurrent clients, with
+# priorities 0-2 in turn and alternating between paths and images sent
+# through the socket. Prints the throughput, then the statistics of the
+# server, and stops it.
+#
+# usage: load_test.sh noisy guide sigma [clients] [jobs_per_client] [workers]
+# The programs are looked for in $BIN (default: the current directory).
+
+if [ $# -lt 3 ]; then
+  echo "usage: $0 noisy guide sigma [clients] [jobs_per_client] [workers]" >&2
+  exit 1
+fi
+NOISY=$1
+GUIDE=$2
+SIGMA=$3
+CLIENTS=${4:-4}
+JOBS=${5:-8}
+WORKERS=${6:-2}
+BIN=${BIN:-.}
+SOCKET=/tmp/da3d-load-$$.sock
+OUT=$(mktemp -d)
+
+"$BIN/da3d_server" -socket "$SOCKET" -workers "$WORKERS" &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null; rm -rf "$OUT"' EXIT
+while [ ! -S "$SOCKET" ]; do
+  kill -0 $SERVER 2>/dev/null || exit 1
+  sleep .1
+done
+
+client() {
+  i=0
+  while [ "$i" -lt "$JOBS" ]; do
+    send=""
+    [ $(((i + $1) % 2)) -eq 1 ] && send="-send"
+    "$BIN/da3d_client" -socket "$SOCKET" -quiet -priority $((i % 3)) $send \
+        "$NOISY" "$GUIDE" "$SIGMA" "$OUT/out-$1-$i.png" || echo failed >&2
+    i=$((i + 1))
+  done
+}
+
+START=$(date +%s.%N)
+c=0
+PIDS=""
+while [ "$c" -lt "$CLIENTS" ]; do
+  client "$c" &
+  PIDS="$PIDS $!"
+  c=$((c + 1))
+done
+wait $PIDS
+END=$(date +%s.%N)
+
+awk -v c="$CLIENTS" -v j="$JOBS" -v w="$WORKERS" -v s="$START" -v e="$END" \
+    'BEGIN { printf "%d clients x %d jobs, %d workers: %.2f jobs/s\n",
+             c, j, w, c * j / (e - s) }'
+"$BIN/da3d_client" -socket "$SOCKET" -stats
+"$BIN/da3d_client" -socket "$SOCKET" -shutdown
+wait $SERVER